@@ -0,0 +1,164 @@
+#version 430
+
+// This shader is only used in deterministic mode, or when the particles
+// are kept sorted by type. sort_particles places the particles into their
+// tiles with atomics, so the order of the particles inside of a tile
+// changes from run to run, and with it the order in which update_forces
+// sums up the forces. This shader puts the particles of each tile back
+// in a stable order: the order they had in the old particle buffer.
+// sort_particles stores that index in each particle's key. If typeSorted
+// is set the particles are ordered by their type first, so that
+// update_forces sees runs of particles with the same type.
+// The particles are moved from the "new" particle buffers back to the
+// "old" ones, which are no longer needed, and the buffers are then swapped
+// again on the CPU. In compact mode the compact buffer is rewritten in
+// the new order as well. This shader is only run for the active tiles
+// if activeTiles is set, it's the only one that uses their list.
+
+// LOCAL_SIZE is defined by universe.c when it compiles this shader,
+// see autotuneWorkGroupSizes.
+layout (local_size_x=LOCAL_SIZE) in;
+
+struct TileList {
+	int offset;
+	int capacity;
+	int size;
+};
+
+struct HotParticle {
+	float x;
+	float y;
+	int type;
+};
+
+struct ColdParticle {
+	float vx;
+	float vy;
+	int key;
+};
+
+struct CompactParticle {
+	uint pos;  // position relative to the tile origin, 16-bit unorm x and y
+	uint type; // only the low 8 bits are used
+};
+
+layout(std430, binding=0) restrict readonly buffer TILE_LISTS {
+	TileList tileLists[];
+};
+
+layout(std430, binding=1) restrict readonly buffer NEW_HOT_PARTICLES {
+	HotParticle newHotParticles[];
+};
+
+layout(std430, binding=2) restrict writeonly buffer OLD_HOT_PARTICLES {
+	HotParticle oldHotParticles[];
+};
+
+layout(std430, binding=12) restrict readonly buffer NEW_COLD_PARTICLES {
+	ColdParticle newColdParticles[];
+};
+
+layout(std430, binding=13) restrict writeonly buffer OLD_COLD_PARTICLES {
+	ColdParticle oldColdParticles[];
+};
+
+layout(std430, binding=5) restrict writeonly buffer COMPACT_PARTICLES {
+	CompactParticle compactParticles[];
+};
+
+layout(std430, binding=7) restrict readonly buffer ACTIVE_TILES {
+	uint dispatchSize[3];
+	uint numActiveTiles;
+	int activeTileIDs[];
+};
+
+layout(std140, binding=10) uniform UNIFORMS {
+	ivec2 numTiles;
+	float invTileSize;
+	float deltaTime;
+	vec2 size;
+	vec2 center;
+	float friction;
+	float particleRadius;
+	bool wrap;
+	bool typeSorted;
+	bool compact;
+	bool activeTiles;
+	bool packTiles;
+	bool countLanes;
+	int stencilRadius;
+	bool tabulated;
+	float forceTableScale;
+	bool stageInteractions;
+};
+
+// Encode a particle for the force pass, relative to the origin of its tile.
+CompactParticle encodeParticle(HotParticle p, int tileID) {
+	vec2 tileOrigin = vec2(tileID % numTiles.x, tileID / numTiles.x) / invTileSize;
+	CompactParticle c;
+	c.pos = packUnorm2x16((vec2(p.x, p.y) - tileOrigin) * invTileSize);
+	c.type = uint(p.type) & 0xFFu;
+	return c;
+}
+
+shared int keyCache[gl_WorkGroupSize.x];
+shared int typeCache[gl_WorkGroupSize.x];
+
+void main() {
+
+	// This shader is run once for each tile. The keys are unique, so the
+	// new position of a particle in its tile is simply the number of particles
+	// in the tile that come before it. Each thread ranks one particle at a time,
+	// while the keys of the whole tile are streamed through the shared cache.
+
+	int tileID = int(gl_WorkGroupID.y) * numTiles.x + int(gl_WorkGroupID.x);
+	bool idle = false;
+	if (activeTiles) {
+		uint index = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+		idle = index >= numActiveTiles;
+		tileID = idle ? 0 : activeTileIDs[index];
+	}
+	TileList tile = tileLists[tileID];
+	if (idle)
+		tile.size = 0;
+
+	for (int pBase = 0; pBase < tile.size; pBase += int(gl_WorkGroupSize.x)) {
+
+		int pIdx = pBase + int(gl_LocalInvocationID.x);
+		HotParticle p;
+		ColdParticle c;
+		if (pIdx < tile.size) {
+			p = newHotParticles[tile.offset + pIdx];
+			c = newColdParticles[tile.offset + pIdx];
+		}
+		int rank = 0;
+
+		for (int qBase = 0; qBase < tile.size; qBase += int(gl_WorkGroupSize.x)) {
+
+			int qIdx = qBase + int(gl_LocalInvocationID.x);
+			if (qIdx < tile.size) {
+				keyCache[gl_LocalInvocationID.x] = newColdParticles[tile.offset + qIdx].key;
+				typeCache[gl_LocalInvocationID.x] = newHotParticles[tile.offset + qIdx].type;
+			}
+			memoryBarrierShared();
+			barrier();
+
+			int qidMax = min(int(gl_WorkGroupSize.x), tile.size - qBase);
+			if (typeSorted) {
+				for (int qid = 0; qid < qidMax; ++qid)
+					rank += int(typeCache[qid] < p.type || (typeCache[qid] == p.type && keyCache[qid] < c.key));
+			} else {
+				for (int qid = 0; qid < qidMax; ++qid)
+					rank += int(keyCache[qid] < c.key);
+			}
+			barrier();
+		}
+
+		if (pIdx < tile.size) {
+			oldHotParticles[tile.offset + rank] = p;
+			oldColdParticles[tile.offset + rank] = c;
+			if (compact)
+				compactParticles[tile.offset + rank] = encodeParticle(p, tileID);
+		}
+	}
+}
@@ -0,0 +1,81 @@
+#version 430
+
+// This is the first of the 3 passes that calculate the offset into
+// the particle buffer at which each tile stores its particle list.
+// The tiles are split into blocks of TILES_PER_BLOCK tiles, and each
+// workgroup sums up the capacities of the tiles in one block.
+// TILES_PER_BLOCK is defined by universe.c when it compiles this shader.
+// scan_tiles then turns the block sums into block offsets, and
+// setup_tiles calculates the offsets of the tiles within each block.
+
+layout (local_size_x=256) in;
+
+const int tilesPerThread = TILES_PER_BLOCK / int(gl_WorkGroupSize.x);
+
+struct TileList {
+	int offset;
+	int capacity;
+	int size;
+};
+
+layout(std430, binding=0) restrict readonly buffer TILE_LISTS {
+	TileList tileLists[];
+};
+
+layout(std430, binding=6) restrict writeonly buffer TILE_BLOCKS {
+	int blockSums[];
+};
+
+layout(std140, binding=10) uniform UNIFORMS {
+	ivec2 numTiles;
+	float invTileSize;
+	float deltaTime;
+	vec2 size;
+	vec2 center;
+	float friction;
+	float particleRadius;
+	bool wrap;
+	bool typeSorted;
+	bool compact;
+	bool activeTiles;
+	bool packTiles;
+	bool countLanes;
+	int stencilRadius;
+	bool tabulated;
+	float forceTableScale;
+	bool stageInteractions;
+};
+
+shared int partialSums[gl_WorkGroupSize.x];
+
+void main() {
+
+	// Each thread sums up tilesPerThread tiles of the block. The threads
+	// take turns so that neighboring threads read neighboring tiles.
+
+	int id = int(gl_LocalInvocationID.x);
+	int totalTiles = numTiles.x * numTiles.y;
+	int blockStart = int(gl_WorkGroupID.x) * int(gl_WorkGroupSize.x) * tilesPerThread;
+
+	int sum = 0;
+	for (int i = 0; i < tilesPerThread; ++i) {
+		int t = blockStart + i * int(gl_WorkGroupSize.x) + id;
+		if (t < totalTiles)
+			sum += tileLists[t].capacity;
+	}
+	partialSums[id] = sum;
+	memoryBarrierShared();
+	barrier();
+
+	// Add up the sums of all threads in a tree.
+
+	for (int stride = int(gl_WorkGroupSize.x) / 2; stride > 0; stride /= 2) {
+		if (id < stride)
+			partialSums[id] += partialSums[id + stride];
+		memoryBarrierShared();
+		barrier();
+	}
+
+	if (id == 0)
+		blockSums[gl_WorkGroupID.x] = partialSums[0];
+}
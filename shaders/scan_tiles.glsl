@@ -0,0 +1,87 @@
+#version 430
+
+// This is the second of the 3 passes that calculate the tile offsets.
+// It runs as a single workgroup and replaces the sum of each block of
+// tiles from reduce_tiles with the offset of the block, which is the
+// sum of all the blocks before it. There is one block for every
+// 4096 tiles, so even for 4 million tiles this is only about
+// a thousand numbers. It also empties the list of active tiles
+// and the bins of update_forces, which setup_tiles fills in again.
+
+// LOCAL_SIZE is defined by universe.c when it compiles this shader,
+// see autotuneWorkGroupSizes.
+layout (local_size_x=LOCAL_SIZE) in;
+
+layout(std430, binding=6) restrict buffer TILE_BLOCKS {
+	int blockSums[];
+};
+
+layout(std430, binding=7) restrict writeonly buffer ACTIVE_TILES {
+	uint dispatchSize[3]; // the number of workgroups for glDispatchComputeIndirect
+	uint numActiveTiles;
+};
+
+layout(std430, binding=8) restrict writeonly buffer TILE_WORK {
+	uint workDispatchSize[3]; // the number of workgroups of update_forces for glDispatchComputeIndirect
+	uint numWorkGroups;
+	uint binSizes[4];
+};
+
+shared int threadSums[gl_WorkGroupSize.x];
+
+void main() {
+
+	// Assign a fraction of all blocks to each thread.
+	// We want to distribute the work as much as possible, so
+	// each thread gets the same number of blocks + the last
+	// couple of threads might get an extra block if the total
+	// number of threads doesn't evenly divide the number of blocks.
+
+	int id = int(gl_LocalInvocationID.x);
+	if (id == 0) {
+		dispatchSize[0] = 0;
+		dispatchSize[1] = 1;
+		dispatchSize[2] = 1;
+		numActiveTiles = 0;
+	}
+	if (id < 4)
+		binSizes[id] = 0;
+	if (id == 4) {
+		workDispatchSize[0] = 0;
+		workDispatchSize[1] = 1;
+		workDispatchSize[2] = 1;
+		numWorkGroups = 0;
+	}
+
+	int numBlocks = blockSums.length();
+	int workSize = (numBlocks + id) / int(gl_WorkGroupSize.x);
+	int workOffset =
+		(numBlocks / int(gl_WorkGroupSize.x)) * id +
+		max(id - int(gl_WorkGroupSize.x) + numBlocks % int(gl_WorkGroupSize.x), 0);
+
+	int sum = 0;
+	for (int b = workOffset; b < workOffset + workSize; ++b)
+		sum += blockSums[b];
+	threadSums[id] = sum;
+	memoryBarrierShared();
+	barrier();
+
+	// Cumulative sum of the thread sums, doubling the distance each step.
+
+	for (int stride = 1; stride < int(gl_WorkGroupSize.x); stride *= 2) {
+		int other = id >= stride ? threadSums[id - stride] : 0;
+		barrier();
+		threadSums[id] += other;
+		memoryBarrierShared();
+		barrier();
+	}
+
+	// Turn the sums of this thread's blocks into offsets.
+
+	int offset = threadSums[id] - sum;
+	for (int b = workOffset; b < workOffset + workSize; ++b) {
+		int blockSum = blockSums[b];
+		blockSums[b] = offset;
+		offset += blockSum;
+	}
+}
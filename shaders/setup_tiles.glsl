@@ -8,8 +8,37 @@
 // offsets, so once that is done we no longer need them until
 // the next timestep. The sizes need to be reset to 0 so that
 // we can properly sort the particles into tiles later.
+// This is the last of 3 passes: reduce_tiles and scan_tiles
+// have already calculated the offset of every block of tiles.
+// If activeTiles is set, the tiles that will have particles in
+// them are also appended to the list of active tiles, and the
+// indirect dispatch size of order_particles is grown to fit them.
+// universe.c only sets it when order_particles is going to run.
+// The tiles that will have particles in them are also sorted into
+// bins by how many particles they hold, for update_forces. Without
+// packTiles they all go into the last bin, so that every tile gets
+// its own workgroup, and the heavy ones are still split into chunks.
+// LOCAL_SIZE, FORCES_LOCAL_SIZE and TILES_PER_BLOCK are defined by
+// universe.c when it compiles this shader. LOCAL_SIZE is the size of
+// this pass and FORCES_LOCAL_SIZE the one of update_forces, which the
+// bins are laid out for. Both come from autotuneWorkGroupSizes.
 
-layout (local_size_x=64) in;
+layout (local_size_x=LOCAL_SIZE) in;
+
+const int tilesPerThread = TILES_PER_BLOCK / LOCAL_SIZE;
+
+// The number of workgroups that every implementation supports in a dimension of a dispatch.
+// Longer lists of active tiles are dispatched as several rows of this many workgroups.
+const uint maxWorkGroups = 65535u;
+
+// The tiles in the first 3 bins hold at most as many particles as the threads in the slices
+// of the workgroups in update_forces, which are 1/8, 1/4 and 1/2 of its workgroup wide.
+// The tiles in the last bin get a whole workgroup for each chunk of particlesPerThread *
+// FORCES_LOCAL_SIZE particles, so the tiles with more particles than that are split into
+// several items. particlesPerThread has to be the same as in update_forces.glsl.
+const uint binWidths[3] = uint[3](uint(FORCES_LOCAL_SIZE) / 8u, uint(FORCES_LOCAL_SIZE) / 4u, uint(FORCES_LOCAL_SIZE) / 2u);
+const int particlesPerThread = 4;
+const int chunkSize = particlesPerThread * FORCES_LOCAL_SIZE;
 
 struct TileList {
 	int offset;
@@ -21,6 +50,24 @@ layout(std430, binding=0) restrict buffer TILE_LISTS {
 	TileList tileLists[];
 };
 
+layout(std430, binding=6) restrict readonly buffer TILE_BLOCKS {
+	int blockSums[];
+};
+
+layout(std430, binding=7) coherent restrict buffer ACTIVE_TILES {
+	uint dispatchSize[3]; // the number of workgroups for glDispatchComputeIndirect
+	uint numActiveTiles;
+	int activeTileIDs[];
+};
+
+layout(std430, binding=8) coherent restrict buffer TILE_WORK {
+	uint workDispatchSize[3]; // the number of workgroups of update_forces for glDispatchComputeIndirect
+	uint numWorkGroups;       // the number of workgroups that the items of all bins need
+	uint binSizes[4];         // the number of items in each bin
+	uint binStarts[4];        // the index of the first item of each bin, set once on the CPU
+	int workItems[];          // a tile ID for the first 3 bins, and a tile ID and the first particle of the chunk for the last one
+};
+
 layout(std140, binding=10) uniform UNIFORMS {
 	ivec2 numTiles;
 	float invTileSize;
@@ -30,62 +77,166 @@ layout(std140, binding=10) uniform UNIFORMS {
 	float friction;
 	float particleRadius;
 	bool wrap;
+	bool typeSorted;
+	bool compact;
+	bool activeTiles;
+	bool packTiles;
+	bool countLanes;
+	int stencilRadius;
+	bool tabulated;
+	float forceTableScale;
+	bool stageInteractions;
 };
 
-// Each thread processes a local block of 1/64 of all tile lists.
-// The threads first process the local block by calculating the
-// local capacity sum, and offsets of the tiles in this 1/64 tile
-// fraction and storing these in the thread-shared cache. One of
-// the threads then calculates a cumulative sum of the cached offsets.
-// Each thread then calculates the global offset of the local fraction
-// of tiles.
+// Each workgroup processes one block of tiles, and each thread
+// processes tilesPerThread tiles in a row of that block. The
+// threads first calculate the capacity sum of their tiles and
+// store it in the thread-shared cache. The threads then calculate
+// a cumulative sum of the cached sums together, which gives
+// each thread the offset of its tiles within the block.
 
-shared int blockSum[gl_WorkGroupSize.x];
-shared int blockOffset[gl_WorkGroupSize.x];
+shared int threadSums[gl_WorkGroupSize.x];
+shared uint numBlockActive;
+shared uint blockActiveOffset;
+shared uint blockBinSizes[4];
+shared uint blockBinOffsets[4];
+
+// Get the bin of a tile with the given number of particles.
+int getBin(int capacity) {
+	if (!packTiles)
+		return 3;
+	for (int bin = 0; bin < 3; ++bin) {
+		if (capacity <= int(binWidths[bin]))
+			return bin;
+	}
+	return 3;
+}
 
 void main() {
 
-	// Assign a fraction of all tiles to each thread.
-	// We want to distribute the work as much as possible, so
-	// each thread gets the same number of tiles + the last 
-	// couple of threads might get an extra tile of the total
-	// number of threads doesn't evenly divide the number of tiles.
-
-	int totalTiles = numTiles.x * numTiles.y;	
-	int workSize = (totalTiles + int(gl_LocalInvocationID.x)) / int(gl_WorkGroupSize.x);
-	int workOffset =
-		(totalTiles / int(gl_WorkGroupSize.x)) * int(gl_LocalInvocationID.x) +
-		max(int(gl_LocalInvocationID.x) - int(gl_WorkGroupSize.x) + totalTiles % int(gl_WorkGroupSize.x), 0);
-	
 	int id = int(gl_LocalInvocationID.x);
-	int blockStart = workOffset;
-	int blockEnd = workOffset + workSize;
-	
-	// Calculate the capacity sum and offsets for the whole local block.
-	blockSum[id] = 0;
-	for (int t = blockStart; t < blockEnd; ++t) {
-		blockSum[id] += tileLists[t].capacity;
+	int totalTiles = numTiles.x * numTiles.y;
+	int blockStart = int(gl_WorkGroupID.x) * int(gl_WorkGroupSize.x) * tilesPerThread;
+	int tileStart = blockStart + id * tilesPerThread;
+	int tileEnd = min(tileStart + tilesPerThread, totalTiles);
+
+	int capacities[tilesPerThread];
+	int sum = 0;
+	for (int t = tileStart; t < tileEnd; ++t) {
+		capacities[t - tileStart] = tileLists[t].capacity;
+		sum += capacities[t - tileStart];
+	}
+	threadSums[id] = sum;
+	memoryBarrierShared();
+	barrier();
+
+	// Cumulative sum of the thread sums, doubling the distance each step.
+
+	for (int stride = 1; stride < int(gl_WorkGroupSize.x); stride *= 2) {
+		int other = id >= stride ? threadSums[id - stride] : 0;
+		barrier();
+		threadSums[id] += other;
+		memoryBarrierShared();
+		barrier();
+	}
+
+	// Calculate the global offset for the local tiles and reset the capacity and size to 0.
+
+	int offset = blockSums[gl_WorkGroupID.x] + threadSums[id] - sum;
+	for (int t = tileStart; t < tileEnd; ++t) {
+		tileLists[t].offset = offset;
+		tileLists[t].capacity = 0;
 		tileLists[t].size = 0;
-	}	
+		offset += capacities[t - tileStart];
+	}
+
+	// Append the active tiles of the block to the list. Each thread reserves room for its tiles
+	// in the block's part of the list, and one thread reserves the block's part in the whole list.
+
+	if (activeTiles) {
+		if (id == 0)
+			numBlockActive = 0;
+		memoryBarrierShared();
+		barrier();
+
+		uint numActive = 0;
+		for (int t = tileStart; t < tileEnd; ++t)
+			numActive += uint(capacities[t - tileStart] > 0);
+		uint threadOffset = atomicAdd(numBlockActive, numActive);
+		memoryBarrierShared();
+		barrier();
+
+		if (id == 0 && numBlockActive > 0) {
+			blockActiveOffset = atomicAdd(numActiveTiles, numBlockActive);
+			uint end = blockActiveOffset + numBlockActive;
+			atomicMax(dispatchSize[0], min(end, maxWorkGroups));
+			atomicMax(dispatchSize[1], (end + maxWorkGroups - 1u) / maxWorkGroups);
+		}
+		memoryBarrierShared();
+		barrier();
+
+		uint index = blockActiveOffset + threadOffset;
+		for (int t = tileStart; t < tileEnd; ++t) {
+			if (capacities[t - tileStart] > 0)
+				activeTileIDs[index++] = t;
+		}
+	}
+
+	// Append the items of the block to the bins the same way. The workgroups of update_forces
+	// process the bins one after the other, so every item that starts a new workgroup of its
+	// bin grows the total number of workgroups, and with it the indirect dispatch size.
+
+	if (id < 4)
+		blockBinSizes[id] = 0;
 	memoryBarrierShared();
 	barrier();
-	
-	// One thread does a cumulative sum of the block offsets.
-	
-	if (id == 0) {
-		blockOffset[0] = 0;
-		for (int b = 1; b < gl_WorkGroupSize.x; ++b)
-			blockOffset[b] = blockOffset[b - 1] + blockSum[b - 1];
+
+	uint threadBinOffsets[4] = uint[4](0u, 0u, 0u, 0u);
+	for (int t = tileStart; t < tileEnd; ++t) {
+		int capacity = capacities[t - tileStart];
+		if (capacity > 0) {
+			int bin = getBin(capacity);
+			threadBinOffsets[bin] += bin < 3 ? 1u : uint((capacity + chunkSize - 1) / chunkSize);
+		}
+	}
+	for (int bin = 0; bin < 4; ++bin) {
+		if (threadBinOffsets[bin] > 0)
+			threadBinOffsets[bin] = atomicAdd(blockBinSizes[bin], threadBinOffsets[bin]);
 	}
 	memoryBarrierShared();
 	barrier();
-	
-	// Calculate the global offset for the local block and reset the capacity to 0.
-	
-	tileLists[blockStart].offset = blockOffset[id];
-	for (int t = blockStart + 1; t < blockEnd; ++t) {
-		tileLists[t].offset = tileLists[t - 1].offset + tileLists[t - 1].capacity;
-		tileLists[t - 1].capacity = 0;
+
+	if (id < 4 && blockBinSizes[id] > 0) {
+		uint itemsPerGroup = id < 3 ? uint(FORCES_LOCAL_SIZE) / binWidths[id] : 1u;
+		uint start = atomicAdd(binSizes[id], blockBinSizes[id]);
+		uint end = start + blockBinSizes[id];
+		uint newGroups = (end + itemsPerGroup - 1u) / itemsPerGroup - (start + itemsPerGroup - 1u) / itemsPerGroup;
+		blockBinOffsets[id] = start;
+		if (newGroups > 0) {
+			uint groupsEnd = atomicAdd(numWorkGroups, newGroups) + newGroups;
+			atomicMax(workDispatchSize[0], min(groupsEnd, maxWorkGroups));
+			atomicMax(workDispatchSize[1], (groupsEnd + maxWorkGroups - 1u) / maxWorkGroups);
+		}
+	}
+	memoryBarrierShared();
+	barrier();
+
+	for (int t = tileStart; t < tileEnd; ++t) {
+		int capacity = capacities[t - tileStart];
+		if (capacity <= 0)
+			continue;
+		int bin = getBin(capacity);
+		uint item = blockBinOffsets[bin] + threadBinOffsets[bin];
+		if (bin < 3) {
+			workItems[binStarts[bin] + item] = t;
+			++threadBinOffsets[bin];
+		} else {
+			for (int first = 0; first < capacity; first += chunkSize) {
+				workItems[binStarts[bin] + 2 * item] = t;
+				workItems[binStarts[bin] + 2 * item + 1] = first;
+				++item;
+				++threadBinOffsets[bin];
+			}
+		}
 	}
-	tileLists[blockEnd - 1].capacity = 0;
-}
\ No newline at end of file
+}
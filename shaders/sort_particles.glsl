@@ -2,10 +2,14 @@
 
 // This compute shader sorts all of the particles into tiles
 // based on the position of the particle. The particles are moved
-// from the "old" particle buffer (back-buffer) to the "new" 
-// particle buffer (front-buffer).
+// from the "old" particle buffers (back-buffers) to the "new" 
+// particle buffers (front-buffers), both the hot and the cold
+// ones. In compact mode the particles are also encoded into the
+// compact buffer read by update_forces.
 
-layout (local_size_x=256) in;
+// LOCAL_SIZE is defined by universe.c when it compiles this shader,
+// see autotuneWorkGroupSizes.
+layout (local_size_x=LOCAL_SIZE) in;
 
 struct TileList {
 	int offset;
@@ -13,22 +17,45 @@ struct TileList {
 	int size;
 };
 
-struct Particle {
-	vec2 pos;
-	vec2 vel;
+struct HotParticle {
+	float x;
+	float y;
 	int type;
 };
 
+struct ColdParticle {
+	float vx;
+	float vy;
+	int key; // index in the old buffer, used by order_particles
+};
+
+struct CompactParticle {
+	uint pos;  // position relative to the tile origin, 16-bit unorm x and y
+	uint type; // only the low 8 bits are used
+};
+
 layout(std430, binding=0) coherent restrict buffer TILE_LISTS {
 	TileList tileLists[];
 };
 
-layout(std430, binding=1) restrict writeonly buffer NEW_PARTICLES {
-	Particle newParticles[];
+layout(std430, binding=1) restrict writeonly buffer NEW_HOT_PARTICLES {
+	HotParticle newHotParticles[];
+};
+
+layout(std430, binding=2) restrict readonly buffer OLD_HOT_PARTICLES {
+	HotParticle oldHotParticles[];
 };
 
-layout(std430, binding=2) restrict readonly buffer OLD_PARTICLES {
-	Particle oldParticles[];
+layout(std430, binding=12) restrict writeonly buffer NEW_COLD_PARTICLES {
+	ColdParticle newColdParticles[];
+};
+
+layout(std430, binding=13) restrict readonly buffer OLD_COLD_PARTICLES {
+	ColdParticle oldColdParticles[];
+};
+
+layout(std430, binding=5) restrict writeonly buffer COMPACT_PARTICLES {
+	CompactParticle compactParticles[];
 };
 
 layout(std140, binding=10) uniform UNIFORMS {
@@ -40,23 +67,46 @@ layout(std140, binding=10) uniform UNIFORMS {
 	float friction;
 	float particleRadius;
 	bool wrap;
+	bool typeSorted;
+	bool compact;
+	bool activeTiles;
+	bool packTiles;
+	bool countLanes;
+	int stencilRadius;
+	bool tabulated;
+	float forceTableScale;
+	bool stageInteractions;
 };
 
+// Encode a particle for the force pass, relative to the origin of its tile.
+CompactParticle encodeParticle(HotParticle p, int tileID) {
+	vec2 tileOrigin = vec2(tileID % numTiles.x, tileID / numTiles.x) / invTileSize;
+	CompactParticle c;
+	c.pos = packUnorm2x16((vec2(p.x, p.y) - tileOrigin) * invTileSize);
+	c.type = uint(p.type) & 0xFFu;
+	return c;
+}
+
 void main() {
 
 	// Each global thread ID corresponds to a single particle.
 	int id = int(gl_GlobalInvocationID.x);
-	if (id >= oldParticles.length())
+	if (id >= oldHotParticles.length())
 		return;
 		
-	Particle p = oldParticles[id];
+	HotParticle p = oldHotParticles[id];
+	ColdParticle c = oldColdParticles[id];
+	c.key = id;
 	
 	// Get which tile this particle belongs to.
-	ivec2 tilePos = ivec2(p.pos * invTileSize);
+	ivec2 tilePos = ivec2(vec2(p.x, p.y) * invTileSize);
 	int tileID = clamp(tilePos.y * numTiles.x + tilePos.x, 0, tileLists.length() - 1);
 	
 	// Place the particle in its tile.
 	int address = atomicAdd(tileLists[tileID].size, 1);
 	memoryBarrier(); // <<--- Is this necessary???
-	newParticles[tileLists[tileID].offset + address] = p;
+	newHotParticles[tileLists[tileID].offset + address] = p;
+	newColdParticles[tileLists[tileID].offset + address] = c;
+	if (compact)
+		compactParticles[tileLists[tileID].offset + address] = encodeParticle(p, tileID);
 }
\ No newline at end of file
@@ -2,10 +2,43 @@
 
 // Calculate the forces enacted on each particle and then update
 // the velocity of the particles based on that force.
-// This shader is run once for each tile and only processes the
-// forces and velocities for the particles in that tile only.
+// Each slice of a workgroup only processes the forces and velocities
+// for the particles of one tile. setup_tiles lists the tiles that have
+// particles in them, because the empty tiles have nothing to update.
+// If packTiles is set, setup_tiles has sorted them into bins by how
+// many particles they hold, and the workgroup is split into slices
+// that each process one tile: 8 slices of LOCAL_SIZE / 8 threads for
+// the lightest tiles, up to a single slice of the whole workgroup.
+// Otherwise every tile gets a whole workgroup. Either way, tiles with more particles than a
+// workgroup keeps in its registers are split into chunks, which are
+// processed by separate workgroups.
+// In compact mode the neighboring particles are read from the compact
+// buffer written by sort_particles, which only holds their position
+// relative to their tile and their type.
+// The tiles can be a fraction 1/stencilRadius of the largest interaction
+// radius, in which case the neighbors come from a block of
+// 2*stencilRadius+1 tiles on each side instead of a 3x3 block. The tiles
+// in the corners of that block that are entirely out of reach of the
+// tile are left out, so the block is closer to a disk.
+// The particles are split into a hot and a cold stream. The neighbors are
+// read from the hot one, which only holds their position and type, and
+// the velocity in the cold one is only touched for the particles of the
+// tile itself.
+// If tabulated is set the force of each pair of particles is looked up in
+// a table of every pair of types, which doesn't need any branches.
+// simulateTimestep samples it from calcForce again before the first
+// tabulated timestep after the interactions have changed.
+// If stageInteractions is set and there are few enough particle types,
+// the workgroup loads the whole interaction matrix into shared memory once,
+// together with the squared maximum radius of each pair, so that the pairs
+// don't have to read their interaction from the buffer.
+// WRAP, NUM_PARTICLE_TYPES and LOCAL_SIZE are defined by universe.c when
+// it compiles this shader, so there is a separate program for every
+// combination of them, and the compiler can leave out whatever doesn't
+// apply. LOCAL_SIZE comes from autotuneWorkGroupSizes, and setup_tiles
+// is compiled with the same one, so that it bins the tiles to match.
 
-layout (local_size_x=256) in;
+layout (local_size_x=LOCAL_SIZE) in;
 
 struct TileList {
 	int offset;
@@ -13,12 +46,25 @@ struct TileList {
 	int size;
 };
 
-struct Particle {
-	vec2 pos;
-	vec2 vel;
+// These are plain floats rather than vec2s, so that each particle takes up
+// 12 bytes in each stream instead of being padded out to 16.
+struct HotParticle {
+	float x;
+	float y;
 	int type;
 };
 
+struct ColdParticle {
+	float vx;
+	float vy;
+	int key;
+};
+
+struct CompactParticle {
+	uint pos;  // position relative to the tile origin, 16-bit unorm x and y
+	uint type; // only the low 8 bits are used
+};
+
 struct ParticleType {
 	vec3 color;
 };
@@ -38,14 +84,23 @@ layout(std140, binding=10) uniform UNIFORMS {
 	float friction;
 	float particleRadius;
 	bool wrap;
+	bool typeSorted;
+	bool compact;
+	bool activeTiles;
+	bool packTiles;
+	bool countLanes;
+	int stencilRadius;
+	bool tabulated;
+	float forceTableScale;
+	bool stageInteractions;
 };
 
-layout(std430, binding=0) coherent restrict buffer TILE_LISTS {
+layout(std430, binding=0) restrict readonly buffer TILE_LISTS {
 	TileList tileLists[];
 };
 
-layout(std430, binding=1) restrict buffer NEW_PARTICLES {
-	Particle particles[];
+layout(std430, binding=1) restrict readonly buffer NEW_HOT_PARTICLES {
+	HotParticle hotParticles[];
 };
 
 layout(std430, binding=3) restrict readonly buffer PARTICLE_TYPES {
@@ -56,114 +111,368 @@ layout(std430, binding=4) restrict readonly buffer PARTICLE_INTERACTIONS {
 	ParticleInteraction interactions[];
 };
 
-vec2 calcForce(vec2 ppos, vec2 qpos, ParticleInteraction interaction) {
+layout(std430, binding=5) restrict readonly buffer COMPACT_PARTICLES {
+	CompactParticle compactParticles[];
+};
+
+layout(std430, binding=8) restrict readonly buffer TILE_WORK {
+	uint workDispatchSize[3];
+	uint numWorkGroups;
+	uint binSizes[4];
+	uint binStarts[4];
+	int workItems[];
+};
+
+layout(std430, binding=9) restrict buffer LANE_COUNTERS {
+	uint laneCounters[6]; // pairs evaluated, lane slots and pairs in range, each as a 64-bit number with the low word first
+};
+
+layout(std430, binding=11) restrict readonly buffer FORCE_TABLE {
+	vec2 forceTable[]; // the force times the distance, and how much that changes until the next sample
+};
+
+layout(std430, binding=12) restrict buffer NEW_COLD_PARTICLES {
+	ColdParticle coldParticles[];
+};
+
+// The interaction is the attraction, the minimum radius, the maximum radius and the maximum radius squared.
+vec2 calcForce(vec2 ppos, vec2 qpos, vec4 interaction) {
 	vec2 dpos = qpos - ppos;
-	if (wrap) {
-		dpos += size * vec2(lessThan(dpos, -center));
-		dpos -= size * vec2(greaterThan(dpos, center));
-	}
+#if WRAP
+	dpos += size * vec2(lessThan(dpos, -center));
+	dpos -= size * vec2(greaterThan(dpos, center));
+#endif
 
 	float r2 = dot(dpos, dpos);
-	float minr = interaction.minRadius;
-	float maxr = interaction.maxRadius;
-	if (r2 > maxr * maxr || r2 < 0.001) {
+	float minr = interaction.y;
+	float maxr = interaction.z;
+	if (r2 > interaction.w || r2 < 0.001) {
 		return vec2(0);
 	}
 
 	float r = sqrt(r2);
 	if (r > minr) {
-		return dpos / r * interaction.attraction * (min(abs(r - minr), abs(r - maxr)));
+		return dpos / r * interaction.x * (min(abs(r - minr), abs(r - maxr)));
 	} else {
 		return -dpos * (minr - r) / (r * (0.5 + minr * r));
 	}
 }
 
-shared TileList tileCache[3][3];
+// The number of samples in each row of the force table, these have to be the same as FORCE_TABLE_SIZE and
+// NEAR_FORCE_TABLE_SIZE in universe.c.
+const int forceTableSize = 1024;
+const int nearForceTableSize = 128;
+const int forceTableStride = forceTableSize + nearForceTableSize;
+
+// Look up the force in the given row of the force table. The samples are spaced evenly over the squared
+// distance up to the largest interaction radius, and the last sample of each row is 0. The distance is
+// clamped to the last sample, so the pairs that are out of range get no force without any branches.
+// The table holds the force times the distance, so dividing it by the squared distance gives the factor
+// that the difference of the positions is scaled by. Before the second sample the repulsion rises from 0
+// much faster than the samples are spaced, so those pairs look up the finer samples at the end of the row
+// instead, which are spaced evenly over the square root of the distance, so they are densest where the
+// repulsion bends. Like calcForce, the pairs that are almost on top of each other get no force, which
+// also keeps a particle from getting a force from itself.
+vec2 calcTabulatedForce(vec2 ppos, vec2 qpos, int row) {
+	vec2 dpos = qpos - ppos;
+#if WRAP
+	dpos += size * vec2(lessThan(dpos, -center));
+	dpos -= size * vec2(greaterThan(dpos, center));
+#endif
+
+	float r2 = dot(dpos, dpos);
+	float x = min(r2 * forceTableScale, float(forceTableSize - 1));
+	x = x < 1.0 ? float(forceTableSize) + sqrt(sqrt(x)) * float(nearForceTableSize) : x;
+	int i = int(x);
+	vec2 entry = forceTable[row + i];
+	return r2 < 0.001 ? vec2(0) : dpos * ((entry.x + (x - float(i)) * entry.y) / r2);
+}
+
+void addToCounter(int counter, uint value) {
+	uint low = atomicAdd(laneCounters[2 * counter], value);
+	if (low + value < low)
+		atomicAdd(laneCounters[2 * counter + 1], 1u);
+}
+
+// How many of the tile's particles each thread keeps in registers during one sweep over the block of neighbors.
+const int particlesPerThread = 4;
+
+// The largest block of neighboring tiles, for a stencilRadius of 4.
+const int maxStencilWidth = 9;
+const int maxStencilTiles = maxStencilWidth * maxStencilWidth;
+
+// The width of the slices in each bin of setup_tiles, the same as binWidths there. The last bin
+// holds the tiles that need the whole workgroup, one chunk of a tile at a time.
+const int maxSlices = 8;
+const int binWidths[4] = int[4](LOCAL_SIZE / maxSlices, LOCAL_SIZE / 4, LOCAL_SIZE / 2, LOCAL_SIZE);
+
+shared int sliceTile[maxSlices];
+shared int sliceFirst[maxSlices];
+shared int sliceCount[maxSlices];
+shared int neighborOffset[maxSlices][maxStencilTiles];
+shared int neighborStart[maxSlices][maxStencilTiles + 1];
+shared vec2 neighborOrigin[maxSlices][maxStencilTiles];
 shared vec2 qPosCache[gl_WorkGroupSize.x];
 shared int qTypeCache[gl_WorkGroupSize.x];
-shared int numParticleTypes;
+const int numParticleTypes = NUM_PARTICLE_TYPES;
+
+// The interaction matrix is only staged in shared memory for up to this many particle types.
+// More than that would take up too much of the shared memory that the rest of the pass needs.
+const int maxStagedTypes = 16;
+const bool canStage = numParticleTypes <= maxStagedTypes;
+
+shared vec4 stagedInteractions[canStage ? numParticleTypes * numParticleTypes : 1];
+
+vec4 expandInteraction(ParticleInteraction interaction) {
+	return vec4(interaction.attraction, interaction.minRadius, interaction.maxRadius, interaction.maxRadius * interaction.maxRadius);
+}
+
+// Get the interaction at the given index of the matrix, from shared memory if it has been staged there.
+vec4 loadInteraction(bool staged, int index) {
+	return staged ? stagedInteractions[index] : expandInteraction(interactions[index]);
+}
 
 void main() {
 
-	ivec2 tilePos = ivec2(gl_WorkGroupID.x, gl_WorkGroupID.y);
-	int tileID = tilePos.y * numTiles.x + tilePos.x;
-	tileLists[tileID].capacity = 0;
+	int id = int(gl_LocalInvocationID.x);
+	uint groupIndex = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+
+	// Find the bin of this workgroup. The workgroups of the bins come one after the
+	// other, and each of them processes as many items of its bin as it has slices.
+	// Without packTiles the first 3 bins are empty.
+	int bin;
+	uint groupStart = 0;
+	for (bin = 0; bin < 3; ++bin) {
+		uint itemsPerGroup = gl_WorkGroupSize.x / uint(binWidths[bin]);
+		uint binGroups = (binSizes[bin] + itemsPerGroup - 1) / itemsPerGroup;
+		if (groupIndex < groupStart + binGroups)
+			break;
+		groupStart += binGroups;
+	}
+	uint firstItem = (groupIndex - groupStart) * (gl_WorkGroupSize.x / uint(binWidths[bin]));
+
+	int sliceWidth = binWidths[bin];
+	int numSlices = int(gl_WorkGroupSize.x) / sliceWidth;
+	int slice = id / sliceWidth;
+	int lane = id % sliceWidth;
+	int sliceSweep = particlesPerThread * sliceWidth;
+
+	// This is the same for the whole dispatch, so the branches on it don't diverge.
+	bool staged = canStage && stageInteractions && !tabulated;
+	if (staged) {
+		for (int k = id; k < numParticleTypes * numParticleTypes; k += int(gl_WorkGroupSize.x))
+			stagedInteractions[k] = expandInteraction(interactions[k]);
+	}
+
+	// Find the tile and the range of its particles that each slice processes. The bins are
+	// dispatched in rows, so the last row can have a couple of workgroups left over, and the
+	// last workgroup of a bin can have some slices left over. These get an empty range of particles.
+
+	if (id < numSlices) {
+		int tileID = 0;
+		int first = 0;
+		int count = 0;
+		uint item = firstItem + uint(id);
+		if (item < binSizes[bin] && bin < 3) {
+			tileID = workItems[binStarts[bin] + item];
+			count = tileLists[tileID].size;
+		} else if (item < binSizes[bin]) {
+			tileID = workItems[binStarts[bin] + 2 * item];
+			first = workItems[binStarts[bin] + 2 * item + 1];
+			count = min(tileLists[tileID].size - first, sliceSweep);
+		}
+		sliceTile[id] = tileID;
+		sliceFirst[id] = first;
+		sliceCount[id] = count;
+	}
+
+	memoryBarrierShared();
+	barrier();
 
-	if (gl_LocalInvocationID.x == 0)
-		numParticleTypes = particleTypes.length();
+	int stencilWidth = 2 * stencilRadius + 1;
+	int stencilTiles = stencilWidth * stencilWidth;
 
-	if (gl_LocalInvocationID.x < 9) {
-		// 9 threads will load the data for the neighboring tiles in a 3x3
-		// block and store it into the shared memory cache so that we don't
-		// have to keep loading these from global memory.
-		int dx = int(gl_LocalInvocationID.x) % 3;
-		int dy = int(gl_LocalInvocationID.x) / 3;
-		ivec2 neighborPos = tilePos + ivec2(dx - 1, dy - 1);
+	for (int k = id; k < numSlices * stencilTiles; k += int(gl_WorkGroupSize.x)) {
+		// The threads of the workgroup load the data for the neighboring tiles of
+		// every slice and store it into the shared memory cache so that we don't
+		// have to keep loading these from global memory. A tile in the block is
+		// out of reach if even its nearest point is further than stencilRadius
+		// tiles away from the nearest point of the slice's tile. These tiles are
+		// treated as empty.
+		int s = k / stencilTiles;
+		int n = k % stencilTiles;
+		ivec2 d = ivec2(n % stencilWidth, n / stencilWidth) - stencilRadius;
+		ivec2 gap = max(abs(d) - 1, 0);
+		bool inReach = gap.x * gap.x + gap.y * gap.y <= stencilRadius * stencilRadius;
+		ivec2 tilePos = ivec2(sliceTile[s] % numTiles.x, sliceTile[s] / numTiles.x);
+		ivec2 neighborPos = tilePos + d;
 		// Wrap the tile position.
 		neighborPos += numTiles * ivec2(lessThan(neighborPos, ivec2(0)));
 		neighborPos -= numTiles * ivec2(greaterThanEqual(neighborPos, numTiles));
 		int neighborID = clamp(neighborPos.y * numTiles.x + neighborPos.x, 0, tileLists.length() - 1);
-		tileCache[dy][dx] = tileLists[neighborID];
+		TileList neighbor = tileLists[neighborID];
+		neighborOffset[s][n] = neighbor.offset;
+		neighborStart[s][n + 1] = sliceCount[s] > 0 && inReach ? neighbor.size : 0;
+		neighborOrigin[s][n] = vec2(neighborID % numTiles.x, neighborID / numTiles.x) / invTileSize;
 	}
 
 	memoryBarrierShared();
 	barrier();
 
-	// Assign a fraction of all particles to each thread.
-	// We want to distribute the work as much as possible, so
-	// each thread gets the same number of particles + the last 
-	// couple of threads might get an extra particles if the total
-	// number of threads doesn't evenly divide the number of particles.
-
-	TileList tile = tileCache[1][1];
-	int workSize = (tile.size + int(gl_LocalInvocationID.x)) / int(gl_WorkGroupSize.x);
-	int workOffset = tile.offset + 
-		(tile.size / int(gl_WorkGroupSize.x)) * int(gl_LocalInvocationID.x) +
-		max(int(gl_LocalInvocationID.x) - int(gl_WorkGroupSize.x) + tile.size % int(gl_WorkGroupSize.x), 0);
-	
-	// Loop through all the 3x3 neighboring tiles and calculate the forces for each interaction.
-
-	for (int dy = 0; dy < 3; ++dy) {
-		for (int dx = 0; dx < 3; ++dx) {
-
-			TileList neighbor = tileCache[dy][dx];
-
-			// In order to avoid loading particles from the neighboring tile over and over from global memory
-			// each thread loads a single particle from the neighboring tile into a local cache. Only the interactions
-			// with the cached particles are processed, and then the next batch of neighboring particles is cached again.
-			// There is a tradeoff here, because processing the neighbor particles in blocks like this means
-			// we have to load the actual particles we are working with more often.
-
-			// Loop until all neighboring particles were processed
-			for (int qBase = 0; qBase < neighbor.size + int(gl_WorkGroupSize.x); qBase += int(gl_WorkGroupSize.x)) {
-
-				// Load the neighboring particles into the cache.
-				int qIdx = qBase + int(gl_LocalInvocationID.x);
-				if (qIdx < neighbor.size) {
-				
-					Particle q = particles[neighbor.offset + qIdx];
-					qPosCache[gl_LocalInvocationID.x] = q.pos;
-					qTypeCache[gl_LocalInvocationID.x] = q.type;
-				}
-				memoryBarrierShared();
-				barrier();
+	// The neighbors of each slice are treated as one list, with the tiles of the block one after
+	// the other. Turn the sizes of the tiles into the index of their first particle in that list.
+
+	if (id < numSlices) {
+		neighborStart[id][0] = 0;
+		for (int n = 0; n < stencilTiles; ++n)
+			neighborStart[id][n + 1] += neighborStart[id][n];
+	}
+
+	memoryBarrierShared();
+	barrier();
+
+	// All slices go through the same number of batches, so that they stay in step at the
+	// barriers. The slices that are done sooner just skip the work of the rest.
+
+	int numBatches = 0;
+	for (int s = 0; s < numSlices; ++s)
+		numBatches = max(numBatches, (neighborStart[s][stencilTiles] + sliceWidth - 1) / sliceWidth);
+
+	int tileOffset = neighborOffset[slice][stencilTiles / 2] + sliceFirst[slice];
+	int tileCount = sliceCount[slice];
+	int numNeighbors = neighborStart[slice][stencilTiles];
+
+	// Each thread keeps up to particlesPerThread of the slice's particles in registers:
+	// their position, their row of the interaction matrix, and the force summed up so far.
+	// The velocity is only updated once, after the whole block of neighbors has been processed.
+	// The particles are assigned round-robin, so neighboring threads load neighboring particles.
+	// setup_tiles splits the tiles with more than particlesPerThread * LOCAL_SIZE particles into chunks
+	// of that many, so the slice's particles always fit into the registers of its threads.
 
-				// Calculate the particle interactions with the cached neighboring particles.
-				int qidMax = min(int(gl_WorkGroupSize.x), neighbor.size - qBase);
-				for (int address = workOffset; address < workOffset + workSize; ++address) {
+	int numOwned = 0;
+	vec2 pPos[particlesPerThread];
+	int pOffset[particlesPerThread];
+	vec2 pForce[particlesPerThread];
+	uint inRange = 0;
+	for (int i = 0; i < particlesPerThread; ++i) {
+		int pIdx = i * sliceWidth + lane;
+		if (pIdx < tileCount) {
+			HotParticle p = hotParticles[tileOffset + pIdx];
+			pPos[i] = vec2(p.x, p.y);
+			pOffset[i] = p.type * numParticleTypes;
+			pForce[i] = vec2(0);
+			numOwned = i + 1;
+		}
+	}
+
+	// In order to avoid loading particles from the neighboring tiles over and over from global memory
+	// each thread loads a single neighboring particle into its slice of a local cache. Only the interactions
+	// with the cached particles are processed, and then the next batch of neighboring particles is cached again.
 
-					Particle p = particles[address];
-					int pOffset = p.type * numParticleTypes;
-					vec2 f = vec2(0);
+	for (int batch = 0; batch < numBatches; ++batch) {
 
-					for (int qid = 0; qid < qidMax; ++qid) {
-						ParticleInteraction interaction = interactions[pOffset + qTypeCache[qid]];
-						f += calcForce(p.pos, qPosCache[qid], interaction);	
-					}
+		// Load the neighboring particles into the cache.
+		int qIdx = batch * sliceWidth + lane;
+		if (qIdx < numNeighbors) {
+
+			// Find the tile of the neighbor, the last one that starts at or before it.
+			// Tiles that are empty or out of reach start at the same index as the next one.
+			// The steps of the search add up to more than the largest block of tiles.
+			int n = 0;
+			for (int step = 64; step > 0; step /= 2) {
+				if (n + step < stencilTiles && neighborStart[slice][n + step] <= qIdx)
+					n += step;
+			}
+			int address = neighborOffset[slice][n] + qIdx - neighborStart[slice][n];
 
-					particles[address].vel += deltaTime * f;
+			if (compact) {
+				CompactParticle q = compactParticles[address];
+				qPosCache[id] = neighborOrigin[slice][n] + unpackUnorm2x16(q.pos) / invTileSize;
+				qTypeCache[id] = int(q.type);
+			} else {
+				HotParticle q = hotParticles[address];
+				qPosCache[id] = vec2(q.x, q.y);
+				qTypeCache[id] = q.type;
+			}
+		}
+		memoryBarrierShared();
+		barrier();
+
+		// Calculate the particle interactions with the cached neighboring particles of this slice.
+		int qidMin = slice * sliceWidth;
+		int qidMax = qidMin + clamp(numNeighbors - batch * sliceWidth, 0, sliceWidth);
+		for (int i = 0; i < numOwned; ++i) {
+
+			vec2 f = vec2(0);
+
+			if (tabulated) {
+				// The row of the force table is just an index, so the runs of typeSorted don't matter here.
+				for (int qid = qidMin; qid < qidMax; ++qid)
+					f += calcTabulatedForce(pPos[i], qPosCache[qid], (pOffset[i] + qTypeCache[qid]) * forceTableStride);
+			} else if (typeSorted) {
+				// The tiles are sorted by type, so the cached neighbors come in runs of the
+				// same type. Only load the interaction once at the start of each run.
+				int qid = qidMin;
+				while (qid < qidMax) {
+					int qType = qTypeCache[qid];
+					vec4 interaction = loadInteraction(staged, pOffset[i] + qType);
+					for (; qid < qidMax && qTypeCache[qid] == qType; ++qid)
+						f += calcForce(pPos[i], qPosCache[qid], interaction);
+				}
+			} else {
+				for (int qid = qidMin; qid < qidMax; ++qid) {
+					vec4 interaction = loadInteraction(staged, pOffset[i] + qTypeCache[qid]);
+					f += calcForce(pPos[i], qPosCache[qid], interaction);
+				}
+			}
+
+			pForce[i] += f;
+
+			// Count the cached neighbors that are within the largest interaction radius,
+			// which is stencilRadius tiles. This is what the disk around the particle holds.
+			if (countLanes) {
+				float maxDistance = float(stencilRadius) / invTileSize;
+				for (int qid = qidMin; qid < qidMax; ++qid) {
+					vec2 dpos = qPosCache[qid] - pPos[i];
+#if WRAP
+					dpos += size * vec2(lessThan(dpos, -center));
+					dpos -= size * vec2(greaterThan(dpos, center));
+#endif
+					inRange += uint(dot(dpos, dpos) <= maxDistance * maxDistance);
 				}
 			}
 		}
+
+		// Wait until everyone is done with the cache before it is overwritten.
+		barrier();
+	}
+
+	for (int i = 0; i < numOwned; ++i) {
+		int pIdx = i * sliceWidth + lane;
+		coldParticles[tileOffset + pIdx].vx += deltaTime * pForce[i].x;
+		coldParticles[tileOffset + pIdx].vy += deltaTime * pForce[i].y;
+	}
+
+	// Count the pairs of particles that were evaluated, and how many lane slots the workgroup
+	// spent on them. In each batch every lane of the workgroup waits for the busiest lane.
+
+	if (countLanes && inRange > 0)
+		addToCounter(2, inRange);
+
+	if (countLanes && id == 0) {
+		uint pairs = 0;
+		uint slots = 0;
+		for (int batch = 0; batch < numBatches; ++batch) {
+			int maxPairs = 0;
+			for (int s = 0; s < numSlices; ++s) {
+				int owned = sliceCount[s];
+				int cached = clamp(neighborStart[s][stencilTiles] - batch * sliceWidth, 0, sliceWidth);
+				maxPairs = max(maxPairs, min((owned + sliceWidth - 1) / sliceWidth, particlesPerThread) * cached);
+				pairs += uint(owned * cached);
+			}
+			slots += uint(maxPairs) * gl_WorkGroupSize.x;
+		}
+		addToCounter(0, pairs);
+		addToCounter(1, slots);
 	}
 }
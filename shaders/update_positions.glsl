@@ -3,8 +3,11 @@
 // This compute shader updates the positions of each particle
 // and also sorts the particles into the tiles for the next frame
 // by updating the tile capacities.
+// WRAP and LOCAL_SIZE are defined by universe.c when it compiles this
+// shader. WRAP picks which of the two boundaries the particles have, and
+// LOCAL_SIZE comes from autotuneWorkGroupSizes.
 
-layout (local_size_x=256) in;
+layout (local_size_x=LOCAL_SIZE) in;
 
 struct TileList {
 	int offset;
@@ -12,18 +15,28 @@ struct TileList {
 	int size;
 };
 
-struct Particle {
-	vec2 pos;
-	vec2 vel;
+struct HotParticle {
+	float x;
+	float y;
 	int type;
 };
 
+struct ColdParticle {
+	float vx;
+	float vy;
+	int key;
+};
+
 layout(std430, binding=0) coherent restrict buffer TILE_LISTS {
 	TileList tileLists[];
 };
 
-layout(std430, binding=1) restrict buffer NEW_PARTICLES {
-	Particle particles[];
+layout(std430, binding=1) restrict buffer NEW_HOT_PARTICLES {
+	HotParticle hotParticles[];
+};
+
+layout(std430, binding=12) restrict buffer NEW_COLD_PARTICLES {
+	ColdParticle coldParticles[];
 };
 
 layout(std140, binding=10) uniform UNIFORMS {
@@ -35,40 +48,55 @@ layout(std140, binding=10) uniform UNIFORMS {
 	float friction;
 	float particleRadius;
 	bool wrap;
+	bool typeSorted;
+	bool compact;
+	bool activeTiles;
+	bool packTiles;
+	bool countLanes;
+	int stencilRadius;
+	bool tabulated;
+	float forceTableScale;
+	bool stageInteractions;
 };
 
-void updateParticle(inout Particle p) {
-	p.pos += p.vel * deltaTime;
-	p.vel *= pow(1.0 - friction, deltaTime);
+void updateParticle(inout vec2 pos, inout vec2 vel) {
+	pos += vel * deltaTime;
+	vel *= pow(1.0 - friction, deltaTime);
 
-	if (wrap) {
-		p.pos -= size * ivec2(greaterThanEqual(p.pos, size));
-		p.pos += size * ivec2(lessThan(p.pos, vec2(0)));
-	} else {
-		float particleDiamater = 2.0 * particleRadius;
-		vec2 minPos = vec2(particleDiamater);
-		vec2 maxPos = size - vec2(particleDiamater);
-		bvec2 less = lessThanEqual(p.pos, minPos);
-		bvec2 greater = greaterThanEqual(p.pos, maxPos);
-		bvec2 mask = bvec2(ivec2(less) | ivec2(greater));
-		p.vel *= mix(vec2(1.0), vec2(-1.0), mask);
-		p.pos = clamp(p.pos, minPos, maxPos);
-	}
+#if WRAP
+	pos -= size * ivec2(greaterThanEqual(pos, size));
+	pos += size * ivec2(lessThan(pos, vec2(0)));
+#else
+	float particleDiamater = 2.0 * particleRadius;
+	vec2 minPos = vec2(particleDiamater);
+	vec2 maxPos = size - vec2(particleDiamater);
+	bvec2 less = lessThanEqual(pos, minPos);
+	bvec2 greater = greaterThanEqual(pos, maxPos);
+	bvec2 mask = bvec2(ivec2(less) | ivec2(greater));
+	vel *= mix(vec2(1.0), vec2(-1.0), mask);
+	pos = clamp(pos, minPos, maxPos);
+#endif
 }
 
 void main() {
 
 	// Each global thread ID corresponds to a single particle.
 	int id = int(gl_GlobalInvocationID.x);
-	if (id >= particles.length())
+	if (id >= hotParticles.length())
 		return;
 		
-	Particle p = particles[id];
-	updateParticle(p);
-	particles[id] = p;
+	HotParticle p = hotParticles[id];
+	ColdParticle c = coldParticles[id];
+	vec2 pos = vec2(p.x, p.y);
+	vec2 vel = vec2(c.vx, c.vy);
+	updateParticle(pos, vel);
+	hotParticles[id].x = pos.x;
+	hotParticles[id].y = pos.y;
+	coldParticles[id].vx = vel.x;
+	coldParticles[id].vy = vel.y;
 	
 	// Get which tile this particle belongs to.
-	ivec2 tilePos = ivec2(p.pos * invTileSize);
+	ivec2 tilePos = ivec2(pos * invTileSize);
 	int tileID = clamp(tilePos.y * numTiles.x + tilePos.x, 0, tileLists.length() - 1);
 	atomicAdd(tileLists[tileID].capacity, 1);
 	memoryBarrier(); // <<--- is this necessary for atomics and coherent buffer???
@@ -23,6 +23,15 @@ layout(std140, binding=10) uniform UNIFORMS {
 	float friction;
 	float particleRadius;
 	bool  wrap;
+	bool  typeSorted;
+	bool  compact;
+	bool  activeTiles;
+	bool  packTiles;
+	bool  countLanes;
+	int   stencilRadius;
+	bool  tabulated;
+	float forceTableScale;
+	bool  stageInteractions;
 };
 
 void main() {
@@ -0,0 +1,1473 @@
+#include "benchmark.h"
+#include "universe.h"
+#include "forces.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The RNG seed used by every benchmark, same as the BENCHMARK block in main.c. */
+#define BENCHMARK_SEED 42
+
+/* How long each measurement should run for, in seconds. */
+#define BENCHMARK_DURATION 0.5
+
+/* The randomization presets from onKey in main.c. */
+typedef struct Preset {
+	const char *name;
+	float friction;
+	float attractionMean;
+	float attractionStddev;
+	float minRadius0;
+	float minRadius1;
+	float maxRadius0;
+	float maxRadius1;
+} Preset;
+
+static const Preset largeClusters  = { "large clusters",  0.2f,   0.025f, 0.02f, 0.0f,  30.0f, 30.0f, 100.0f };
+static const Preset mediumClusters = { "medium clusters", 0.05f,  0.02f,  0.05f, 0.0f,  20.0f, 20.0f, 50.0f  };
+static const Preset smallClusters  = { "small clusters",  0.01f, -0.005f, 0.01f, 10.0f, 10.0f, 20.0f, 50.0f  };
+
+/* The universe of the BENCHMARK block in main.c. */
+static const Preset benchmarkBlock = { "BENCHMARK block", 0.05f, -0.02f, 0.06f, 0.0f, 20.0f, 20.0f, 70.0f };
+
+/* Create a universe the same way main.c does, randomized with the given preset. */
+static Universe createBenchmarkUniverse(Backend backend, int numParticleTypes, int numParticles, const Preset *preset) {
+	Universe u = createUniverse(numParticleTypes, numParticles, 1280, 720, backend);
+	u.deltaTime = 1.0f;
+	u.friction = preset->friction;
+	u.wrap = GL_TRUE;
+	u.particleRadius = 5.0f;
+	u.rng = seedRNG(BENCHMARK_SEED);
+	randomize(&u, preset->attractionMean, preset->attractionStddev, preset->minRadius0, preset->minRadius1, preset->maxRadius0, preset->maxRadius1);
+	return u;
+}
+
+void runMicroBenchmarks(void) {
+	benchmarkForceKernels();
+	benchmarkScheduler();
+	benchmarkHalfStencil();
+	benchmarkCpuBackend();
+	benchmarkDeterministic();
+	benchmarkTypeSorted();
+	benchmarkCompact();
+	benchmarkPlacement();
+	benchmarkTileScan();
+	benchmarkActiveTiles();
+	benchmarkPackedTiles();
+	benchmarkTileDivisions();
+	benchmarkTabulated();
+	benchmarkStagedInteractions();
+	benchmarkShaderVariants();
+	benchmarkAutotune();
+	benchmarkStageTimers();
+	benchmarkUniformRing();
+	benchmarkIncrementalUpdates();
+	benchmarkSnapshots();
+	benchmarkProgramCache();
+}
+
+void benchmarkForceKernels(void) {
+
+	/* Set up one neighbourhood that looks like the 3x3 tiles around a particle
+	   in the "balanced" preset: 8 types, radii of up to 70, and particles spread
+	   out over a 3x3 block of 70x70 tiles. */
+
+	const int numTypes = 8;
+	const int numParticles = 256;
+	const int numNeighbors = 2048;
+	const float tileSize = 70;
+	RNG rng = seedRNG(BENCHMARK_SEED);
+
+	ParticleInteraction *interactions = (ParticleInteraction *)malloc(numTypes * numTypes * sizeof(ParticleInteraction));
+	for (int i = 0; i < numTypes * numTypes; ++i) {
+		interactions[i].minRadius = randUniform(&rng, 10, 20);
+		interactions[i].maxRadius = randUniform(&rng, 20, tileSize);
+		interactions[i].attraction = 2 * randGaussian(&rng, -0.02f, 0.06f) / (interactions[i].maxRadius - interactions[i].minRadius);
+	}
+
+	vec2 *pos = (vec2 *)malloc(numParticles * sizeof(vec2));
+	int *type = (int *)malloc(numParticles * sizeof(int));
+	for (int i = 0; i < numParticles; ++i) {
+		pos[i].x = randUniform(&rng, tileSize, 2 * tileSize);
+		pos[i].y = randUniform(&rng, tileSize, 2 * tileSize);
+		type[i] = randi(&rng, 0, numTypes);
+	}
+
+	float *qx = (float *)malloc(numNeighbors * sizeof(float));
+	float *qy = (float *)malloc(numNeighbors * sizeof(float));
+	int *qtype = (int *)malloc(numNeighbors * sizeof(int));
+	for (int i = 0; i < numNeighbors; ++i) {
+		qx[i] = randUniform(&rng, 0, 3 * tileSize);
+		qy[i] = randUniform(&rng, 0, 3 * tileSize);
+		qtype[i] = randi(&rng, 0, numTypes);
+	}
+
+	ForceParams params;
+	params.width = 1280;
+	params.height = 720;
+	params.centerX = params.width / 2;
+	params.centerY = params.height / 2;
+	params.wrap = 1;
+
+	/* The scalar kernel is the reference which the others are checked against. */
+	vec2 *reference = (vec2 *)malloc(numParticles * sizeof(vec2));
+	ForceKernel scalar = getForceKernel(ISA_SCALAR);
+	float maxForce = 0;
+	for (int i = 0; i < numParticles; ++i) {
+		reference[i] = scalar(&params, pos[i], &interactions[type[i] * numTypes], qx, qy, qtype, numNeighbors);
+		maxForce = fmaxf(maxForce, fmaxf(fabsf(reference[i].x), fabsf(reference[i].y)));
+	}
+
+	printf("force kernels (%d types, %d particles x %d neighbours, best ISA: %s)\n",
+		numTypes, numParticles, numNeighbors, getIsaName(getBestIsa()));
+	printf("  ISA      |  pairs/sec  | speedup | max rel. error\n");
+
+	double scalarRate = 0;
+	for (int isa = ISA_SCALAR; isa < NUM_ISAS; ++isa) {
+		if (!isIsaSupported((Isa)isa)) {
+			printf("  %-8s |         not supported\n", getIsaName((Isa)isa));
+			continue;
+		}
+
+		ForceKernel kernel = getForceKernel((Isa)isa);
+		float maxError = 0;
+		for (int i = 0; i < numParticles; ++i) {
+			vec2 f = kernel(&params, pos[i], &interactions[type[i] * numTypes], qx, qy, qtype, numNeighbors);
+			maxError = fmaxf(maxError, fmaxf(fabsf(f.x - reference[i].x), fabsf(f.y - reference[i].y)));
+		}
+
+		/* Keep running until we have a long enough measurement. The sink stops
+		   the compiler from throwing the whole calculation away. */
+		volatile float sink = 0;
+		double pairs = 0;
+		double t0 = getTime(), t1 = t0;
+		while (t1 - t0 < BENCHMARK_DURATION) {
+			for (int i = 0; i < numParticles; ++i) {
+				vec2 f = kernel(&params, pos[i], &interactions[type[i] * numTypes], qx, qy, qtype, numNeighbors);
+				sink += f.x + f.y;
+			}
+			pairs += (double)numParticles * numNeighbors;
+			t1 = getTime();
+		}
+
+		double rate = pairs / (t1 - t0);
+		if (isa == ISA_SCALAR)
+			scalarRate = rate;
+		printf("  %-8s | %11.4g | %6.2fx | %g\n", getIsaName((Isa)isa), rate, rate / scalarRate, maxError / maxForce);
+	}
+	printf("\n");
+
+	free(interactions);
+	free(pos);
+	free(type);
+	free(qx);
+	free(qy);
+	free(qtype);
+	free(reference);
+}
+
+void benchmarkScheduler(void) {
+
+	/* The clusters only form after a while, so let the universe settle first, and then
+	   run the same timesteps once with each scheduler from a copy of the settled state. */
+
+	const int numThreads = getNumProcessors() > 1 ? getNumProcessors() : 4;
+	const int numParticles = 20000;
+	const int warmupTimesteps = 50;
+	const int timesteps = 50;
+	const Preset *presets[] = { &largeClusters, &mediumClusters, &smallClusters };
+
+	printf("force pass scheduling (%d particles, %d threads, %d timesteps after %d warmup timesteps)\n",
+		numParticles, numThreads, timesteps, warmupTimesteps);
+	printf("  preset          | scheduler     | timesteps/sec | busy min/max [s] | idle [%%]\n");
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		Universe u = createBenchmarkUniverse(BACKEND_CPU, 6, numParticles, presets[p]);
+		setNumThreads(&u, numThreads);
+		u.halfStencil = 0;
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+
+		/* Remember the settled state so both schedulers start from it. The tile
+		   lists are rebuilt from the particles at the start of every timestep. */
+		Particles settled = allocParticles(numParticles);
+		copyParticles(&settled, &u.particles, numParticles);
+
+		for (int workStealing = 0; workStealing <= 1; ++workStealing) {
+			copyParticles(&u.particles, &settled, numParticles);
+			u.workStealing = workStealing;
+			resetThreadStats(u.internal.threadPool);
+
+			double t0 = getTime();
+			for (int i = 0; i < timesteps; ++i)
+				simulateTimestep(&u);
+			double elapsed = getTime() - t0;
+
+			const ThreadStats *stats = getThreadStats(u.internal.threadPool);
+			double minBusy = stats[0].busyTime, maxBusy = stats[0].busyTime, busy = 0, idle = 0;
+			for (int i = 0; i < numThreads; ++i) {
+				minBusy = fmin(minBusy, stats[i].busyTime);
+				maxBusy = fmax(maxBusy, stats[i].busyTime);
+				busy += stats[i].busyTime;
+				idle += stats[i].idleTime;
+			}
+			printf("  %-15s | %-13s | %13.2f | %7.3f / %-7.3f | %7.1f\n", presets[p]->name,
+				workStealing ? "work stealing" : "static", timesteps / elapsed, minBusy, maxBusy, 100 * idle / (busy + idle));
+		}
+
+		freeParticles(&settled);
+		destroyUniverse(&u);
+	}
+	printf("\n");
+}
+
+void benchmarkHalfStencil(void) {
+
+	/* Count how many pairs of particles each force pass looks at, from the tile sizes. The full
+	   stencil looks at every particle in the 3x3 block, including the particle itself. The half
+	   stencil looks at each pair only once, and never at a particle and itself. */
+
+	const int numParticles = 50000;
+	const int warmupTimesteps = 100;
+	const int timesteps = 20;
+	const Preset *presets[] = { &largeClusters, &mediumClusters, &smallClusters };
+
+	printf("half-stencil force pass (%d particles, %d timesteps after %d warmup timesteps)\n",
+		numParticles, timesteps, warmupTimesteps);
+	printf("  preset          | stencil | pairs/timestep | timesteps/sec | speedup\n");
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		Universe u = createBenchmarkUniverse(BACKEND_CPU, 6, numParticles, presets[p]);
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+
+		Particles settled = allocParticles(numParticles);
+		copyParticles(&settled, &u.particles, numParticles);
+
+		const struct UniverseInternal *ui = &u.internal;
+		double fullPairs = 0;
+		for (int y = 0; y < ui->numTilesY; ++y) {
+			for (int x = 0; x < ui->numTilesX; ++x) {
+				double size = ui->tileLists[y * ui->numTilesX + x].size;
+				for (int dy = -1; dy <= 1; ++dy) {
+					for (int dx = -1; dx <= 1; ++dx) {
+						int nx = (x + dx + ui->numTilesX) % ui->numTilesX;
+						int ny = (y + dy + ui->numTilesY) % ui->numTilesY;
+						fullPairs += size * ui->tileLists[ny * ui->numTilesX + nx].size;
+					}
+				}
+			}
+		}
+		double halfPairs = (fullPairs - numParticles) / 2;
+
+		double fullRate = 0;
+		for (int halfStencil = 0; halfStencil <= 1; ++halfStencil) {
+			copyParticles(&u.particles, &settled, numParticles);
+			u.halfStencil = halfStencil;
+
+			double t0 = getTime();
+			for (int i = 0; i < timesteps; ++i)
+				simulateTimestep(&u);
+			double rate = timesteps / (getTime() - t0);
+			if (!halfStencil)
+				fullRate = rate;
+			printf("  %-15s | %-7s | %14.4g | %13.2f | %6.2fx\n", presets[p]->name,
+				halfStencil ? "half" : "full", halfStencil ? halfPairs : fullPairs, rate, rate / fullRate);
+		}
+
+		freeParticles(&settled);
+		destroyUniverse(&u);
+	}
+	printf("\n");
+}
+
+void benchmarkCpuBackend(void) {
+
+	/* The target of the CPU backend is 100'000 particles at 30 timesteps per second on a 32-core machine.
+	   Let the universe settle once, and then run the same timesteps from a copy of the settled state with
+	   1, 2, 4, ... threads, up to the number of logical processors. The CPU backend gives the same result
+	   with any number of threads, so every row does exactly the same work. */
+
+	const int numParticles = 100000;
+	const int warmupTimesteps = 50;
+	const int timesteps = 20;
+	const double targetRate = 30;
+
+	printf("CPU backend (%d particles, %s, %d timesteps after %d warmup timesteps)\n",
+		numParticles, benchmarkBlock.name, timesteps, warmupTimesteps);
+	printf("  threads | timesteps/sec | of target | per thread\n");
+
+	Universe u = createBenchmarkUniverse(BACKEND_CPU, 6, numParticles, &benchmarkBlock);
+	for (int i = 0; i < warmupTimesteps; ++i)
+		simulateTimestep(&u);
+
+	Particles settled = allocParticles(numParticles);
+	copyParticles(&settled, &u.particles, numParticles);
+
+	const int numProcessors = getNumProcessors();
+	for (int numThreads = 1; ; numThreads *= 2) {
+		if (numThreads > numProcessors)
+			numThreads = numProcessors;
+		setNumThreads(&u, numThreads);
+		copyParticles(&u.particles, &settled, numParticles);
+
+		double t0 = getTime();
+		for (int i = 0; i < timesteps; ++i)
+			simulateTimestep(&u);
+		double rate = timesteps / (getTime() - t0);
+		printf("  %7d | %13.2f | %8.1f%% | %10.3f\n", numThreads, rate, 100 * rate / targetRate, rate / numThreads);
+
+		if (numThreads == numProcessors)
+			break;
+	}
+	printf("\n");
+
+	freeParticles(&settled);
+	destroyUniverse(&u);
+}
+
+/* Read back the particles in the GPU front-buffers and put the hot and cold halves back together. */
+static void readGpuParticles(Universe *u, Particle *particles) {
+	HotParticle *hot = (HotParticle *)malloc(u->numParticles * sizeof(HotParticle));
+	ColdParticle *cold = (ColdParticle *)malloc(u->numParticles * sizeof(ColdParticle));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, u->internal.gpuNewParticles);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, u->numParticles * sizeof(HotParticle), hot);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, u->internal.gpuNewColdParticles);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, u->numParticles * sizeof(ColdParticle), cold);
+	for (int i = 0; i < u->numParticles; ++i) {
+		particles[i].pos = hot[i].pos;
+		particles[i].vel = cold[i].vel;
+		particles[i].type = hot[i].type;
+		particles[i].padding[0] = cold[i].key;
+	}
+	free(hot);
+	free(cold);
+}
+
+/* Put particles that were read back with readGpuParticles into the universe and upload them. */
+static void restoreParticles(Universe *u, const Particle *particles) {
+	for (int i = 0; i < u->numParticles; ++i) {
+		u->particles.posX[i] = particles[i].pos.x;
+		u->particles.posY[i] = particles[i].pos.y;
+		u->particles.velX[i] = particles[i].vel.x;
+		u->particles.velY[i] = particles[i].vel.y;
+		u->particles.type[i] = particles[i].type;
+	}
+	updateBuffers(u);
+}
+
+/* Keep simulating the universe until we have a long enough measurement, and return the timesteps per second. */
+static double measureTimestepsPerSecond(Universe *u) {
+	int timesteps = 0;
+	glFinish();
+	double t0 = getTime(), t1 = t0;
+	while (t1 - t0 < BENCHMARK_DURATION) {
+		simulateTimestep(u);
+		glFinish();
+		++timesteps;
+		t1 = getTime();
+	}
+	return timesteps / (t1 - t0);
+}
+
+/* Run a universe from the benchmark seed and return a copy of its particles after the given
+   number of timesteps, in the GPU layout so that it can be compared bit for bit. */
+static Particle *runFromSeed(Backend backend, int numParticles, int numThreads, int deterministic, int timesteps, double *timestepsPerSecond) {
+	Universe u = createBenchmarkUniverse(backend, 6, numParticles, &mediumClusters);
+	setNumThreads(&u, numThreads);
+	u.deterministic = deterministic;
+
+	glFinish();
+	double t0 = getTime();
+	for (int i = 0; i < timesteps; ++i)
+		simulateTimestep(&u);
+	glFinish();
+	*timestepsPerSecond = timesteps / (getTime() - t0);
+
+	Particle *particles = (Particle *)malloc(numParticles * sizeof(Particle));
+	if (backend == BACKEND_GPU) {
+		readGpuParticles(&u, particles);
+	} else {
+		for (int i = 0; i < numParticles; ++i) {
+			particles[i].pos.x = u.particles.posX[i];
+			particles[i].pos.y = u.particles.posY[i];
+			particles[i].vel.x = u.particles.velX[i];
+			particles[i].vel.y = u.particles.velY[i];
+			particles[i].type = u.particles.type[i];
+		}
+	}
+
+	/* The padding holds sort keys on the GPU, which don't matter for the state. */
+	for (int i = 0; i < numParticles; ++i)
+		particles[i].padding[0] = 0;
+
+	destroyUniverse(&u);
+	return particles;
+}
+
+void benchmarkDeterministic(void) {
+
+	/* Run the same seed twice in each mode and check whether the two end up bit-identical.
+	   The GPU runs can't control the thread count, so they rely on the scheduling being
+	   different between runs. On the CPU the second run uses a different number of threads. */
+
+	const int numParticles = 10000;
+	const int timesteps = 300;
+	const int numThreads = getNumProcessors() > 1 ? getNumProcessors() : 4;
+
+	printf("deterministic mode (%d particles, %d timesteps, medium clusters)\n", numParticles, timesteps);
+	printf("  backend | mode            | timesteps/sec | bit-identical\n");
+
+	for (int deterministic = 0; deterministic <= 1; ++deterministic) {
+		double rate1, rate2;
+		Particle *run1 = runFromSeed(BACKEND_GPU, numParticles, 1, deterministic, timesteps, &rate1);
+		Particle *run2 = runFromSeed(BACKEND_GPU, numParticles, 1, deterministic, timesteps, &rate2);
+		int identical = memcmp(run1, run2, numParticles * sizeof(Particle)) == 0;
+		printf("  GPU     | %-15s | %13.2f | %s\n", deterministic ? "deterministic" : "default",
+			(rate1 + rate2) / 2, identical ? "yes" : "no");
+		free(run1);
+		free(run2);
+	}
+
+	double rate1, rate2;
+	Particle *run1 = runFromSeed(BACKEND_CPU, numParticles, 1, 0, timesteps, &rate1);
+	Particle *run2 = runFromSeed(BACKEND_CPU, numParticles, numThreads, 0, timesteps, &rate2);
+	int identical = memcmp(run1, run2, numParticles * sizeof(Particle)) == 0;
+	printf("  CPU     | 1 vs %-2d threads | %13.2f | %s\n", numThreads, (rate1 + rate2) / 2, identical ? "yes" : "no");
+	free(run1);
+	free(run2);
+	printf("\n");
+}
+
+void benchmarkTypeSorted(void) {
+
+	/* Sorting by type needs the same extra ordering pass as deterministic mode, so that mode is
+	   also measured. The difference between the two is what the type-sorted kernel itself gains.
+	   Each universe is warmed up once, and then keeps running with each of the modes in turn. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 50;
+	const int numTypes[] = { 2, 4, 8, 16, 32, 64 };
+
+	printf("type-sorted tiles on the GPU (%d particles, medium clusters, after %d warmup timesteps)\n",
+		numParticles, warmupTimesteps);
+	printf("  types | mode          | timesteps/sec | speedup\n");
+
+	for (int t = 0; t < (int)(sizeof(numTypes) / sizeof(numTypes[0])); ++t) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, numTypes[t], numParticles, &mediumClusters);
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+
+		double defaultRate = 0;
+		for (int mode = 0; mode < 3; ++mode) {
+			const char *names[] = { "default", "deterministic", "type sorted" };
+			u.deterministic = mode == 1;
+			u.typeSorted = mode == 2;
+
+			/* Run one timestep first so the ordering pass has run before we start measuring. */
+			simulateTimestep(&u);
+
+			double rate = measureTimestepsPerSecond(&u);
+			if (mode == 0)
+				defaultRate = rate;
+			printf("  %5d | %-13s | %13.2f | %6.2fx\n", numTypes[t], names[mode], rate, rate / defaultRate);
+		}
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+}
+
+void benchmarkCompact(void) {
+
+	/* Let a universe settle in the float32 path, and then start a float32 and a compact universe
+	   from that same state. Both are deterministic, so after one timestep the particles are in the
+	   same order in both, and the difference in their velocities is the error of the compact forces. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 100;
+	const Preset *presets[] = { &largeClusters, &mediumClusters, &smallClusters };
+
+	printf("compact particles in the GPU force pass (%d particles, 1 timestep after %d warmup timesteps)\n",
+		numParticles, warmupTimesteps);
+	printf("  preset          | max/mean rel. force error | neighbour MB/step f32 -> compact | timesteps/sec f32 -> compact\n");
+
+	Particle *settled = (Particle *)malloc(numParticles * sizeof(Particle));
+	Particle *result[2];
+	result[0] = (Particle *)malloc(numParticles * sizeof(Particle));
+	result[1] = (Particle *)malloc(numParticles * sizeof(Particle));
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, presets[p]);
+		u.deterministic = 1;
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+		readGpuParticles(&u, settled);
+
+		double rate[2];
+		for (int compact = 0; compact <= 1; ++compact) {
+			restoreParticles(&u, settled);
+			u.compact = compact;
+			simulateTimestep(&u);
+			readGpuParticles(&u, result[compact]);
+
+			rate[compact] = measureTimestepsPerSecond(&u);
+		}
+
+		/* The velocity change of a timestep is the force plus friction, which is the same for both. */
+		double maxChange = 0, maxError = 0, sumChange = 0, sumError = 0;
+		for (int i = 0; i < numParticles; ++i) {
+			vec2 v0 = result[0][i].vel, v1 = result[1][i].vel;
+			double change = hypot(v0.x - settled[i].vel.x, v0.y - settled[i].vel.y);
+			double error = hypot(v1.x - v0.x, v1.y - v0.y);
+			maxChange = fmax(maxChange, change);
+			maxError = fmax(maxError, error);
+			sumChange += change;
+			sumError += error;
+		}
+
+		/* Every particle is loaded as a neighbour by the workgroups of the 9 tiles around it. The float32
+		   path streams the hot particles through the cache, the compact path streams the compact particles,
+		   and sort_particles writes each compact particle once. */
+		double neighbors = 9.0 * numParticles;
+		double f32Bytes = neighbors * sizeof(HotParticle);
+		double compactBytes = neighbors * sizeof(CompactParticle) + numParticles * sizeof(CompactParticle);
+		printf("  %-15s | %11.3g / %-11.3g | %15.2f -> %-14.2f | %13.2f -> %.2f\n", presets[p]->name,
+			maxError / maxChange, sumError / sumChange, f32Bytes / 1e6, compactBytes / 1e6, rate[0], rate[1]);
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+
+	free(settled);
+	free(result[0]);
+	free(result[1]);
+}
+
+void benchmarkPlacement(void) {
+
+	/* Interleaved placement spreads every band over all nodes, so most reads cross a node boundary.
+	   Striped placement keeps each band on its own node. On a machine with a single node, all of
+	   them should be about as fast, except for the pinning. */
+
+	const int numThreads = getNumProcessors();
+	const int numParticles = 1000000;
+	const int warmupTimesteps = 5;
+	const char *names[] = { "default", "interleaved", "striped" };
+
+	printf("NUMA placement (%d particles, %d threads, %d NUMA nodes, medium clusters)\n",
+		numParticles, numThreads, getNumNodes());
+	printf("  placement   | timesteps/sec | speedup\n");
+
+	Universe u = createBenchmarkUniverse(BACKEND_CPU, 6, numParticles, &mediumClusters);
+	for (int i = 0; i < warmupTimesteps; ++i)
+		simulateTimestep(&u);
+
+	double defaultRate = 0;
+	for (int placement = PLACEMENT_DEFAULT; placement <= PLACEMENT_STRIPED; ++placement) {
+		setPlacement(&u, (Placement)placement);
+		simulateTimestep(&u);
+
+		int timesteps = 0;
+		double t0 = getTime(), t1 = t0;
+		while (t1 - t0 < BENCHMARK_DURATION) {
+			simulateTimestep(&u);
+			++timesteps;
+			t1 = getTime();
+		}
+
+		double rate = timesteps / (t1 - t0);
+		if (placement == PLACEMENT_DEFAULT)
+			defaultRate = rate;
+		printf("  %-11s | %13.2f | %6.2fx\n", names[placement], rate, rate / defaultRate);
+	}
+
+	destroyUniverse(&u);
+	printf("\n");
+}
+
+void benchmarkTileScan(void) {
+
+	/* Grow the world so that it has the given number of tiles, give every tile a random capacity,
+	   and check the offsets against a scan on the CPU. After that the capacities are all 0, but the
+	   amount of work the scan does doesn't depend on them, so just keep running it for the timing. */
+
+	const int sides[] = { 32, 128, 512, 1024, 2048 };
+
+	printf("tile offset scan on the GPU\n");
+	printf("  tiles   | ms/scan | correct\n");
+
+	for (int i = 0; i < (int)(sizeof(sides) / sizeof(sides[0])); ++i) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, 10000, &mediumClusters);
+		struct UniverseInternal *ui = &u.internal;
+		u.width = u.height = sides[i] / ui->invTileSize;
+		updateBuffers(&u);
+		updateUniforms(&u);
+		int numTiles = ui->numTilesX * ui->numTilesY;
+
+		RNG rng = seedRNG(BENCHMARK_SEED);
+		TileList *tiles = (TileList *)malloc(numTiles * sizeof(TileList));
+		for (int t = 0; t < numTiles; ++t) {
+			tiles[t].offset = 0;
+			tiles[t].capacity = randi(&rng, 0, 8);
+			tiles[t].size = 0;
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuTileLists);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, numTiles * sizeof(TileList), tiles);
+
+		setupTiles(&u);
+		TileList *result = (TileList *)malloc(numTiles * sizeof(TileList));
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuTileLists);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, numTiles * sizeof(TileList), result);
+		int correct = 1;
+		int offset = 0;
+		for (int t = 0; t < numTiles; ++t) {
+			correct &= result[t].offset == offset && result[t].capacity == 0 && result[t].size == 0;
+			offset += tiles[t].capacity;
+		}
+
+		int scans = 0;
+		glFinish();
+		double t0 = getTime(), t1 = t0;
+		while (t1 - t0 < BENCHMARK_DURATION) {
+			setupTiles(&u);
+			glFinish();
+			++scans;
+			t1 = getTime();
+		}
+		printf("  %7d | %7.3f | %s\n", numTiles, 1000 * (t1 - t0) / scans, correct ? "yes" : "no");
+
+		free(tiles);
+		free(result);
+		destroyUniverse(&u);
+	}
+	printf("\n");
+}
+
+void benchmarkActiveTiles(void) {
+
+	/* Let the clusters form, and then start from that same state over all tiles and over the active
+	   tiles only. Both are deterministic, and each tile is processed the same way in both, so the
+	   particles should be bit-identical after a timestep. The larger world doesn't wrap around and
+	   has 16 times the area, but the particles start out in one corner of the size of the default
+	   world, so most of its tiles are empty. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 50;
+	const Preset *presets[] = { &largeClusters, &smallClusters };
+	const int scales[] = { 1, 4 };
+
+	printf("active tiles in the GPU ordering pass (%d particles, after %d warmup timesteps)\n", numParticles, warmupTimesteps);
+	printf("  preset          | world             | active / tiles  | timesteps/sec all -> active | speedup | identical\n");
+
+	Particle *settled = (Particle *)malloc(numParticles * sizeof(Particle));
+	Particle *result[2];
+	result[0] = (Particle *)malloc(numParticles * sizeof(Particle));
+	result[1] = (Particle *)malloc(numParticles * sizeof(Particle));
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		for (int s = 0; s < (int)(sizeof(scales) / sizeof(scales[0])); ++s) {
+			Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, presets[p]);
+			struct UniverseInternal *ui = &u.internal;
+			u.width *= scales[s];
+			u.height *= scales[s];
+			u.wrap = scales[s] == 1;
+			updateBuffers(&u);
+			u.deterministic = 1;
+			for (int i = 0; i < warmupTimesteps; ++i)
+				simulateTimestep(&u);
+			readGpuParticles(&u, settled);
+
+			double rate[2];
+			int numActive = 0;
+			for (int activeTiles = 0; activeTiles <= 1; ++activeTiles) {
+				restoreParticles(&u, settled);
+				u.activeTiles = activeTiles;
+				simulateTimestep(&u);
+				readGpuParticles(&u, result[activeTiles]);
+				if (activeTiles) {
+					GLuint numActiveTiles;
+					glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuActiveTiles);
+					glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 3 * sizeof(GLuint), sizeof(GLuint), &numActiveTiles);
+					numActive = (int)numActiveTiles;
+				}
+
+				rate[activeTiles] = measureTimestepsPerSecond(&u);
+			}
+
+			int identical = memcmp(result[0], result[1], numParticles * sizeof(Particle)) == 0;
+
+			char world[32];
+			snprintf(world, sizeof(world), "%.0fx%.0f%s", u.width, u.height, u.wrap ? "" : " no wrap");
+			printf("  %-15s | %-17s | %6d / %-6d | %12.2f -> %-12.2f | %6.2fx | %s\n", presets[p]->name, world,
+				numActive, ui->numTilesX * ui->numTilesY, rate[0], rate[1], rate[1] / rate[0], identical ? "yes" : "no");
+
+			destroyUniverse(&u);
+		}
+	}
+	printf("\n");
+
+	free(settled);
+	free(result[0]);
+	free(result[1]);
+}
+
+/* Read the lane counters of the GPU force pass, and reset them. */
+static void readLaneCounters(Universe *u, double *pairs, double *slots, double *inRange) {
+	GLuint counters[6];
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, u->internal.gpuLaneCounters);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+	*pairs = counters[0] + 4294967296.0 * counters[1];
+	*slots = counters[2] + 4294967296.0 * counters[3];
+	*inRange = counters[4] + 4294967296.0 * counters[5];
+	memset(counters, 0, sizeof(counters));
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+}
+
+/* Read how busy the lanes of the GPU force pass were, and reset the lane counters. */
+static double readLaneUtilisation(Universe *u) {
+	double pairs, slots, inRange;
+	readLaneCounters(u, &pairs, &slots, &inRange);
+	return slots > 0 ? pairs / slots : 0;
+}
+
+void benchmarkPackedTiles(void) {
+
+	/* Let the clusters form, and then start from that same state with one tile per workgroup and with
+	   packed tiles. The two sum up the forces of the neighbors in batches of different sizes, so the
+	   velocities after a timestep are only the same up to rounding. The lane counters are only on
+	   while measuring the utilisation, so that they don't slow down the measurement of the speed. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 100;
+	const Preset *presets[] = { &largeClusters, &mediumClusters, &smallClusters };
+
+	printf("packed tiles in the GPU force pass (%d particles, after %d warmup timesteps)\n", numParticles, warmupTimesteps);
+	printf("  preset          | tiles <=128 / >1024 particles | lane utilisation 1/wg -> packed | timesteps/sec 1/wg -> packed | max rel. difference\n");
+
+	Particle *settled = (Particle *)malloc(numParticles * sizeof(Particle));
+	Particle *result[2];
+	result[0] = (Particle *)malloc(numParticles * sizeof(Particle));
+	result[1] = (Particle *)malloc(numParticles * sizeof(Particle));
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, presets[p]);
+		struct UniverseInternal *ui = &u.internal;
+		u.deterministic = 1;
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+		readGpuParticles(&u, settled);
+
+		double utilisation[2], rate[2];
+		int numLight = 0, numHeavy = 0, numOccupied = 0;
+		for (int packTiles = 0; packTiles <= 1; ++packTiles) {
+			restoreParticles(&u, settled);
+			u.packTiles = packTiles;
+
+			/* updateBuffers has binned the particles on the host, so the tile sizes are known here. */
+			numLight = numHeavy = numOccupied = 0;
+			for (int t = 0; t < ui->numTilesX * ui->numTilesY; ++t) {
+				numOccupied += ui->tileLists[t].capacity > 0;
+				numLight += ui->tileLists[t].capacity > 0 && ui->tileLists[t].capacity <= 128;
+				numHeavy += ui->tileLists[t].capacity > 1024;
+			}
+
+			u.countLanes = 1;
+			readLaneUtilisation(&u);
+			simulateTimestep(&u);
+			readGpuParticles(&u, result[packTiles]);
+			for (int i = 0; i < 10; ++i)
+				simulateTimestep(&u);
+			utilisation[packTiles] = readLaneUtilisation(&u);
+			u.countLanes = 0;
+
+			rate[packTiles] = measureTimestepsPerSecond(&u);
+		}
+
+		/* Compare the difference of the velocities with the change of the velocities in the timestep. */
+		double maxChange = 0, maxDifference = 0;
+		for (int i = 0; i < numParticles; ++i) {
+			vec2 v0 = result[0][i].vel, v1 = result[1][i].vel;
+			maxChange = fmax(maxChange, hypot(v0.x - settled[i].vel.x, v0.y - settled[i].vel.y));
+			maxDifference = fmax(maxDifference, hypot(v1.x - v0.x, v1.y - v0.y));
+		}
+
+		char tiles[48];
+		snprintf(tiles, sizeof(tiles), "%d / %d of %d", numLight, numHeavy, numOccupied);
+		printf("  %-15s | %-29s | %20.1f%% -> %5.1f%% | %15.2f -> %-9.2f | %g\n", presets[p]->name, tiles,
+			100 * utilisation[0], 100 * utilisation[1], rate[0], rate[1], maxDifference / maxChange);
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+
+	free(settled);
+	free(result[0]);
+	free(result[1]);
+}
+
+/* The state of a particle before a timestep, and its velocity after. */
+typedef struct ParticleStep {
+	float x, y, vx, vy;
+	vec2 vel;
+} ParticleStep;
+
+/* Order the particles by their state before the timestep. */
+static int compareParticleSteps(const void *a, const void *b) {
+	const float *pa = (const float *)a;
+	const float *pb = (const float *)b;
+	for (int i = 0; i < 4; ++i) {
+		if (pa[i] != pb[i])
+			return pa[i] < pb[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+void benchmarkTileDivisions(void) {
+
+	/* Let the clusters form, and then start from that same state with each tile size. The particles end
+	   up in a different order with each tile size, so the key that sort_particles leaves in each particle
+	   is used to look up its state before the timestep in the host-side particles, and the particles of
+	   the runs are matched up by that state. Smaller tiles only change which far away tiles are skipped,
+	   and the order in which the forces are summed up, so the velocities should agree up to rounding.
+	   The world doesn't wrap around here. Its size isn't a multiple of the tile size, so the last column
+	   and row of tiles are narrower than the rest, and the blocks of tiles that reach across the seam of a
+	   wrapping world miss some of the pairs there. How many they miss depends on the tile size. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 100;
+	const Preset *presets[] = { &largeClusters, &mediumClusters, &smallClusters };
+
+	printf("tile divisions in the GPU force pass (%d particles, no wrap, after %d warmup timesteps)\n", numParticles, warmupTimesteps);
+	printf("  preset          | block | pairs evaluated | in range | timesteps/sec | speedup | max rel. difference\n");
+
+	Particle *settled = (Particle *)malloc(numParticles * sizeof(Particle));
+	Particle *result = (Particle *)malloc(numParticles * sizeof(Particle));
+	ParticleStep *steps[2];
+	steps[0] = (ParticleStep *)malloc(numParticles * sizeof(ParticleStep));
+	steps[1] = (ParticleStep *)malloc(numParticles * sizeof(ParticleStep));
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, presets[p]);
+		u.deterministic = 1;
+		u.wrap = 0;
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+		readGpuParticles(&u, settled);
+
+		double baseRate = 0, maxChange = 0;
+		for (int divisions = 1; divisions <= 4; ++divisions) {
+			u.tileDivisions = divisions;
+			restoreParticles(&u, settled);
+
+			double pairs, slots, inRange;
+			u.countLanes = 1;
+			readLaneCounters(&u, &pairs, &slots, &inRange);
+			simulateTimestep(&u);
+			readGpuParticles(&u, result);
+			readLaneCounters(&u, &pairs, &slots, &inRange);
+			u.countLanes = 0;
+
+			ParticleStep *step = steps[divisions > 1];
+			for (int i = 0; i < numParticles; ++i) {
+				int key = result[i].padding[0];
+				step[i].x = u.particles.posX[key];
+				step[i].y = u.particles.posY[key];
+				step[i].vx = u.particles.velX[key];
+				step[i].vy = u.particles.velY[key];
+				step[i].vel = result[i].vel;
+			}
+			qsort(step, numParticles, sizeof(ParticleStep), compareParticleSteps);
+
+			double maxDifference = 0;
+			for (int i = 0; i < numParticles; ++i) {
+				ParticleStep s0 = steps[0][i], s1 = step[i];
+				if (divisions == 1)
+					maxChange = fmax(maxChange, hypot(s0.vel.x - s0.vx, s0.vel.y - s0.vy));
+				else
+					maxDifference = fmax(maxDifference, hypot(s1.vel.x - s0.vel.x, s1.vel.y - s0.vel.y));
+			}
+
+			double rate = measureTimestepsPerSecond(&u);
+			if (divisions == 1)
+				baseRate = rate;
+
+			int stencilWidth = 2 * divisions + 1;
+			printf("  %-15s | %dx%d   | %15.0f | %7.1f%% | %13.2f | %6.2fx | %g\n", presets[p]->name, stencilWidth, stencilWidth,
+				pairs, pairs > 0 ? 100 * inRange / pairs : 0, rate, rate / baseRate, maxDifference / maxChange);
+		}
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+
+	free(settled);
+	free(result);
+	free(steps[0]);
+	free(steps[1]);
+}
+
+void benchmarkTabulated(void) {
+
+	/* Like benchmarkCompact, start an analytic and a tabulated universe from the same settled state.
+	   Both are deterministic and use the same tiles, so the particles are in the same order in both. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 100;
+	const Preset *presets[] = { &largeClusters, &mediumClusters, &smallClusters };
+
+	printf("tabulated force law in the GPU force pass (%d particles, 1 timestep after %d warmup timesteps)\n",
+		numParticles, warmupTimesteps);
+	printf("  preset          | max/mean rel. force error | timesteps/sec analytic -> tabulated | speedup\n");
+
+	Particle *settled = (Particle *)malloc(numParticles * sizeof(Particle));
+	Particle *result[2];
+	result[0] = (Particle *)malloc(numParticles * sizeof(Particle));
+	result[1] = (Particle *)malloc(numParticles * sizeof(Particle));
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, presets[p]);
+		u.deterministic = 1;
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+		readGpuParticles(&u, settled);
+
+		double rate[2];
+		for (int tabulated = 0; tabulated <= 1; ++tabulated) {
+			restoreParticles(&u, settled);
+			u.tabulated = tabulated;
+			simulateTimestep(&u);
+			readGpuParticles(&u, result[tabulated]);
+
+			rate[tabulated] = measureTimestepsPerSecond(&u);
+		}
+
+		/* The velocity change of a timestep is the force plus friction, which is the same for both. */
+		double maxChange = 0, maxError = 0, sumChange = 0, sumError = 0;
+		for (int i = 0; i < numParticles; ++i) {
+			vec2 v0 = result[0][i].vel, v1 = result[1][i].vel;
+			double change = hypot(v0.x - settled[i].vel.x, v0.y - settled[i].vel.y);
+			double error = hypot(v1.x - v0.x, v1.y - v0.y);
+			maxChange = fmax(maxChange, change);
+			maxError = fmax(maxError, error);
+			sumChange += change;
+			sumError += error;
+		}
+
+		printf("  %-15s | %11.3g / %-11.3g | %17.2f -> %-15.2f | %6.2fx\n", presets[p]->name,
+			maxError / maxChange, sumError / sumChange, rate[0], rate[1], rate[1] / rate[0]);
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+
+	free(settled);
+	free(result[0]);
+	free(result[1]);
+}
+
+void benchmarkStagedInteractions(void) {
+
+	/* Start a universe that reads the interactions from the buffer and one that stages them in shared
+	   memory from the same settled state. Staging doesn't change any of the math, so with deterministic
+	   mode the particles should be bit-identical after a timestep. 32 types don't fit into shared
+	   memory, so that universe falls back to the buffer in both modes. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 50;
+	const int numTypes[] = { 4, 8, 16, 32 };
+
+	printf("interaction matrix staged in shared memory in the GPU force pass (%d particles, medium clusters, after %d warmup timesteps)\n",
+		numParticles, warmupTimesteps);
+	printf("  types | timesteps/sec buffer -> staged | speedup | bit-identical\n");
+
+	Particle *settled = (Particle *)malloc(numParticles * sizeof(Particle));
+	Particle *result[2];
+	result[0] = (Particle *)malloc(numParticles * sizeof(Particle));
+	result[1] = (Particle *)malloc(numParticles * sizeof(Particle));
+
+	for (int t = 0; t < (int)(sizeof(numTypes) / sizeof(numTypes[0])); ++t) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, numTypes[t], numParticles, &mediumClusters);
+		u.deterministic = 1;
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+		readGpuParticles(&u, settled);
+
+		double rate[2];
+		for (int staged = 0; staged <= 1; ++staged) {
+			restoreParticles(&u, settled);
+			u.stageInteractions = staged;
+			simulateTimestep(&u);
+			readGpuParticles(&u, result[staged]);
+
+			rate[staged] = measureTimestepsPerSecond(&u);
+		}
+
+		int identical = memcmp(result[0], result[1], numParticles * sizeof(Particle)) == 0;
+		printf("  %5d | %13.2f -> %-13.2f | %6.2fx | %s\n", numTypes[t], rate[0], rate[1], rate[1] / rate[0], identical ? "yes" : "no");
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+
+	free(settled);
+	free(result[0]);
+	free(result[1]);
+}
+
+/* Run a single timestep and return how long it took, in milliseconds. */
+static double timeTimestep(Universe *u) {
+	glFinish();
+	double t0 = getTime();
+	simulateTimestep(u);
+	glFinish();
+	return 1000 * (getTime() - t0);
+}
+
+void benchmarkShaderVariants(void) {
+
+	/* The first timestep after wrap is toggled compiles the variants of the force and position passes for
+	   the new setting, and toggling it back picks the cached variants again. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 10;
+	const int numTypes[] = { 4, 16, 64 };
+
+	printf("specialised shader variants on the GPU (%d particles, medium clusters, after %d warmup timesteps)\n",
+		numParticles, warmupTimesteps);
+	printf("  types | ms/timestep | first wrap switch ms | cached wrap switch ms | timesteps/sec wrap -> no wrap\n");
+
+	for (int t = 0; t < (int)(sizeof(numTypes) / sizeof(numTypes[0])); ++t) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, numTypes[t], numParticles, &mediumClusters);
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+
+		double step = timeTimestep(&u);
+		u.wrap = 0;
+		double firstSwitch = timeTimestep(&u);
+		u.wrap = 1;
+		double cachedSwitch = timeTimestep(&u);
+
+		double rate[2];
+		for (int wrap = 1; wrap >= 0; --wrap) {
+			u.wrap = wrap;
+			simulateTimestep(&u);
+
+			rate[wrap] = measureTimestepsPerSecond(&u);
+		}
+
+		printf("  %5d | %11.1f | %20.1f | %21.1f | %13.2f -> %.2f\n", numTypes[t], step, firstSwitch, cachedSwitch, rate[1], rate[0]);
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+}
+
+void benchmarkAutotune(void) {
+
+	/* Tune a universe, save the sizes to a temporary file and load them back in from there, then
+	   compare the default sizes with the tuned ones on the same settled particles. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 20;
+	const char *filename = "benchmark-workgroup-sizes.txt";
+	const Preset *presets[] = { &mediumClusters, &smallClusters };
+
+	printf("workgroup size autotuner on the GPU (%d particles, deterministic, after %d warmup timesteps)\n",
+		numParticles, warmupTimesteps);
+	printf("  preset          | tuning sec | scan setup sort order forces positions | loaded | timesteps/sec default -> tuned\n");
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, presets[p]);
+		u.deterministic = 1;
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+
+		remove(filename);
+		double t0 = getTime();
+		autotuneWorkGroupSizes(&u, filename);
+		double tuningTime = getTime() - t0;
+		int tuned[NUM_TUNED_PASSES];
+		memcpy(tuned, u.workGroupSizes, sizeof(tuned));
+
+		for (int i = 0; i < NUM_TUNED_PASSES; ++i)
+			u.workGroupSizes[i] = 256;
+		int found = loadWorkGroupSizes(&u, filename);
+		found = found && memcmp(u.workGroupSizes, tuned, sizeof(tuned)) == 0;
+		remove(filename);
+
+		double rate[2];
+		for (int t = 0; t <= 1; ++t) {
+			for (int i = 0; i < NUM_TUNED_PASSES; ++i)
+				u.workGroupSizes[i] = t ? tuned[i] : 256;
+			updateBuffers(&u);
+			simulateTimestep(&u);
+
+			rate[t] = measureTimestepsPerSecond(&u);
+		}
+
+		printf("  %-15s | %10.1f | %4d %5d %4d %5d %6d %9d | %-6s | %13.2f -> %.2f\n", presets[p]->name, tuningTime,
+			tuned[TUNED_SCAN_TILES], tuned[TUNED_SETUP_TILES], tuned[TUNED_SORT_PARTICLES], tuned[TUNED_ORDER_PARTICLES],
+			tuned[TUNED_UPDATE_FORCES], tuned[TUNED_UPDATE_POSITIONS], found ? "yes" : "no", rate[0], rate[1]);
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+}
+
+void benchmarkStageTimers(void) {
+
+	/* Run the same universe without and with the stage timers, and print the statistics they collected.
+	   The benchmarks don't draw, so there is no draw stage here. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 20;
+	const char *filename = "benchmark-stage-times.csv";
+	const Preset *presets[] = { &largeClusters, &mediumClusters, &smallClusters };
+
+	printf("GPU stage timers (%d particles, after %d warmup timesteps)\n", numParticles, warmupTimesteps);
+	printf("  preset          | timesteps/sec untimed -> timed | CSV rows | stage            | timesteps | min ms   | mean ms  | p99 ms\n");
+
+	for (int p = 0; p < (int)(sizeof(presets) / sizeof(presets[0])); ++p) {
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, presets[p]);
+		for (int i = 0; i < warmupTimesteps; ++i)
+			simulateTimestep(&u);
+
+		double rate[2];
+		for (int timed = 0; timed <= 1; ++timed) {
+			u.timeStages = timed;
+			if (timed)
+				setStageLog(&u, filename);
+			simulateTimestep(&u);
+
+			rate[timed] = measureTimestepsPerSecond(&u);
+		}
+		setStageLog(&u, NULL);
+
+		int rows = -1;
+		FILE *f = fopen(filename, "r");
+		if (f) {
+			for (int c = fgetc(f); c != EOF; c = fgetc(f))
+				rows += c == '\n';
+			fclose(f);
+		}
+		remove(filename);
+
+		const char *names[] = { "setup_tiles", "sort_particles", "update_forces", "update_positions", "draw" };
+		for (int s = 0; s < NUM_STAGES; ++s) {
+			StageStats stats = getStageStats(&u, (Stage)s);
+			if (stats.count == 0)
+				continue;
+			if (s == 0)
+				printf("  %-15s | %14.2f -> %-13.2f | %8d ", presets[p]->name, rate[0], rate[1], rows);
+			else
+				printf("  %-15s | %30s | %8s ", "", "", "");
+			printf("| %-16s | %9d | %8.3f | %8.3f | %.3f\n", names[s], stats.count, stats.min, stats.mean, stats.p99);
+		}
+
+		destroyUniverse(&u);
+	}
+	printf("\n");
+}
+
+void benchmarkUniformRing(void) {
+
+	/* The CPU time of a timestep is how long simulateTimestep takes to return, with the timesteps queued
+	   up back to back like in the main loop. updateUniforms is also timed on its own, because it's only a
+	   small part of the timestep. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 20;
+	const int numTimesteps = 20;
+	const int numUpdates = 10000;
+
+	printf("uniforms in a persistently mapped ring (%d particles, medium clusters, after %d warmup timesteps)\n",
+		numParticles, warmupTimesteps);
+	printf("  mode         | updateUniforms us | CPU submit ms/timestep | timesteps/sec\n");
+
+	Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, &mediumClusters);
+	for (int i = 0; i < warmupTimesteps; ++i)
+		simulateTimestep(&u);
+
+	for (int ring = 0; ring <= 1; ++ring) {
+		u.uniformRing = ring;
+		glFinish();
+
+		double t0 = getTime();
+		for (int i = 0; i < numUpdates; ++i)
+			updateUniforms(&u);
+		double update = 1e6 * (getTime() - t0) / numUpdates;
+		glFinish();
+
+		double submit = 0;
+		double t1 = getTime();
+		for (int i = 0; i < numTimesteps; ++i) {
+			double t2 = getTime();
+			simulateTimestep(&u);
+			submit += getTime() - t2;
+		}
+		glFinish();
+		double rate = numTimesteps / (getTime() - t1);
+
+		printf("  %-12s | %17.2f | %22.3f | %.2f\n", ring ? "mapped ring" : "glBufferData", update, 1000 * submit / numTimesteps, rate);
+	}
+
+	destroyUniverse(&u);
+	printf("\n");
+}
+
+/* Sum up the positions and velocities of the particles on the GPU, and count the particles of each type,
+   to check that they are still the same particles after they were sorted into tiles again. */
+static void checksumGpuParticles(Universe *u, double sums[4], int *counts) {
+	Particle *particles = (Particle *)malloc(u->numParticles * sizeof(Particle));
+	readGpuParticles(u, particles);
+	memset(sums, 0, 4 * sizeof(double));
+	memset(counts, 0, u->numParticleTypes * sizeof(int));
+	for (int i = 0; i < u->numParticles; ++i) {
+		sums[0] += particles[i].pos.x;
+		sums[1] += particles[i].pos.y;
+		sums[2] += particles[i].vel.x;
+		sums[3] += particles[i].vel.y;
+		counts[particles[i].type] += 1;
+	}
+	free(particles);
+}
+
+void benchmarkIncrementalUpdates(void) {
+
+	/* Each change is made on the host, marked, and sent with updateDirtyBuffers, and then a timestep is run
+	   to check that the GPU still simulates. The first row is a full updateBuffers for comparison. A larger
+	   largest interaction radius changes the tiles, so the particles are read back from the GPU and sorted
+	   into the new tiles, which has to give the same particles. The universe is made as much bigger as
+	   there are more particles than in the other benchmarks, so that the particles are as dense. */
+
+	const int numParticles = 1000000;
+	const int numTypes = 6;
+	const int warmupTimesteps = 2;
+	const float scale = 7;
+
+	printf("incremental buffer updates (%d particles, %d types, medium clusters, after %d warmup timesteps)\n",
+		numParticles, numTypes, warmupTimesteps);
+	printf("  change                   | bytes uploaded | ms     | check\n");
+
+	Universe u = createBenchmarkUniverse(BACKEND_GPU, numTypes, numParticles, &mediumClusters);
+	struct UniverseInternal *ui = &u.internal;
+	u.width *= scale;
+	u.height *= scale;
+	randomize(&u, mediumClusters.attractionMean, mediumClusters.attractionStddev, mediumClusters.minRadius0,
+		mediumClusters.minRadius1, mediumClusters.maxRadius0, mediumClusters.maxRadius1);
+	for (int i = 0; i < warmupTimesteps; ++i)
+		simulateTimestep(&u);
+
+	const char *names[] = { "everything", "particles", "particle types", "interactions", "interactions, new radius" };
+	const int numInteractions = numTypes * numTypes;
+	ParticleInteraction *interactions = (ParticleInteraction *)malloc(numInteractions * sizeof(ParticleInteraction));
+	double sums[2][4];
+	int counts[2][64];
+
+	for (int change = 0; change < 5; ++change) {
+		const char *check = "-";
+		if (change == 3 || change == 4) {
+			for (int i = 0; i < numInteractions; ++i)
+				u.interactions[i].attraction = randGaussian(&u.rng, mediumClusters.attractionMean, mediumClusters.attractionStddev);
+		}
+		if (change == 4) {
+			float maxRadius = 0;
+			for (int i = 0; i < numInteractions; ++i)
+				maxRadius = fmaxf(maxRadius, u.interactions[i].maxRadius);
+			getInteraction(&u, 0, 1)->maxRadius = getInteraction(&u, 1, 0)->maxRadius = 1.25f * maxRadius;
+			checksumGpuParticles(&u, sums[0], counts[0]);
+		}
+
+		glFinish();
+		size_t bytes = ui->uploadedBytes;
+		double t0 = getTime();
+		if (change == 0)
+			updateBuffers(&u);
+		else {
+			markDirty(&u, change == 1 ? DIRTY_PARTICLES : change == 2 ? DIRTY_TYPES : DIRTY_INTERACTIONS);
+			updateDirtyBuffers(&u);
+		}
+		glFinish();
+		double elapsed = getTime() - t0;
+		bytes = ui->uploadedBytes - bytes;
+
+		if (change == 3) {
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuInteractions);
+			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, numInteractions * sizeof(ParticleInteraction), interactions);
+			check = memcmp(interactions, u.interactions, numInteractions * sizeof(ParticleInteraction)) == 0 ? "uploaded" : "WRONG";
+		}
+		if (change == 4) {
+			/* The particles are summed up in another order, so the sums can differ in the last couple of bits. */
+			checksumGpuParticles(&u, sums[1], counts[1]);
+			int same = memcmp(counts[0], counts[1], numTypes * sizeof(int)) == 0;
+			for (int i = 0; i < 4; ++i)
+				same = same && fabs(sums[0][i] - sums[1][i]) <= 1e-9 * fabs(sums[0][i]) + 1e-6;
+			check = same ? "same particles" : "WRONG";
+		}
+		simulateTimestep(&u);
+
+		printf("  %-24s | %14zu | %6.1f | %s\n", names[change], bytes, 1000 * elapsed, check);
+	}
+
+	free(interactions);
+	destroyUniverse(&u);
+	printf("\n");
+}
+
+typedef struct SnapshotCheck {
+	int delivered;
+	int lastTimestep;
+	int inOrder;
+	Particle *particles; /* if not NULL, the particles of each snapshot are copied here */
+} SnapshotCheck;
+
+static void onSnapshot(const Snapshot *snapshot, void *userData) {
+	SnapshotCheck *check = (SnapshotCheck *)userData;
+	check->inOrder = check->inOrder && snapshot->timestep > check->lastTimestep;
+	check->lastTimestep = snapshot->timestep;
+	check->delivered += 1;
+	if (!check->particles)
+		return;
+	for (int i = 0; i < snapshot->numParticles; ++i) {
+		check->particles[i].pos = snapshot->hot[i].pos;
+		check->particles[i].vel = snapshot->cold[i].vel;
+		check->particles[i].type = snapshot->hot[i].type;
+	}
+}
+
+void benchmarkSnapshots(void) {
+
+	/* Like benchmarkUniformRing, the CPU time of a timestep is how long simulateTimestep takes to return.
+	   The timesteps get slower as the particles cluster, so the intervals take turns in short rounds.
+	   At the end the ring is drained with collectSnapshots, and the snapshot of one more timestep is
+	   compared with the particles read back directly from the GPU. */
+
+	const int numParticles = 20000;
+	const int warmupTimesteps = 20;
+	const int numRounds = 5;
+	const int roundTimesteps = 10;
+	const int intervals[] = { 0, 10, 1 };
+	const int numIntervals = (int)(sizeof(intervals) / sizeof(intervals[0]));
+
+	printf("asynchronous particle snapshots (%d particles, medium clusters, after %d warmup timesteps)\n",
+		numParticles, warmupTimesteps);
+	printf("  every    | CPU submit ms/timestep | timesteps/sec | delivered | dropped | in order | same particles\n");
+
+	Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, &mediumClusters);
+	struct UniverseInternal *ui = &u.internal;
+	for (int i = 0; i < warmupTimesteps; ++i)
+		simulateTimestep(&u);
+
+	SnapshotCheck checks[3];
+	double submit[3] = { 0, 0, 0 }, total[3] = { 0, 0, 0 };
+	int dropped[3] = { 0, 0, 0 };
+	for (int k = 0; k < numIntervals; ++k) {
+		SnapshotCheck check = { 0, -1, 1, NULL };
+		checks[k] = check;
+	}
+
+	for (int round = 0; round < numRounds; ++round) {
+		for (int k = 0; k < numIntervals; ++k) {
+			setSnapshotCallback(&u, intervals[k], onSnapshot, &checks[k]);
+			ui->droppedSnapshots = 0;
+			glFinish();
+
+			double t0 = getTime();
+			for (int i = 0; i < roundTimesteps; ++i) {
+				double t1 = getTime();
+				simulateTimestep(&u);
+				submit[k] += getTime() - t1;
+			}
+			glFinish();
+			total[k] += getTime() - t0;
+			collectSnapshots(&u, 1);
+			dropped[k] += ui->droppedSnapshots;
+		}
+	}
+
+	Particle *expected = (Particle *)malloc(numParticles * sizeof(Particle));
+	Particle *snapshot = (Particle *)malloc(numParticles * sizeof(Particle));
+	SnapshotCheck check = { 0, -1, 1, snapshot };
+	setSnapshotCallback(&u, 1, onSnapshot, &check);
+	simulateTimestep(&u);
+	glFinish();
+	readGpuParticles(&u, expected);
+	collectSnapshots(&u, 1);
+	int same = check.delivered == 1;
+	for (int i = 0; i < numParticles; ++i) {
+		same = same && memcmp(&expected[i].pos, &snapshot[i].pos, sizeof(vec2)) == 0
+			&& memcmp(&expected[i].vel, &snapshot[i].vel, sizeof(vec2)) == 0 && expected[i].type == snapshot[i].type;
+	}
+	setSnapshotCallback(&u, 0, NULL, NULL);
+
+	const int numTimesteps = numRounds * roundTimesteps;
+	for (int k = 0; k < numIntervals; ++k) {
+		char every[16];
+		snprintf(every, sizeof(every), intervals[k] ? "%d" : "off", intervals[k]);
+		printf("  %-8s | %22.3f | %13.2f | %9d | %7d | %-8s | %s\n", every, 1000 * submit[k] / numTimesteps, numTimesteps / total[k],
+			checks[k].delivered, dropped[k], checks[k].inOrder ? "yes" : "NO", intervals[k] == 1 ? (same ? "yes" : "NO") : "-");
+	}
+
+	free(expected);
+	free(snapshot);
+	destroyUniverse(&u);
+	printf("\n");
+}
+
+void benchmarkProgramCache(void) {
+
+	/* Each run creates a universe and simulates its first timestep, which compiles (or loads) all of the
+	   programs that a deterministic timestep and drawing need. The last run flips a byte in the middle of
+	   the cache file, which lands in one of the binaries, so the driver has to reject it. Every run has to
+	   give the same particles as the one without the cache. */
+
+	const char *filename = "program-cache-benchmark.bin";
+	const int numParticles = 1000;
+	const char *names[] = { "off", "empty", "filled", "corrupted" };
+
+	printf("program binary cache (universe creation and first timestep, %d particles)\n", numParticles);
+	printf("  cache     | ms      | hits | misses | rejected | same particles\n");
+
+	remove(filename);
+	Particle *expected = (Particle *)malloc(numParticles * sizeof(Particle));
+	Particle *particles = (Particle *)malloc(numParticles * sizeof(Particle));
+
+	for (int run = 0; run < 4; ++run) {
+		if (run == 3) {
+			FILE *f = fopen(filename, "r+b");
+			if (f) {
+				fseek(f, 0, SEEK_END);
+				long middle = ftell(f) / 2;
+				fseek(f, middle, SEEK_SET);
+				int byte = fgetc(f);
+				fseek(f, middle, SEEK_SET);
+				fputc(byte ^ 0xff, f);
+				fclose(f);
+			}
+		}
+		setProgramCache(run == 0 ? NULL : filename);
+
+		glFinish();
+		double t0 = getTime();
+		Universe u = createBenchmarkUniverse(BACKEND_GPU, 6, numParticles, &mediumClusters);
+		u.deterministic = 1;
+		simulateTimestep(&u);
+		glFinish();
+		double elapsed = getTime() - t0;
+
+		readGpuParticles(&u, run == 0 ? expected : particles);
+		int same = run == 0 || memcmp(expected, particles, numParticles * sizeof(Particle)) == 0;
+		destroyUniverse(&u);
+
+		ProgramCacheStats stats = getProgramCacheStats();
+		printf("  %-9s | %7.1f | %4d | %6d | %8d | %s\n", names[run], 1000 * elapsed, stats.hits, stats.misses, stats.rejected,
+			run == 0 ? "-" : same ? "yes" : "NO");
+	}
+
+	setProgramCache(NULL);
+	remove(filename);
+	free(expected);
+	free(particles);
+	printf("\n");
+}
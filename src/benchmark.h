@@ -0,0 +1,89 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/* Micro-benchmarks for individual parts of the simulation. Each benchmark prints a small
+   table of results to stdout. Benchmarks that create a universe need a current OpenGL context. */
+
+/* Run all of the micro-benchmarks below, one after the other. */
+void runMicroBenchmarks(void);
+
+/* Measure how many particle pairs per second each of the CPU force kernels can evaluate. */
+void benchmarkForceKernels(void);
+
+/* Compare the static tile split with the work-stealing scheduler in the CPU force pass on the
+   cluster presets, and report how busy the threads were with each. This uses the full stencil,
+   whose tasks split heavy tiles; the half stencil runs whole tiles in colour phases. */
+void benchmarkScheduler(void);
+
+/* Compare the full 3x3 stencil with the half stencil in the CPU force pass on the cluster presets. */
+void benchmarkHalfStencil(void);
+
+/* Measure the CPU backend against its target of 100'000 particles at 30 timesteps per second, from the
+   seed of the BENCHMARK block in main.c, with 1, 2, 4, ... threads up to the number of logical processors. */
+void benchmarkCpuBackend(void);
+
+/* Check whether runs from the same seed are bit-identical with and without deterministic mode,
+   and measure how much deterministic mode costs on the GPU. */
+void benchmarkDeterministic(void);
+
+/* Compare the GPU force pass with and without type-sorted tiles for 2 to 64 particle types. */
+void benchmarkTypeSorted(void);
+
+/* Compare the force error, the neighbour bytes per timestep and the speed of the compact particle
+   encoding in the GPU force pass with the float32 path. */
+void benchmarkCompact(void);
+
+/* Compare the default, interleaved and striped NUMA placements in the CPU backend at 1M particles. */
+void benchmarkPlacement(void);
+
+/* Check the GPU scan that calculates the tile offsets, and measure it for 1k to 4M tiles. */
+void benchmarkTileScan(void);
+
+/* Compare the GPU ordering pass of deterministic mode over all tiles with the indirect dispatch over the
+   active tiles only, on the large and small cluster presets in the default world, and in a non-wrapping one
+   with 16 times the area where the particles only cover one corner. */
+void benchmarkActiveTiles(void);
+
+/* Compare the lane utilisation and the speed of the GPU force pass with one tile per workgroup (heavy tiles
+   still split) and with the tiles packed into workgroups by how many particles they hold, on the cluster presets. */
+void benchmarkPackedTiles(void);
+
+/* Compare tiles of the full interaction radius with tiles of 1/2 to 1/4 of it and the wider blocks of neighbor
+   tiles that go with them in the GPU force pass, and report how many of the evaluated pairs are in range. */
+void benchmarkTileDivisions(void);
+
+/* Compare the force error and the speed of the tabulated force law in the GPU force pass with the analytic one. */
+void benchmarkTabulated(void);
+
+/* Compare the GPU force pass reading the interactions from their buffer with staging them in shared memory
+   for 4 to 32 particle types, and check that both give the same particles. */
+void benchmarkStagedInteractions(void);
+
+/* Measure how long the first timestep after switching to another variant of the GPU passes takes, which
+   compiles it, compared to switching back to a cached variant, for 4 to 64 particle types. */
+void benchmarkShaderVariants(void);
+
+/* Run the workgroup size autotuner on the cluster presets, check that the sizes it saves load back in,
+   and compare the speed of the GPU passes with the default and the tuned sizes. */
+void benchmarkAutotune(void);
+
+/* Measure what the GPU stage timers cost on the cluster presets, and print the statistics they collect. */
+void benchmarkStageTimers(void);
+
+/* Compare the CPU time of sending the uniforms, and of submitting a GPU timestep, between reallocating
+   the uniform buffer every time and writing into the persistently mapped ring of uniform blocks. */
+void benchmarkUniformRing(void);
+
+/* Measure how many bytes are sent to the GPU, and how long that takes, when only the particles, the particle
+   types or the interactions are marked as changed, compared to sending everything with updateBuffers. */
+void benchmarkIncrementalUpdates(void);
+
+/* Measure what taking asynchronous snapshots of the particles every 10 timesteps and every timestep adds to the
+   CPU and the total time of a GPU timestep, and check that the snapshots arrive in order and hold the particles. */
+void benchmarkSnapshots(void);
+
+/* Compare creating a universe and simulating its first timestep without the program cache, with an empty one,
+   with a filled one, and with one whose binaries the driver rejects, and check that they all simulate the same. */
+void benchmarkProgramCache(void);
+
+#endif
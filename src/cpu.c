@@ -0,0 +1,624 @@
+#include "cpu.h"
+#include "forces.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* How many force tasks to aim for per thread. More tasks make it easier to balance the
+   work, but each task has some overhead and scatters the work around the caches. */
+#define TASKS_PER_THREAD 8
+
+/* The maximum number of histogram entries (blocks * tiles) when sorting the particles into tiles. */
+#define MAX_HISTOGRAM_SIZE (1 << 22)
+
+/* Up to this many threads the per-thread sums of the tile scan live on the stack. */
+#define MAX_THREADS 256
+
+/* The granularity at which memory is placed on NUMA nodes. */
+#define NUMA_PAGE_SIZE 4096
+
+/* This file is a straight port of the compute shader pipeline to the CPU.
+   Each pass below corresponds to one of the compute shaders and is run on every
+   thread of the universe's thread pool. Where a shader uses one thread per particle
+   or one workgroup per tile, the CPU version splits the particles or tiles into
+   one contiguous block per thread instead. */
+
+/* Everything the passes need to know about the current timestep.
+   This mirrors the UNIFORMS block of the compute shaders. */
+typedef struct Step {
+	Universe *u;
+	int numTilesX;
+	int numTilesY;
+	int numTiles;
+	float invTileSize;
+	float deltaTime;
+	float width;
+	float height;
+	float centerX;
+	float centerY;
+	float drag; /* pow(1 - friction, deltaTime), this is the same for every particle so only calculate it once */
+	float particleRadius;
+	int wrap;
+	ForceParams forceParams;
+	ForceKernel forceKernel; /* the widest SIMD kernel the running CPU supports */
+	PairKernel pairKernel;   /* the same, for the half-stencil force pass */
+} Step;
+
+/* The state of binParticles(), shared between all of the threads. */
+typedef struct Binning {
+	const Particles *src;
+	Particles *dst;
+	TileList *tileLists;
+	int *particleTiles;
+	int *histograms;    /* numBlocks histograms of numTiles each */
+	int *threadSums;    /* the number of particles in each thread's range of tiles */
+	int numBlocks;      /* how many blocks the particles are split into */
+	int numParticles;
+	int numTiles;
+	int numTilesX;
+	float invTileSize;
+} Binning;
+
+/* Get which tile the given position belongs to. */
+static int getTileID(const Binning *b, float x, float y) {
+	int tileID = (int)(y * b->invTileSize) * b->numTilesX + (int)(x * b->invTileSize);
+	if (tileID < 0) tileID = 0;
+	if (tileID >= b->numTiles) tileID = b->numTiles - 1;
+	return tileID;
+}
+
+/* Count how many particles of each block go into each tile. */
+static void binHistogram(void *data, int threadID, int numThreads) {
+	Binning *b = (Binning *)data;
+	(void)numThreads;
+	if (threadID >= b->numBlocks)
+		return;
+
+	int *histogram = &b->histograms[threadID * b->numTiles];
+	memset(histogram, 0, b->numTiles * sizeof(int));
+
+	int begin, end;
+	splitWork(b->numParticles, threadID, b->numBlocks, &begin, &end);
+	for (int id = begin; id < end; ++id) {
+		int tileID = getTileID(b, b->src->posX[id], b->src->posY[id]);
+		b->particleTiles[id] = tileID;
+		histogram[tileID]++;
+	}
+}
+
+/* Sum up the histograms over each thread's range of tiles. */
+static void binReduce(void *data, int threadID, int numThreads) {
+	Binning *b = (Binning *)data;
+	int begin, end;
+	splitWork(b->numTiles, threadID, numThreads, &begin, &end);
+
+	int sum = 0;
+	for (int block = 0; block < b->numBlocks; ++block) {
+		const int *histogram = &b->histograms[block * b->numTiles];
+		for (int t = begin; t < end; ++t)
+			sum += histogram[t];
+	}
+	b->threadSums[threadID] = sum;
+}
+
+/* Calculate the offset of each tile, and replace the histogram counts with the
+   position at which each block starts writing its particles into each tile. */
+static void binScan(void *data, int threadID, int numThreads) {
+	Binning *b = (Binning *)data;
+	int begin, end;
+	splitWork(b->numTiles, threadID, numThreads, &begin, &end);
+
+	int offset = b->threadSums[threadID];
+	for (int t = begin; t < end; ++t) {
+		b->tileLists[t].offset = offset;
+		for (int block = 0; block < b->numBlocks; ++block) {
+			int *count = &b->histograms[block * b->numTiles + t];
+			int blockCount = *count;
+			*count = offset;
+			offset += blockCount;
+		}
+		b->tileLists[t].capacity = offset - b->tileLists[t].offset;
+		b->tileLists[t].size = b->tileLists[t].capacity;
+	}
+}
+
+/* Move each particle into its tile. Each block writes its particles in order to its
+   own part of each tile, so the particles stay in the same order within a tile. */
+static void binScatter(void *data, int threadID, int numThreads) {
+	Binning *b = (Binning *)data;
+	(void)numThreads;
+	if (threadID >= b->numBlocks)
+		return;
+
+	int *histogram = &b->histograms[threadID * b->numTiles];
+	const Particles *src = b->src;
+	Particles *dst = b->dst;
+
+	int begin, end;
+	splitWork(b->numParticles, threadID, b->numBlocks, &begin, &end);
+	for (int id = begin; id < end; ++id) {
+		int address = histogram[b->particleTiles[id]]++;
+		dst->posX[address] = src->posX[id];
+		dst->posY[address] = src->posY[id];
+		dst->velX[address] = src->velX[id];
+		dst->velY[address] = src->velY[id];
+		dst->type[address] = src->type[id];
+	}
+}
+
+void binParticles(Universe *u, const Particles *src, Particles *dst) {
+	struct UniverseInternal *ui = &u->internal;
+	int numThreads = getNumThreads(ui->threadPool);
+
+	Binning b;
+	b.src = src;
+	b.dst = dst;
+	b.tileLists = ui->tileLists;
+	b.particleTiles = ui->particleTiles;
+	b.numParticles = u->numParticles;
+	b.numTiles = ui->numTilesX * ui->numTilesY;
+	b.numTilesX = ui->numTilesX;
+	b.invTileSize = ui->invTileSize;
+
+	/* Every block needs its own histogram over all tiles. For huge worlds that gets expensive,
+	   so use fewer blocks (and fewer threads in the histogram and scatter passes) if needed. */
+	b.numBlocks = MAX_HISTOGRAM_SIZE / b.numTiles;
+	if (b.numBlocks > numThreads) b.numBlocks = numThreads;
+	if (b.numBlocks < 1) b.numBlocks = 1;
+	if (b.numBlocks * b.numTiles > ui->histogramsSize) {
+		ui->histogramsSize = b.numBlocks * b.numTiles;
+		ui->histograms = (int *)realloc(ui->histograms, ui->histogramsSize * sizeof(int));
+	}
+	b.histograms = ui->histograms;
+
+	int threadSums[MAX_THREADS];
+	b.threadSums = numThreads <= MAX_THREADS ? threadSums : (int *)malloc(numThreads * sizeof(int));
+
+	runParallel(ui->threadPool, binHistogram, &b);
+	runParallel(ui->threadPool, binReduce, &b);
+
+	/* Exclusive scan of the per-thread sums, there are only a few of these. */
+	int offset = 0;
+	for (int i = 0; i < numThreads; ++i) {
+		int sum = b.threadSums[i];
+		b.threadSums[i] = offset;
+		offset += sum;
+	}
+
+	runParallel(ui->threadPool, binScan, &b);
+	runParallel(ui->threadPool, binScatter, &b);
+
+	if (b.threadSums != threadSums)
+		free(b.threadSums);
+}
+
+/* The state of placeParticles(), shared between all of the threads. */
+typedef struct Placing {
+	const Particles *src;
+	Particles *dst;
+	int numParticles;
+	Placement placement;
+} Placing;
+
+/* Copy one array of the particles (they all have 4-byte elements). Interleaved, every thread copies every numThreads'th page.
+   Striped, every thread copies the same range of particles that it moves in binParticles and
+   updatePositions, and that it starts out with in the force pass. */
+static void placeLane(const Placing *p, void *dst, const void *src, int threadID, int numThreads) {
+	const size_t size = (size_t)p->numParticles * sizeof(float);
+	if (p->placement == PLACEMENT_INTERLEAVED) {
+		for (size_t page = (size_t)threadID * NUMA_PAGE_SIZE; page < size; page += (size_t)numThreads * NUMA_PAGE_SIZE) {
+			size_t count = size - page < NUMA_PAGE_SIZE ? size - page : NUMA_PAGE_SIZE;
+			memcpy((char *)dst + page, (const char *)src + page, count);
+		}
+	} else {
+		int begin, end;
+		splitWork(p->numParticles, threadID, numThreads, &begin, &end);
+		memcpy((float *)dst + begin, (const float *)src + begin, (end - begin) * sizeof(float));
+	}
+}
+
+static void placeJob(void *data, int threadID, int numThreads) {
+	Placing *p = (Placing *)data;
+	placeLane(p, p->dst->posX, p->src->posX, threadID, numThreads);
+	placeLane(p, p->dst->posY, p->src->posY, threadID, numThreads);
+	placeLane(p, p->dst->velX, p->src->velX, threadID, numThreads);
+	placeLane(p, p->dst->velY, p->src->velY, threadID, numThreads);
+	placeLane(p, p->dst->type, p->src->type, threadID, numThreads);
+}
+
+void placeParticles(Universe *u, Particles *particles) {
+	Particles placed = allocParticles(u->numParticles);
+
+	Placing p;
+	p.src = particles;
+	p.dst = &placed;
+	p.numParticles = u->numParticles;
+	p.placement = u->internal.placement;
+	runParallel(u->internal.threadPool, placeJob, &p);
+
+	freeParticles(particles);
+	*particles = placed;
+}
+
+/* Get the 3x3 neighboring tiles of a tile, wrapping around the edges like update_forces.glsl does.
+   Because the particles are sorted by tile in row-major order, the 3 neighbors in each row of
+   the 3x3 block usually sit right next to each other in memory. Those are merged into a single
+   run of particles so the force kernel can stream through them in one go. Returns the number of
+   runs and the total number of neighboring particles. */
+static int getNeighborRuns(const Step *s, int tileID, int runOffset[9], int runSize[9], int *numNeighbors) {
+	const TileList *tileLists = s->u->internal.tileLists;
+	int tileX = tileID % s->numTilesX;
+	int tileY = tileID / s->numTilesX;
+	int numRuns = 0;
+	*numNeighbors = 0;
+
+	for (int i = 0; i < 9; ++i) {
+		int nx = tileX + i % 3 - 1;
+		int ny = tileY + i / 3 - 1;
+		if (nx < 0) nx += s->numTilesX;
+		if (ny < 0) ny += s->numTilesY;
+		if (nx >= s->numTilesX) nx -= s->numTilesX;
+		if (ny >= s->numTilesY) ny -= s->numTilesY;
+		int neighborID = ny * s->numTilesX + nx;
+		if (neighborID < 0) neighborID = 0;
+		if (neighborID >= s->numTiles) neighborID = s->numTiles - 1;
+
+		TileList neighbor = tileLists[neighborID];
+		*numNeighbors += neighbor.size;
+		if (numRuns > 0 && runOffset[numRuns - 1] + runSize[numRuns - 1] == neighbor.offset) {
+			runSize[numRuns - 1] += neighbor.size;
+		} else {
+			runOffset[numRuns] = neighbor.offset;
+			runSize[numRuns] = neighbor.size;
+			++numRuns;
+		}
+	}
+	return numRuns;
+}
+
+/* Split the force pass into tasks for the scheduler. The work for a tile is roughly the number of
+   particles in it times the number of neighbors they have. Clusters can make a handful of tiles
+   hold most of the work, so tiles with more than their fair share of work are split into several
+   tasks, each of which handles a range of the tile's particles. Without work stealing, each tile
+   is a single task, which is the same as update_forces.glsl running one workgroup per tile. */
+static int buildForceTasks(Step *s) {
+	struct UniverseInternal *ui = &s->u->internal;
+	const TileList *tileLists = ui->tileLists;
+	const int numThreads = getNumThreads(ui->threadPool);
+
+	double totalWork = 0;
+	for (int tileID = 0; tileID < s->numTiles; ++tileID) {
+		if (tileLists[tileID].size == 0)
+			continue;
+		int runOffset[9], runSize[9], numNeighbors;
+		getNeighborRuns(s, tileID, runOffset, runSize, &numNeighbors);
+		totalWork += (double)tileLists[tileID].size * numNeighbors;
+	}
+	double taskWork = totalWork / (numThreads * TASKS_PER_THREAD) + 1;
+
+	int numTasks = 0;
+	for (int tileID = 0; tileID < s->numTiles; ++tileID) {
+		TileList tile = tileLists[tileID];
+		if (tile.size == 0)
+			continue;
+
+		int numSplits = 1;
+		if (s->u->workStealing) {
+			int runOffset[9], runSize[9], numNeighbors;
+			getNeighborRuns(s, tileID, runOffset, runSize, &numNeighbors);
+			numSplits = (int)ceil((double)tile.size * numNeighbors / taskWork);
+			if (numSplits > tile.size) numSplits = tile.size;
+			if (numSplits < 1) numSplits = 1;
+		}
+
+		if (numTasks + numSplits > ui->tasksCapacity) {
+			ui->tasksCapacity = 2 * (numTasks + numSplits);
+			ui->tasks = (Task *)realloc(ui->tasks, ui->tasksCapacity * sizeof(Task));
+		}
+
+		for (int i = 0; i < numSplits; ++i) {
+			int begin, end;
+			splitWork(tile.size, i, numSplits, &begin, &end);
+			Task *task = &ui->tasks[numTasks++];
+			task->id = tileID;
+			task->begin = tile.offset + begin;
+			task->end = tile.offset + end;
+		}
+	}
+	return numTasks;
+}
+
+/* Port of update_forces.glsl. Each task sums up the forces from all particles in the 3x3 neighboring
+   tiles for a range of particles in one tile, and then updates their velocities. */
+static void updateForces(void *data, const Task *task, int threadID) {
+	Step *s = (Step *)data;
+	Universe *u = s->u;
+	Particles *p = &u->particles;
+	(void)threadID;
+
+	int runOffset[9], runSize[9], numNeighbors;
+	int numRuns = getNeighborRuns(s, task->id, runOffset, runSize, &numNeighbors);
+
+	for (int address = task->begin; address < task->end; ++address) {
+		const ParticleInteraction *pInteractions = &u->interactions[p->type[address] * u->numParticleTypes];
+		vec2 pos;
+		pos.x = p->posX[address];
+		pos.y = p->posY[address];
+
+		float fx = 0;
+		float fy = 0;
+		for (int r = 0; r < numRuns; ++r) {
+			int q = runOffset[r];
+			vec2 f = s->forceKernel(&s->forceParams, pos, pInteractions, &p->posX[q], &p->posY[q], &p->type[q], runSize[r]);
+			fx += f.x;
+			fy += f.y;
+		}
+
+		p->velX[address] += s->deltaTime * fx;
+		p->velY[address] += s->deltaTime * fy;
+	}
+}
+
+/* The half-stencil force pass visits every pair of neighboring tiles only once: each tile is paired
+   with itself and with the 4 tiles after it (right, and the 3 tiles below), and every pair of particles
+   gets the force in both directions at once. This halves the distance and sqrt work, but it is only
+   correct if every interaction has the same radii in both directions, which randomize() ensures. */
+
+/* Number of tiles in the half stencil, not counting the tile itself. */
+#define HALF_STENCIL_SIZE 4
+
+/* Check whether the half-stencil force pass can be used for this timestep. With fewer than 3 tiles
+   in a direction, the wrapped 3x3 block contains some tiles more than once, and the half stencil
+   would not be able to reproduce that. */
+static int canUseHalfStencil(const Step *s) {
+	const Universe *u = s->u;
+	if (!u->halfStencil || s->numTilesX < 3 || s->numTilesY < 3)
+		return 0;
+	for (int i = 0; i < u->numParticleTypes; ++i) {
+		for (int j = i + 1; j < u->numParticleTypes; ++j) {
+			const ParticleInteraction *ij = &u->interactions[i * u->numParticleTypes + j];
+			const ParticleInteraction *ji = &u->interactions[j * u->numParticleTypes + i];
+			if (ij->minRadius != ji->minRadius || ij->maxRadius != ji->maxRadius)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Like getNeighborRuns, but for the 4 tiles of the half stencil. */
+static int getHalfNeighborRuns(const Step *s, int tileID, int runOffset[HALF_STENCIL_SIZE], int runSize[HALF_STENCIL_SIZE]) {
+	static const int stencil[HALF_STENCIL_SIZE][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+	const TileList *tileLists = s->u->internal.tileLists;
+	int tileX = tileID % s->numTilesX;
+	int tileY = tileID / s->numTilesX;
+	int numRuns = 0;
+
+	for (int i = 0; i < HALF_STENCIL_SIZE; ++i) {
+		int nx = tileX + stencil[i][0];
+		int ny = tileY + stencil[i][1];
+		if (nx < 0) nx += s->numTilesX;
+		if (nx >= s->numTilesX) nx -= s->numTilesX;
+		if (ny >= s->numTilesY) ny -= s->numTilesY;
+
+		TileList neighbor = tileLists[ny * s->numTilesX + nx];
+		if (numRuns > 0 && runOffset[numRuns - 1] + runSize[numRuns - 1] == neighbor.offset) {
+			runSize[numRuns - 1] += neighbor.size;
+		} else {
+			runOffset[numRuns] = neighbor.offset;
+			runSize[numRuns] = neighbor.size;
+			++numRuns;
+		}
+	}
+	return numRuns;
+}
+
+/* The tasks of the half-stencil pass write to the velocities of their own tile and of the tiles in
+   its half stencil, so two tasks may only run at the same time if those don't overlap. The tiles are
+   coloured so that tiles of the same colour are at least 3 columns or 2 rows apart, and each colour
+   runs on its own. If the number of columns isn't a multiple of 3 (or rows of 2), the leftover
+   columns (or rows) would overlap with the first ones when wrapping around, so they get their own
+   colours. Returns the number of colours, and the first task of each colour in colorOffset. */
+static int buildHalfStencilTasks(Step *s, int colorOffset[]) {
+	struct UniverseInternal *ui = &s->u->internal;
+	const TileList *tileLists = ui->tileLists;
+	const int fullColumns = s->numTilesX - s->numTilesX % 3;
+	const int fullRows = s->numTilesY - s->numTilesY % 2;
+	const int numColorsX = 3 + s->numTilesX % 3;
+	const int numColorsY = 2 + s->numTilesY % 2;
+	const int numColors = numColorsX * numColorsY;
+
+	if (s->numTiles > ui->tasksCapacity) {
+		ui->tasksCapacity = s->numTiles;
+		ui->tasks = (Task *)realloc(ui->tasks, ui->tasksCapacity * sizeof(Task));
+	}
+
+	int numTasks = 0;
+	for (int color = 0; color < numColors; ++color) {
+		colorOffset[color] = numTasks;
+		int colorX = color % numColorsX;
+		int colorY = color / numColorsX;
+		int startX = colorX < 3 ? colorX : fullColumns + colorX - 3;
+		int stepX = colorX < 3 ? 3 : s->numTilesX;
+		int endX = colorX < 3 ? fullColumns : s->numTilesX;
+		int startY = colorY < 2 ? colorY : fullRows;
+		int stepY = colorY < 2 ? 2 : s->numTilesY;
+		int endY = colorY < 2 ? fullRows : s->numTilesY;
+
+		for (int y = startY; y < endY; y += stepY) {
+			for (int x = startX; x < endX; x += stepX) {
+				int tileID = y * s->numTilesX + x;
+				TileList tile = tileLists[tileID];
+				if (tile.size == 0)
+					continue;
+				Task *task = &ui->tasks[numTasks++];
+				task->id = tileID;
+				task->begin = tile.offset;
+				task->end = tile.offset + tile.size;
+			}
+		}
+	}
+	colorOffset[numColors] = numTasks;
+	return numColors;
+}
+
+/* Run the tasks of the force pass. With striped placement each thread starts out with the tasks
+   that fall into its own band of particles, which is the memory on its own node. The tasks are
+   in the order of their particles, so the bands split them into contiguous blocks. */
+static void runForceTasks(Step *s, const Task *tasks, int numTasks, TaskFunc func) {
+	struct UniverseInternal *ui = &s->u->internal;
+	if (ui->placement != PLACEMENT_STRIPED) {
+		runTasks(ui->threadPool, tasks, numTasks, func, s, s->u->workStealing);
+		return;
+	}
+
+	int numThreads = getNumThreads(ui->threadPool);
+	int firstTasks[MAX_THREADS + 1];
+	int *first = numThreads <= MAX_THREADS ? firstTasks : (int *)malloc((numThreads + 1) * sizeof(int));
+
+	int taskID = 0;
+	for (int i = 0; i < numThreads; ++i) {
+		int begin, end;
+		splitWork(s->u->numParticles, i, numThreads, &begin, &end);
+		while (taskID < numTasks && tasks[taskID].begin < begin)
+			++taskID;
+		first[i] = taskID;
+	}
+	first[numThreads] = numTasks;
+
+	runTasksSplit(ui->threadPool, tasks, numTasks, first, func, s, s->u->workStealing);
+
+	if (first != firstTasks)
+		free(first);
+}
+
+/* Each task of the half-stencil pass handles every pair of particles within one tile, and every pair
+   between the tile and the tiles in its half stencil. The forces go straight into the velocities. */
+static void updateForcesHalf(void *data, const Task *task, int threadID) {
+	Step *s = (Step *)data;
+	Universe *u = s->u;
+	Particles *p = &u->particles;
+	(void)threadID;
+
+	int runOffset[HALF_STENCIL_SIZE], runSize[HALF_STENCIL_SIZE];
+	int numRuns = getHalfNeighborRuns(s, task->id, runOffset, runSize);
+
+	for (int address = task->begin; address < task->end; ++address) {
+		int type = p->type[address];
+		const ParticleInteraction *row = &u->interactions[type * u->numParticleTypes];
+		const ParticleInteraction *column = &u->interactions[type];
+		vec2 pos;
+		pos.x = p->posX[address];
+		pos.y = p->posY[address];
+
+		/* The particles after this one in the same tile come first. They usually run right
+		   into the tile on the right, in which case the two are handled in one go. */
+		int q = address + 1;
+		int count = task->end - q;
+		int r = 0;
+		if (runOffset[0] == task->end)
+			count += runSize[r++];
+
+		float fx = 0;
+		float fy = 0;
+		for (;;) {
+			vec2 f = s->pairKernel(&s->forceParams, pos, row, column, u->numParticleTypes,
+				&p->posX[q], &p->posY[q], &p->type[q], &p->velX[q], &p->velY[q], s->deltaTime, count);
+			fx += f.x;
+			fy += f.y;
+			if (r == numRuns)
+				break;
+			q = runOffset[r];
+			count = runSize[r];
+			++r;
+		}
+
+		p->velX[address] += s->deltaTime * fx;
+		p->velY[address] += s->deltaTime * fy;
+	}
+}
+
+/* Port of update_positions.glsl. Move the particles. The tile capacities for the next timestep
+   are counted by binParticles(), so unlike the shader this doesn't have to count them. */
+static void updatePositions(void *data, int threadID, int numThreads) {
+	Step *s = (Step *)data;
+	Universe *u = s->u;
+	float *posX = u->particles.posX;
+	float *posY = u->particles.posY;
+	float *velX = u->particles.velX;
+	float *velY = u->particles.velY;
+	const float particleDiameter = 2 * s->particleRadius;
+	const float maxX = s->width - particleDiameter;
+	const float maxY = s->height - particleDiameter;
+
+	int begin, end;
+	splitWork(u->numParticles, threadID, numThreads, &begin, &end);
+
+	for (int id = begin; id < end; ++id) {
+		posX[id] += velX[id] * s->deltaTime;
+		posY[id] += velY[id] * s->deltaTime;
+		velX[id] *= s->drag;
+		velY[id] *= s->drag;
+	}
+
+	if (s->wrap) {
+		for (int id = begin; id < end; ++id) {
+			if (posX[id] >= s->width)  posX[id] -= s->width;
+			if (posY[id] >= s->height) posY[id] -= s->height;
+			if (posX[id] < 0) posX[id] += s->width;
+			if (posY[id] < 0) posY[id] += s->height;
+		}
+	} else {
+		for (int id = begin; id < end; ++id) {
+			if (posX[id] <= particleDiameter || posX[id] >= maxX) velX[id] = -velX[id];
+			if (posY[id] <= particleDiameter || posY[id] >= maxY) velY[id] = -velY[id];
+			posX[id] = fminf(fmaxf(posX[id], particleDiameter), maxX);
+			posY[id] = fminf(fmaxf(posY[id], particleDiameter), maxY);
+		}
+	}
+}
+
+void cpuSimulateTimestep(Universe *u) {
+
+	struct UniverseInternal *ui = &u->internal;
+
+	Step s;
+	s.u = u;
+	s.numTilesX = ui->numTilesX;
+	s.numTilesY = ui->numTilesY;
+	s.numTiles = ui->numTilesX * ui->numTilesY;
+	s.invTileSize = ui->invTileSize;
+	s.deltaTime = u->deltaTime;
+	s.width = u->width;
+	s.height = u->height;
+	s.centerX = u->width / 2;
+	s.centerY = u->height / 2;
+	s.drag = powf(1 - u->friction, u->deltaTime);
+	s.particleRadius = u->particleRadius;
+	s.wrap = u->wrap;
+	s.forceParams.width = s.width;
+	s.forceParams.height = s.height;
+	s.forceParams.centerX = s.centerX;
+	s.forceParams.centerY = s.centerY;
+	s.forceParams.wrap = s.wrap;
+	s.forceKernel = getForceKernel(getBestIsa());
+	s.pairKernel = getPairKernel(getBestIsa());
+
+	/* Swap the front and back buffers, exactly like the GPU pipeline does. */
+	Particles temp = u->particles;
+	u->particles = ui->oldParticles;
+	ui->oldParticles = temp;
+
+	/* setup_tiles.glsl and sort_particles.glsl together. */
+	binParticles(u, &ui->oldParticles, &u->particles);
+	if (canUseHalfStencil(&s)) {
+		/* There are at most (3 + 2) * (2 + 1) colours. */
+		int colorOffset[5 * 3 + 1];
+		int numColors = buildHalfStencilTasks(&s, colorOffset);
+		for (int color = 0; color < numColors; ++color) {
+			runForceTasks(&s, &ui->tasks[colorOffset[color]], colorOffset[color + 1] - colorOffset[color], updateForcesHalf);
+		}
+	} else {
+		int numTasks = buildForceTasks(&s);
+		runForceTasks(&s, ui->tasks, numTasks, updateForces);
+	}
+	runParallel(ui->threadPool, updatePositions, &s);
+}
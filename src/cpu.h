@@ -0,0 +1,21 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "universe.h"
+
+/* Simulate a single timestep on the CPU. This runs the same tiled pipeline as the compute shaders
+   (setup_tiles, sort_particles, update_forces and update_positions) on the universe's thread pool,
+   and leaves the particles sorted by tile in u->particles, just like the GPU front-buffer. */
+void cpuSimulateTimestep(Universe *u);
+
+/* Sort the particles from src into dst by tile using a stable, parallel counting sort:
+   a histogram of the tiles per thread, an exclusive scan over the tiles, and a scatter.
+   This fills in the offset, capacity and size of every tile in u->internal.tileLists,
+   which has to be big enough for all of the tiles. */
+void binParticles(Universe *u, const Particles *src, Particles *dst);
+
+/* Move the particles into new memory that is placed the way u->internal.placement says. The pages
+   are placed by whichever thread writes to them first, so each thread copies its own part. */
+void placeParticles(Universe *u, Particles *particles);
+
+#endif
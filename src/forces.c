@@ -0,0 +1,606 @@
+#include "forces.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FORCES_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/* GCC and clang need to be told which instruction sets a function may use, MSVC doesn't care.
+   This way we don't have to compile the whole program with -mavx512f and friends, which would
+   make it crash on older CPUs before we even get the chance to check what they support. */
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+/* The scalar kernel is a direct port of calcForce from update_forces.glsl. */
+static vec2 forcesScalar(const ForceParams *params, vec2 pos, const ParticleInteraction *interactions,
+                         const float *qx, const float *qy, const int *qtype, int count) {
+	vec2 f = { 0, 0 };
+	for (int i = 0; i < count; ++i) {
+		float dx = qx[i] - pos.x;
+		float dy = qy[i] - pos.y;
+		if (params->wrap) {
+			if (dx < -params->centerX) dx += params->width;
+			if (dy < -params->centerY) dy += params->height;
+			if (dx > params->centerX) dx -= params->width;
+			if (dy > params->centerY) dy -= params->height;
+		}
+
+		const ParticleInteraction *interaction = &interactions[qtype[i]];
+		float r2 = dx * dx + dy * dy;
+		float minr = interaction->minRadius;
+		float maxr = interaction->maxRadius;
+		if (r2 > maxr * maxr || r2 < 0.001f)
+			continue;
+
+		float r = sqrtf(r2);
+		float scale;
+		if (r > minr) {
+			scale = interaction->attraction * fminf(fabsf(r - minr), fabsf(r - maxr)) / r;
+		} else {
+			scale = -(minr - r) / (r * (0.5f + minr * r));
+		}
+		f.x += dx * scale;
+		f.y += dy * scale;
+	}
+	return f;
+}
+
+/* The scalar pair kernel does the same as the scalar kernel above, but because the radii of
+   an interaction are the same in both directions, it also calculates the opposite force. */
+static vec2 pairsScalar(const ForceParams *params, vec2 pos, const ParticleInteraction *row, const ParticleInteraction *column,
+                        int numTypes, const float *qx, const float *qy, const int *qtype, float *qvx, float *qvy, float qscale, int count) {
+	vec2 f = { 0, 0 };
+	for (int i = 0; i < count; ++i) {
+		float dx = qx[i] - pos.x;
+		float dy = qy[i] - pos.y;
+		if (params->wrap) {
+			if (dx < -params->centerX) dx += params->width;
+			if (dy < -params->centerY) dy += params->height;
+			if (dx > params->centerX) dx -= params->width;
+			if (dy > params->centerY) dy -= params->height;
+		}
+
+		const ParticleInteraction *interaction = &row[qtype[i]];
+		float r2 = dx * dx + dy * dy;
+		float minr = interaction->minRadius;
+		float maxr = interaction->maxRadius;
+		if (r2 > maxr * maxr || r2 < 0.001f)
+			continue;
+
+		float r = sqrtf(r2);
+		float pScale, qScale;
+		if (r > minr) {
+			float distance = fminf(fabsf(r - minr), fabsf(r - maxr)) / r;
+			pScale = interaction->attraction * distance;
+			qScale = column[qtype[i] * numTypes].attraction * distance;
+		} else {
+			pScale = -(minr - r) / (r * (0.5f + minr * r));
+			qScale = pScale;
+		}
+		f.x += dx * pScale;
+		f.y += dy * pScale;
+		qvx[i] -= qscale * dx * qScale;
+		qvy[i] -= qscale * dy * qScale;
+	}
+	return f;
+}
+
+#ifdef FORCES_X86
+
+/* All of the vector kernels below do the same thing as the scalar kernel, but branch-free:
+
+     inRange = r2 <= maxr * maxr && r2 >= 0.001
+     far     = r > minr
+     scale   = far ? attraction * min(|r - minr|, |r - maxr|) / r
+                   : (r - minr) / (r * (0.5 + minr * r))
+     f      += inRange ? dpos * scale : 0
+
+   The two cases share a single division by blending the numerators and the denominators.
+   Lanes which are out of range might divide by 0, but those lanes get masked to 0 anyway.
+   The interaction matrix is an array of 3 floats per type, so the neighbour's type * 3 is
+   used to gather the attraction, minRadius and maxRadius. */
+
+TARGET("sse4.2")
+static vec2 forcesSse42(const ForceParams *params, vec2 pos, const ParticleInteraction *interactions,
+                        const float *qx, const float *qy, const int *qtype, int count) {
+	const float *table = (const float *)interactions;
+	const __m128 px = _mm_set1_ps(pos.x);
+	const __m128 py = _mm_set1_ps(pos.y);
+	const __m128 width = _mm_set1_ps(params->width);
+	const __m128 height = _mm_set1_ps(params->height);
+	const __m128 centerX = _mm_set1_ps(params->centerX);
+	const __m128 centerY = _mm_set1_ps(params->centerY);
+	const __m128 negCenterX = _mm_set1_ps(-params->centerX);
+	const __m128 negCenterY = _mm_set1_ps(-params->centerY);
+	const __m128 epsilon = _mm_set1_ps(0.001f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	__m128 fx = _mm_setzero_ps();
+	__m128 fy = _mm_setzero_ps();
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(qx + i), px);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(qy + i), py);
+		if (params->wrap) {
+			dx = _mm_add_ps(dx, _mm_and_ps(_mm_cmplt_ps(dx, negCenterX), width));
+			dy = _mm_add_ps(dy, _mm_and_ps(_mm_cmplt_ps(dy, negCenterY), height));
+			dx = _mm_sub_ps(dx, _mm_and_ps(_mm_cmpgt_ps(dx, centerX), width));
+			dy = _mm_sub_ps(dy, _mm_and_ps(_mm_cmpgt_ps(dy, centerY), height));
+		}
+
+		/* There is no gather before AVX2. */
+		const float *i0 = &table[3 * qtype[i + 0]];
+		const float *i1 = &table[3 * qtype[i + 1]];
+		const float *i2 = &table[3 * qtype[i + 2]];
+		const float *i3 = &table[3 * qtype[i + 3]];
+		__m128 attraction = _mm_setr_ps(i0[0], i1[0], i2[0], i3[0]);
+		__m128 minr = _mm_setr_ps(i0[1], i1[1], i2[1], i3[1]);
+		__m128 maxr = _mm_setr_ps(i0[2], i1[2], i2[2], i3[2]);
+
+		__m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+		__m128 inRange = _mm_and_ps(_mm_cmple_ps(r2, _mm_mul_ps(maxr, maxr)), _mm_cmpge_ps(r2, epsilon));
+		__m128 r = _mm_sqrt_ps(r2);
+		__m128 far = _mm_cmpgt_ps(r, minr);
+
+		__m128 rMinusMin = _mm_sub_ps(r, minr);
+		__m128 farNum = _mm_mul_ps(attraction, _mm_min_ps(_mm_andnot_ps(signBit, rMinusMin), _mm_andnot_ps(signBit, _mm_sub_ps(r, maxr))));
+		__m128 nearDen = _mm_mul_ps(r, _mm_add_ps(half, _mm_mul_ps(minr, r)));
+		__m128 num = _mm_blendv_ps(rMinusMin, farNum, far);
+		__m128 den = _mm_blendv_ps(nearDen, r, far);
+		__m128 scale = _mm_and_ps(_mm_div_ps(num, den), inRange);
+
+		fx = _mm_add_ps(fx, _mm_mul_ps(dx, scale));
+		fy = _mm_add_ps(fy, _mm_mul_ps(dy, scale));
+	}
+
+	fx = _mm_hadd_ps(fx, fy);
+	fx = _mm_hadd_ps(fx, fx);
+	vec2 tail = forcesScalar(params, pos, interactions, qx + i, qy + i, qtype + i, count - i);
+	vec2 f;
+	f.x = _mm_cvtss_f32(fx) + tail.x;
+	f.y = _mm_cvtss_f32(_mm_shuffle_ps(fx, fx, 1)) + tail.y;
+	return f;
+}
+
+TARGET("avx2")
+static vec2 forcesAvx2(const ForceParams *params, vec2 pos, const ParticleInteraction *interactions,
+                       const float *qx, const float *qy, const int *qtype, int count) {
+	const float *table = (const float *)interactions;
+	const __m256 px = _mm256_set1_ps(pos.x);
+	const __m256 py = _mm256_set1_ps(pos.y);
+	const __m256 width = _mm256_set1_ps(params->width);
+	const __m256 height = _mm256_set1_ps(params->height);
+	const __m256 centerX = _mm256_set1_ps(params->centerX);
+	const __m256 centerY = _mm256_set1_ps(params->centerY);
+	const __m256 negCenterX = _mm256_set1_ps(-params->centerX);
+	const __m256 negCenterY = _mm256_set1_ps(-params->centerY);
+	const __m256 epsilon = _mm256_set1_ps(0.001f);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 signBit = _mm256_set1_ps(-0.0f);
+	const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 fx = _mm256_setzero_ps();
+	__m256 fy = _mm256_setzero_ps();
+
+	for (int i = 0; i < count; i += 8) {
+		/* The last iteration might have fewer than 8 neighbours left, so mask the loads. */
+		__m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - i), laneIndex);
+		__m256 dx = _mm256_sub_ps(_mm256_maskload_ps(qx + i, lanes), px);
+		__m256 dy = _mm256_sub_ps(_mm256_maskload_ps(qy + i, lanes), py);
+		__m256i type = _mm256_maskload_epi32(qtype + i, lanes);
+		if (params->wrap) {
+			dx = _mm256_add_ps(dx, _mm256_and_ps(_mm256_cmp_ps(dx, negCenterX, _CMP_LT_OQ), width));
+			dy = _mm256_add_ps(dy, _mm256_and_ps(_mm256_cmp_ps(dy, negCenterY, _CMP_LT_OQ), height));
+			dx = _mm256_sub_ps(dx, _mm256_and_ps(_mm256_cmp_ps(dx, centerX, _CMP_GT_OQ), width));
+			dy = _mm256_sub_ps(dy, _mm256_and_ps(_mm256_cmp_ps(dy, centerY, _CMP_GT_OQ), height));
+		}
+
+		__m256i index = _mm256_add_epi32(type, _mm256_add_epi32(type, type));
+		__m256 attraction = _mm256_i32gather_ps(table + 0, index, 4);
+		__m256 minr = _mm256_i32gather_ps(table + 1, index, 4);
+		__m256 maxr = _mm256_i32gather_ps(table + 2, index, 4);
+
+		__m256 r2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+		__m256 inRange = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(r2, _mm256_mul_ps(maxr, maxr), _CMP_LE_OQ), _mm256_cmp_ps(r2, epsilon, _CMP_GE_OQ)),
+			_mm256_castsi256_ps(lanes));
+		__m256 r = _mm256_sqrt_ps(r2);
+		__m256 far = _mm256_cmp_ps(r, minr, _CMP_GT_OQ);
+
+		__m256 rMinusMin = _mm256_sub_ps(r, minr);
+		__m256 farNum = _mm256_mul_ps(attraction, _mm256_min_ps(_mm256_andnot_ps(signBit, rMinusMin), _mm256_andnot_ps(signBit, _mm256_sub_ps(r, maxr))));
+		__m256 nearDen = _mm256_mul_ps(r, _mm256_add_ps(half, _mm256_mul_ps(minr, r)));
+		__m256 num = _mm256_blendv_ps(rMinusMin, farNum, far);
+		__m256 den = _mm256_blendv_ps(nearDen, r, far);
+		__m256 scale = _mm256_and_ps(_mm256_div_ps(num, den), inRange);
+
+		fx = _mm256_add_ps(fx, _mm256_mul_ps(dx, scale));
+		fy = _mm256_add_ps(fy, _mm256_mul_ps(dy, scale));
+	}
+
+	__m128 sx = _mm_add_ps(_mm256_castps256_ps128(fx), _mm256_extractf128_ps(fx, 1));
+	__m128 sy = _mm_add_ps(_mm256_castps256_ps128(fy), _mm256_extractf128_ps(fy, 1));
+	sx = _mm_hadd_ps(sx, sy);
+	sx = _mm_hadd_ps(sx, sx);
+	vec2 f;
+	f.x = _mm_cvtss_f32(sx);
+	f.y = _mm_cvtss_f32(_mm_shuffle_ps(sx, sx, 1));
+	return f;
+}
+
+TARGET("avx512f")
+static vec2 forcesAvx512(const ForceParams *params, vec2 pos, const ParticleInteraction *interactions,
+                         const float *qx, const float *qy, const int *qtype, int count) {
+	const float *table = (const float *)interactions;
+	const __m512 px = _mm512_set1_ps(pos.x);
+	const __m512 py = _mm512_set1_ps(pos.y);
+	const __m512 width = _mm512_set1_ps(params->width);
+	const __m512 height = _mm512_set1_ps(params->height);
+	const __m512 centerX = _mm512_set1_ps(params->centerX);
+	const __m512 centerY = _mm512_set1_ps(params->centerY);
+	const __m512 negCenterX = _mm512_set1_ps(-params->centerX);
+	const __m512 negCenterY = _mm512_set1_ps(-params->centerY);
+	const __m512 epsilon = _mm512_set1_ps(0.001f);
+	const __m512 half = _mm512_set1_ps(0.5f);
+	const __m512 zero = _mm512_setzero_ps();
+	__m512 fx = zero;
+	__m512 fy = zero;
+
+	for (int i = 0; i < count; i += 16) {
+		/* The last iteration might have fewer than 16 neighbours left, so mask the loads. */
+		__mmask16 lanes = count - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (count - i)) - 1);
+		__m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, qx + i), px);
+		__m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, qy + i), py);
+		__m512i type = _mm512_maskz_loadu_epi32(lanes, qtype + i);
+		if (params->wrap) {
+			dx = _mm512_mask_add_ps(dx, _mm512_cmp_ps_mask(dx, negCenterX, _CMP_LT_OQ), dx, width);
+			dy = _mm512_mask_add_ps(dy, _mm512_cmp_ps_mask(dy, negCenterY, _CMP_LT_OQ), dy, height);
+			dx = _mm512_mask_sub_ps(dx, _mm512_cmp_ps_mask(dx, centerX, _CMP_GT_OQ), dx, width);
+			dy = _mm512_mask_sub_ps(dy, _mm512_cmp_ps_mask(dy, centerY, _CMP_GT_OQ), dy, height);
+		}
+
+		__m512i index = _mm512_add_epi32(type, _mm512_add_epi32(type, type));
+		__m512 attraction = _mm512_mask_i32gather_ps(zero, lanes, index, table + 0, 4);
+		__m512 minr = _mm512_mask_i32gather_ps(zero, lanes, index, table + 1, 4);
+		__m512 maxr = _mm512_mask_i32gather_ps(zero, lanes, index, table + 2, 4);
+
+		__m512 r2 = _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+		__mmask16 inRange =
+			_mm512_mask_cmp_ps_mask(lanes, r2, _mm512_mul_ps(maxr, maxr), _CMP_LE_OQ) &
+			_mm512_cmp_ps_mask(r2, epsilon, _CMP_GE_OQ);
+		__m512 r = _mm512_maskz_sqrt_ps(inRange, r2);
+		__mmask16 far = _mm512_cmp_ps_mask(r, minr, _CMP_GT_OQ);
+
+		__m512 rMinusMin = _mm512_sub_ps(r, minr);
+		__m512 farNum = _mm512_mul_ps(attraction, _mm512_min_ps(_mm512_abs_ps(rMinusMin), _mm512_abs_ps(_mm512_sub_ps(r, maxr))));
+		__m512 nearDen = _mm512_mul_ps(r, _mm512_add_ps(half, _mm512_mul_ps(minr, r)));
+		__m512 num = _mm512_mask_blend_ps(far, rMinusMin, farNum);
+		__m512 den = _mm512_mask_blend_ps(far, nearDen, r);
+		__m512 scale = _mm512_maskz_div_ps(inRange, num, den);
+
+		fx = _mm512_add_ps(fx, _mm512_mul_ps(dx, scale));
+		fy = _mm512_add_ps(fy, _mm512_mul_ps(dy, scale));
+	}
+
+	vec2 f;
+	f.x = _mm512_reduce_add_ps(fx);
+	f.y = _mm512_reduce_add_ps(fy);
+	return f;
+}
+
+/* The vector pair kernels work like the vector kernels above. Both directions share the
+   distance, the mask and the denominator, so the division is done once as a reciprocal.
+   The opposite attraction is gathered from the column of the interaction matrix for the
+   particle's type, at the neighbour's type * numTypes * 3. The neighbours' velocities
+   are updated with plain loads and stores, because the neighbours are contiguous. */
+
+TARGET("sse4.2")
+static vec2 pairsSse42(const ForceParams *params, vec2 pos, const ParticleInteraction *row, const ParticleInteraction *column,
+                       int numTypes, const float *qx, const float *qy, const int *qtype, float *qvx, float *qvy, float qscale, int count) {
+	const float *table = (const float *)row;
+	const float *columnTable = (const float *)column;
+	const int stride = 3 * numTypes;
+	const __m128 px = _mm_set1_ps(pos.x);
+	const __m128 py = _mm_set1_ps(pos.y);
+	const __m128 width = _mm_set1_ps(params->width);
+	const __m128 height = _mm_set1_ps(params->height);
+	const __m128 centerX = _mm_set1_ps(params->centerX);
+	const __m128 centerY = _mm_set1_ps(params->centerY);
+	const __m128 negCenterX = _mm_set1_ps(-params->centerX);
+	const __m128 negCenterY = _mm_set1_ps(-params->centerY);
+	const __m128 epsilon = _mm_set1_ps(0.001f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	const __m128 negQScale = _mm_set1_ps(-qscale);
+	__m128 fx = _mm_setzero_ps();
+	__m128 fy = _mm_setzero_ps();
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(qx + i), px);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(qy + i), py);
+		if (params->wrap) {
+			dx = _mm_add_ps(dx, _mm_and_ps(_mm_cmplt_ps(dx, negCenterX), width));
+			dy = _mm_add_ps(dy, _mm_and_ps(_mm_cmplt_ps(dy, negCenterY), height));
+			dx = _mm_sub_ps(dx, _mm_and_ps(_mm_cmpgt_ps(dx, centerX), width));
+			dy = _mm_sub_ps(dy, _mm_and_ps(_mm_cmpgt_ps(dy, centerY), height));
+		}
+
+		/* There is no gather before AVX2. */
+		const float *i0 = &table[3 * qtype[i + 0]];
+		const float *i1 = &table[3 * qtype[i + 1]];
+		const float *i2 = &table[3 * qtype[i + 2]];
+		const float *i3 = &table[3 * qtype[i + 3]];
+		__m128 attraction = _mm_setr_ps(i0[0], i1[0], i2[0], i3[0]);
+		__m128 minr = _mm_setr_ps(i0[1], i1[1], i2[1], i3[1]);
+		__m128 maxr = _mm_setr_ps(i0[2], i1[2], i2[2], i3[2]);
+		__m128 qAttraction = _mm_setr_ps(
+			columnTable[stride * qtype[i + 0]], columnTable[stride * qtype[i + 1]],
+			columnTable[stride * qtype[i + 2]], columnTable[stride * qtype[i + 3]]);
+
+		__m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+		__m128 inRange = _mm_and_ps(_mm_cmple_ps(r2, _mm_mul_ps(maxr, maxr)), _mm_cmpge_ps(r2, epsilon));
+		__m128 r = _mm_sqrt_ps(r2);
+		__m128 far = _mm_cmpgt_ps(r, minr);
+
+		__m128 rMinusMin = _mm_sub_ps(r, minr);
+		__m128 distance = _mm_min_ps(_mm_andnot_ps(signBit, rMinusMin), _mm_andnot_ps(signBit, _mm_sub_ps(r, maxr)));
+		__m128 nearDen = _mm_mul_ps(r, _mm_add_ps(half, _mm_mul_ps(minr, r)));
+		__m128 invDen = _mm_and_ps(_mm_div_ps(one, _mm_blendv_ps(nearDen, r, far)), inRange);
+		__m128 pScale = _mm_mul_ps(_mm_blendv_ps(rMinusMin, _mm_mul_ps(attraction, distance), far), invDen);
+		__m128 qScale = _mm_mul_ps(_mm_blendv_ps(rMinusMin, _mm_mul_ps(qAttraction, distance), far), invDen);
+
+		fx = _mm_add_ps(fx, _mm_mul_ps(dx, pScale));
+		fy = _mm_add_ps(fy, _mm_mul_ps(dy, pScale));
+		qScale = _mm_mul_ps(qScale, negQScale);
+		_mm_storeu_ps(qvx + i, _mm_add_ps(_mm_loadu_ps(qvx + i), _mm_mul_ps(dx, qScale)));
+		_mm_storeu_ps(qvy + i, _mm_add_ps(_mm_loadu_ps(qvy + i), _mm_mul_ps(dy, qScale)));
+	}
+
+	fx = _mm_hadd_ps(fx, fy);
+	fx = _mm_hadd_ps(fx, fx);
+	vec2 tail = pairsScalar(params, pos, row, column, numTypes, qx + i, qy + i, qtype + i, qvx + i, qvy + i, qscale, count - i);
+	vec2 f;
+	f.x = _mm_cvtss_f32(fx) + tail.x;
+	f.y = _mm_cvtss_f32(_mm_shuffle_ps(fx, fx, 1)) + tail.y;
+	return f;
+}
+
+TARGET("avx2")
+static vec2 pairsAvx2(const ForceParams *params, vec2 pos, const ParticleInteraction *row, const ParticleInteraction *column,
+                      int numTypes, const float *qx, const float *qy, const int *qtype, float *qvx, float *qvy, float qscale, int count) {
+	const float *table = (const float *)row;
+	const float *columnTable = (const float *)column;
+	const __m256 px = _mm256_set1_ps(pos.x);
+	const __m256 py = _mm256_set1_ps(pos.y);
+	const __m256 width = _mm256_set1_ps(params->width);
+	const __m256 height = _mm256_set1_ps(params->height);
+	const __m256 centerX = _mm256_set1_ps(params->centerX);
+	const __m256 centerY = _mm256_set1_ps(params->centerY);
+	const __m256 negCenterX = _mm256_set1_ps(-params->centerX);
+	const __m256 negCenterY = _mm256_set1_ps(-params->centerY);
+	const __m256 epsilon = _mm256_set1_ps(0.001f);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 signBit = _mm256_set1_ps(-0.0f);
+	const __m256 negQScale = _mm256_set1_ps(-qscale);
+	const __m256i stride = _mm256_set1_epi32(3 * numTypes);
+	const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 fx = _mm256_setzero_ps();
+	__m256 fy = _mm256_setzero_ps();
+
+	for (int i = 0; i < count; i += 8) {
+		/* The last iteration might have fewer than 8 neighbours left, so mask the loads and stores. */
+		__m256i lanes = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - i), laneIndex);
+		__m256 dx = _mm256_sub_ps(_mm256_maskload_ps(qx + i, lanes), px);
+		__m256 dy = _mm256_sub_ps(_mm256_maskload_ps(qy + i, lanes), py);
+		__m256i type = _mm256_maskload_epi32(qtype + i, lanes);
+		if (params->wrap) {
+			dx = _mm256_add_ps(dx, _mm256_and_ps(_mm256_cmp_ps(dx, negCenterX, _CMP_LT_OQ), width));
+			dy = _mm256_add_ps(dy, _mm256_and_ps(_mm256_cmp_ps(dy, negCenterY, _CMP_LT_OQ), height));
+			dx = _mm256_sub_ps(dx, _mm256_and_ps(_mm256_cmp_ps(dx, centerX, _CMP_GT_OQ), width));
+			dy = _mm256_sub_ps(dy, _mm256_and_ps(_mm256_cmp_ps(dy, centerY, _CMP_GT_OQ), height));
+		}
+
+		__m256i index = _mm256_add_epi32(type, _mm256_add_epi32(type, type));
+		__m256 attraction = _mm256_i32gather_ps(table + 0, index, 4);
+		__m256 minr = _mm256_i32gather_ps(table + 1, index, 4);
+		__m256 maxr = _mm256_i32gather_ps(table + 2, index, 4);
+		__m256 qAttraction = _mm256_i32gather_ps(columnTable, _mm256_mullo_epi32(type, stride), 4);
+
+		__m256 r2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+		__m256 inRange = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(r2, _mm256_mul_ps(maxr, maxr), _CMP_LE_OQ), _mm256_cmp_ps(r2, epsilon, _CMP_GE_OQ)),
+			_mm256_castsi256_ps(lanes));
+		__m256 r = _mm256_sqrt_ps(r2);
+		__m256 far = _mm256_cmp_ps(r, minr, _CMP_GT_OQ);
+
+		__m256 rMinusMin = _mm256_sub_ps(r, minr);
+		__m256 distance = _mm256_min_ps(_mm256_andnot_ps(signBit, rMinusMin), _mm256_andnot_ps(signBit, _mm256_sub_ps(r, maxr)));
+		__m256 nearDen = _mm256_mul_ps(r, _mm256_add_ps(half, _mm256_mul_ps(minr, r)));
+		__m256 invDen = _mm256_and_ps(_mm256_div_ps(one, _mm256_blendv_ps(nearDen, r, far)), inRange);
+		__m256 pScale = _mm256_mul_ps(_mm256_blendv_ps(rMinusMin, _mm256_mul_ps(attraction, distance), far), invDen);
+		__m256 qScale = _mm256_mul_ps(_mm256_blendv_ps(rMinusMin, _mm256_mul_ps(qAttraction, distance), far), invDen);
+
+		fx = _mm256_add_ps(fx, _mm256_mul_ps(dx, pScale));
+		fy = _mm256_add_ps(fy, _mm256_mul_ps(dy, pScale));
+		qScale = _mm256_mul_ps(qScale, negQScale);
+		_mm256_maskstore_ps(qvx + i, lanes, _mm256_add_ps(_mm256_maskload_ps(qvx + i, lanes), _mm256_mul_ps(dx, qScale)));
+		_mm256_maskstore_ps(qvy + i, lanes, _mm256_add_ps(_mm256_maskload_ps(qvy + i, lanes), _mm256_mul_ps(dy, qScale)));
+	}
+
+	__m128 sx = _mm_add_ps(_mm256_castps256_ps128(fx), _mm256_extractf128_ps(fx, 1));
+	__m128 sy = _mm_add_ps(_mm256_castps256_ps128(fy), _mm256_extractf128_ps(fy, 1));
+	sx = _mm_hadd_ps(sx, sy);
+	sx = _mm_hadd_ps(sx, sx);
+	vec2 f;
+	f.x = _mm_cvtss_f32(sx);
+	f.y = _mm_cvtss_f32(_mm_shuffle_ps(sx, sx, 1));
+	return f;
+}
+
+TARGET("avx512f")
+static vec2 pairsAvx512(const ForceParams *params, vec2 pos, const ParticleInteraction *row, const ParticleInteraction *column,
+                        int numTypes, const float *qx, const float *qy, const int *qtype, float *qvx, float *qvy, float qscale, int count) {
+	const float *table = (const float *)row;
+	const float *columnTable = (const float *)column;
+	const __m512 px = _mm512_set1_ps(pos.x);
+	const __m512 py = _mm512_set1_ps(pos.y);
+	const __m512 width = _mm512_set1_ps(params->width);
+	const __m512 height = _mm512_set1_ps(params->height);
+	const __m512 centerX = _mm512_set1_ps(params->centerX);
+	const __m512 centerY = _mm512_set1_ps(params->centerY);
+	const __m512 negCenterX = _mm512_set1_ps(-params->centerX);
+	const __m512 negCenterY = _mm512_set1_ps(-params->centerY);
+	const __m512 epsilon = _mm512_set1_ps(0.001f);
+	const __m512 half = _mm512_set1_ps(0.5f);
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512 negQScale = _mm512_set1_ps(-qscale);
+	const __m512i stride = _mm512_set1_epi32(3 * numTypes);
+	const __m512 zero = _mm512_setzero_ps();
+	__m512 fx = zero;
+	__m512 fy = zero;
+
+	for (int i = 0; i < count; i += 16) {
+		/* The last iteration might have fewer than 16 neighbours left, so mask the loads and stores. */
+		__mmask16 lanes = count - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (count - i)) - 1);
+		__m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, qx + i), px);
+		__m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, qy + i), py);
+		__m512i type = _mm512_maskz_loadu_epi32(lanes, qtype + i);
+		if (params->wrap) {
+			dx = _mm512_mask_add_ps(dx, _mm512_cmp_ps_mask(dx, negCenterX, _CMP_LT_OQ), dx, width);
+			dy = _mm512_mask_add_ps(dy, _mm512_cmp_ps_mask(dy, negCenterY, _CMP_LT_OQ), dy, height);
+			dx = _mm512_mask_sub_ps(dx, _mm512_cmp_ps_mask(dx, centerX, _CMP_GT_OQ), dx, width);
+			dy = _mm512_mask_sub_ps(dy, _mm512_cmp_ps_mask(dy, centerY, _CMP_GT_OQ), dy, height);
+		}
+
+		__m512i index = _mm512_add_epi32(type, _mm512_add_epi32(type, type));
+		__m512 attraction = _mm512_mask_i32gather_ps(zero, lanes, index, table + 0, 4);
+		__m512 minr = _mm512_mask_i32gather_ps(zero, lanes, index, table + 1, 4);
+		__m512 maxr = _mm512_mask_i32gather_ps(zero, lanes, index, table + 2, 4);
+		__m512 qAttraction = _mm512_mask_i32gather_ps(zero, lanes, _mm512_mullo_epi32(type, stride), columnTable, 4);
+
+		__m512 r2 = _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+		__mmask16 inRange =
+			_mm512_mask_cmp_ps_mask(lanes, r2, _mm512_mul_ps(maxr, maxr), _CMP_LE_OQ) &
+			_mm512_cmp_ps_mask(r2, epsilon, _CMP_GE_OQ);
+		__m512 r = _mm512_maskz_sqrt_ps(inRange, r2);
+		__mmask16 far = _mm512_cmp_ps_mask(r, minr, _CMP_GT_OQ);
+
+		__m512 rMinusMin = _mm512_sub_ps(r, minr);
+		__m512 distance = _mm512_min_ps(_mm512_abs_ps(rMinusMin), _mm512_abs_ps(_mm512_sub_ps(r, maxr)));
+		__m512 nearDen = _mm512_mul_ps(r, _mm512_add_ps(half, _mm512_mul_ps(minr, r)));
+		__m512 invDen = _mm512_maskz_div_ps(inRange, one, _mm512_mask_blend_ps(far, nearDen, r));
+		__m512 pScale = _mm512_mul_ps(_mm512_mask_blend_ps(far, rMinusMin, _mm512_mul_ps(attraction, distance)), invDen);
+		__m512 qScale = _mm512_mul_ps(_mm512_mask_blend_ps(far, rMinusMin, _mm512_mul_ps(qAttraction, distance)), invDen);
+
+		fx = _mm512_add_ps(fx, _mm512_mul_ps(dx, pScale));
+		fy = _mm512_add_ps(fy, _mm512_mul_ps(dy, pScale));
+		qScale = _mm512_mul_ps(qScale, negQScale);
+		_mm512_mask_storeu_ps(qvx + i, lanes, _mm512_add_ps(_mm512_maskz_loadu_ps(lanes, qvx + i), _mm512_mul_ps(dx, qScale)));
+		_mm512_mask_storeu_ps(qvy + i, lanes, _mm512_add_ps(_mm512_maskz_loadu_ps(lanes, qvy + i), _mm512_mul_ps(dy, qScale)));
+	}
+
+	vec2 f;
+	f.x = _mm512_reduce_add_ps(fx);
+	f.y = _mm512_reduce_add_ps(fy);
+	return f;
+}
+
+#ifdef _MSC_VER
+/* Query CPUID and the OS-enabled register state (XCR0) ourselves on MSVC. */
+static int msvcSupports(Isa isa) {
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	int sse42 = (info[2] >> 20) & 1;
+	int osxsave = (info[2] >> 27) & 1;
+	int avx = (info[2] >> 28) & 1;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	int avx2 = 0, avx512 = 0;
+	if (maxLeaf >= 7) {
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] >> 5) & 1;
+		avx512 = (info[1] >> 16) & 1;
+	}
+	int ymmEnabled = (xcr0 & 0x06) == 0x06;
+	int zmmEnabled = (xcr0 & 0xE6) == 0xE6;
+	switch (isa) {
+		case ISA_SSE42:  return sse42;
+		case ISA_AVX2:   return avx && avx2 && ymmEnabled;
+		case ISA_AVX512: return avx512 && zmmEnabled;
+		default:         return 0;
+	}
+}
+#endif
+
+#endif /* FORCES_X86 */
+
+int isIsaSupported(Isa isa) {
+	if (isa == ISA_SCALAR)
+		return 1;
+#if defined(FORCES_X86) && defined(_MSC_VER)
+	return msvcSupports(isa);
+#elif defined(FORCES_X86)
+	__builtin_cpu_init();
+	switch (isa) {
+		case ISA_SSE42:  return __builtin_cpu_supports("sse4.2");
+		case ISA_AVX2:   return __builtin_cpu_supports("avx2");
+		case ISA_AVX512: return __builtin_cpu_supports("avx512f");
+		default:         return 0;
+	}
+#else
+	return 0;
+#endif
+}
+
+Isa getBestIsa(void) {
+	static int bestIsa = -1;
+	if (bestIsa < 0) {
+		bestIsa = ISA_SCALAR;
+		for (int isa = ISA_SCALAR; isa < NUM_ISAS; ++isa)
+			if (isIsaSupported((Isa)isa))
+				bestIsa = isa;
+	}
+	return (Isa)bestIsa;
+}
+
+const char *getIsaName(Isa isa) {
+	switch (isa) {
+		case ISA_SCALAR: return "scalar";
+		case ISA_SSE42:  return "SSE4.2";
+		case ISA_AVX2:   return "AVX2";
+		case ISA_AVX512: return "AVX-512";
+		default:         return "???";
+	}
+}
+
+ForceKernel getForceKernel(Isa isa) {
+	switch (isa) {
+	#ifdef FORCES_X86
+		case ISA_SSE42:  return forcesSse42;
+		case ISA_AVX2:   return forcesAvx2;
+		case ISA_AVX512: return forcesAvx512;
+	#endif
+		default:         return forcesScalar;
+	}
+}
+
+PairKernel getPairKernel(Isa isa) {
+	switch (isa) {
+	#ifdef FORCES_X86
+		case ISA_SSE42:  return pairsSse42;
+		case ISA_AVX2:   return pairsAvx2;
+		case ISA_AVX512: return pairsAvx512;
+	#endif
+		default:         return pairsScalar;
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef FORCES_H
+#define FORCES_H
+
+#include "universe.h"
+
+/* Host-side ports of calcForce from update_forces.glsl.
+   The vectorized kernels evaluate 4, 8 or 16 neighbours at a time and replace the
+   minRadius/maxRadius branches with masks and blends. The best kernel for the
+   running CPU is picked at runtime, so the same executable runs everywhere. */
+
+/* The instruction sets that we have force kernels for. */
+typedef enum Isa {
+	ISA_SCALAR, /* plain C, always supported */
+	ISA_SSE42,  /* 4 neighbours at a time */
+	ISA_AVX2,   /* 8 neighbours at a time */
+	ISA_AVX512, /* 16 neighbours at a time */
+	NUM_ISAS
+} Isa;
+
+/* The world parameters that the force calculation depends on. */
+typedef struct ForceParams {
+	float width;
+	float height;
+	float centerX;
+	float centerY;
+	int wrap;
+} ForceParams;
+
+/* Sum up the forces exerted on a particle at position pos by count neighbouring particles.
+   The neighbours are given as separate arrays of x and y positions and types, and
+   interactions points to the row of the interaction matrix for the particle's type. */
+typedef vec2 (*ForceKernel)(const ForceParams *params, vec2 pos, const ParticleInteraction *interactions,
+                            const float *qx, const float *qy, const int *qtype, int count);
+
+/* Like ForceKernel, but also applies the opposite force of each pair to the neighbours.
+   This relies on the radii of every interaction being the same in both directions, so only
+   the attraction has to be looked up twice: from row, the row of the interaction matrix for
+   the particle's type, and from column, the column for the particle's type (a stride of numTypes).
+   Returns the force on the particle, and adds qscale times the force on each neighbour to qvx and qvy. */
+typedef vec2 (*PairKernel)(const ForceParams *params, vec2 pos, const ParticleInteraction *row, const ParticleInteraction *column,
+                           int numTypes, const float *qx, const float *qy, const int *qtype, float *qvx, float *qvy, float qscale, int count);
+
+/* Check whether the running CPU (and OS) supports the given instruction set. */
+int isIsaSupported(Isa isa);
+
+/* Get the widest instruction set supported by the running CPU. */
+Isa getBestIsa(void);
+
+/* Get a human readable name for the instruction set. */
+const char *getIsaName(Isa isa);
+
+/* Get the force kernel for the given instruction set. Check isIsaSupported() first. */
+ForceKernel getForceKernel(Isa isa);
+
+/* Get the pair kernel for the given instruction set. Check isIsaSupported() first. */
+PairKernel getPairKernel(Isa isa);
+
+#endif
@@ -6,6 +6,7 @@
    CodeParade: https://www.youtube.com/channel/UCrv269YwJzuZL3dH5PCgxUw */
 
 #include "universe.h"
+#include "benchmark.h"
 #include "glfw3.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,6 +14,27 @@
 /* Uncomment below to compile a benchmark executable */
 /* #define BENCHMARK */
 
+/* Uncomment below to compile an executable which runs the micro-benchmarks from benchmark.c */
+/* #define MICRO_BENCHMARKS */
+
+/* Uncomment below to simulate on the CPU instead of the GPU (the GPU is still used for drawing) */
+/* #define CPU_BACKEND */
+
+/* Uncomment below to tune the workgroup sizes of the compute shaders for your GPU. They are saved to
+   AUTOTUNE_FILE, so this only takes a while on the first launch with each GPU and driver version. */
+/* #define AUTOTUNE */
+#define AUTOTUNE_FILE "workgroup-sizes.txt"
+
+/* Uncomment below to measure the GPU time of each stage with timer queries, TAB then prints them. */
+/* #define TIME_STAGES */
+
+/* Uncomment below to write the GPU time of each stage of every timestep to a CSV file (this implies TIME_STAGES). */
+/* #define STAGE_LOG "stage-times.csv" */
+
+/* Uncomment below to load the linked programs from this file (relative to the working directory) after
+   the first launch with each GPU and driver version, instead of compiling the shaders on every launch. */
+/* #define PROGRAM_CACHE "program-cache.bin" */
+
 /* Request a dedicated GPU if avaliable.
    See: https://stackoverflow.com/a/39047129 */
 #ifdef _MSC_VER
@@ -75,6 +97,9 @@ static void printHelp() {
 	printf("|| M                      medium clusters ||\n");
 	printf("|| S                       small clusters ||\n");
 	printf("|| Q                           quiescence ||\n");
+	printf("||                                        ||\n");
+	printf("|| hold SHIFT to keep the particles and   ||\n");
+	printf("|| only randomize the interactions        ||\n");
 	printf(" ==========================================\n");
 }
 
@@ -83,6 +108,9 @@ static void onKey(GLFWwindow *window, int key, int scancode, int action, int mod
 	if (action != GLFW_PRESS)
 		return;
 
+	/* With shift the presets only change the interactions, and the particles stay where they are. */
+	void (*randomizer)(Universe *, float, float, float, float, float, float) = (mods & GLFW_MOD_SHIFT) ? randomizeInteractions : randomize;
+
 	switch (key) {
 		case GLFW_KEY_ESCAPE:
 			glfwSetWindowShouldClose(window, GLFW_TRUE);
@@ -102,43 +130,43 @@ static void onKey(GLFWwindow *window, int key, int scancode, int action, int mod
 		break;
 		case GLFW_KEY_B:
 			universe.friction = 0.05f;
-			randomize(&universe, -0.02f, 0.06f, 0.0f, 20.0f, 20.0f, 70.0f);
+			randomizer(&universe, -0.02f, 0.06f, 0.0f, 20.0f, 20.0f, 70.0f);
 		break;
 		case GLFW_KEY_C:
 			universe.friction = 0.01f;
-			randomize(&universe, 0.02f, 0.04f, 0.0f, 30.0f, 30.0f, 100.0f);
+			randomizer(&universe, 0.02f, 0.04f, 0.0f, 30.0f, 30.0f, 100.0f);
 		break;
 		case GLFW_KEY_D:
 			universe.friction = 0.05f;
-			randomize(&universe, -0.01f, 0.04f, 0.0f, 20.0f, 10.0f, 60.0f);
+			randomizer(&universe, -0.01f, 0.04f, 0.0f, 20.0f, 10.0f, 60.0f);
 		break;
 		case GLFW_KEY_F:
 			universe.friction = 0.0f;
-			randomize(&universe, 0.01f, 0.005f, 10.0f, 10.0f, 10.0f, 60.0f);
+			randomizer(&universe, 0.01f, 0.005f, 10.0f, 10.0f, 10.0f, 60.0f);
 		break;
 		case GLFW_KEY_G:
 			universe.friction = 0.1f;
-			randomize(&universe, 0.0f, 0.06f, 0.01f, 20.0f, 10.0f, 50.0f);
+			randomizer(&universe, 0.0f, 0.06f, 0.01f, 20.0f, 10.0f, 50.0f);
 		break;
 		case GLFW_KEY_O:
 			universe.friction = 0.05f;
-			randomize(&universe, 0.0f, 0.04f, 10.0f, 10.0f, 10.0f, 80.0f);
+			randomizer(&universe, 0.0f, 0.04f, 10.0f, 10.0f, 10.0f, 80.0f);
 		break;
 		case GLFW_KEY_L:
 			universe.friction = 0.2f;
-			randomize(&universe, 0.025f, 0.02f, 0.0f, 30.0f, 30.0f, 100.0f);
+			randomizer(&universe, 0.025f, 0.02f, 0.0f, 30.0f, 30.0f, 100.0f);
 		break;
 		case GLFW_KEY_M:
 			universe.friction = 0.05f;
-			randomize(&universe, 0.02f, 0.05f, 0.0f, 20.0f, 20.0f, 50.0f);
+			randomizer(&universe, 0.02f, 0.05f, 0.0f, 20.0f, 20.0f, 50.0f);
 		break;
 		case GLFW_KEY_Q:
 			universe.friction = 0.2f;
-			randomize(&universe, -0.02f, 0.1f, 10.0f, 20.0f, 20.0f, 60.0f);
+			randomizer(&universe, -0.02f, 0.1f, 10.0f, 20.0f, 20.0f, 60.0f);
 		break;
 		case GLFW_KEY_S:
 			universe.friction = 0.01f;
-			randomize(&universe, -0.005f, 0.01f, 10.0f, 10.0f, 20.0f, 50.0f);
+			randomizer(&universe, -0.005f, 0.01f, 10.0f, 10.0f, 20.0f, 50.0f);
 		break;
 		default: break;
 	}
@@ -174,11 +202,13 @@ int main(void) {
 	printf(" ===================================== \n");
 	printf("\n");
 	printf("A particle simulation program.\n\n");
+	int numParticles = 0, numParticleTypes = 0;
+#ifndef MICRO_BENCHMARKS
 	printf("how many particles would you like to create? ");
-	int numParticles, numParticleTypes;
 	scanf("%d", &numParticles);
 	printf("and how many varieties of particles? ");
 	scanf("%d", &numParticleTypes);
+#endif
 	printf("\ninitializing ");
 
 	/* Initialize GLFW. */
@@ -233,6 +263,16 @@ int main(void) {
 	glCheckErrors();
 #endif
 
+#ifdef MICRO_BENCHMARKS
+	/* The micro-benchmarks create their own universes, so we are done after running them. */
+	printf(" done\n\n");
+	glfwSwapInterval(0);
+	runMicroBenchmarks();
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return 0;
+#endif
+
 	glfwSetKeyCallback(window, onKey);
 	glfwSetScrollCallback(window, onMouseWheel);
 	glfwSetFramebufferSizeCallback(window, onFramebufferResize);
@@ -240,8 +280,16 @@ int main(void) {
 	double timerFrequency = (double)glfwGetTimerFrequency();
 	uint64_t t0 = glfwGetTimerValue();
 
+#ifdef PROGRAM_CACHE
+	setProgramCache(PROGRAM_CACHE);
+#endif
+
 	/* Set up the initial universe. */
-	universe = createUniverse(numParticleTypes, numParticles, 1280, 720);
+#ifdef CPU_BACKEND
+	universe = createUniverse(numParticleTypes, numParticles, 1280, 720, BACKEND_CPU);
+#else
+	universe = createUniverse(numParticleTypes, numParticles, 1280, 720, BACKEND_GPU);
+#endif
 	universe.deltaTime = 1.0f;
 	universe.friction = 0.05f;
 	universe.wrap = GL_TRUE;
@@ -259,6 +307,25 @@ int main(void) {
 		fatalError("need at least OpenGL 4.3 to run");
 	}
 
+#if defined(AUTOTUNE) && !defined(CPU_BACKEND)
+	if (!loadWorkGroupSizes(&universe, AUTOTUNE_FILE)) {
+		printf("tuning the workgroup sizes for this GPU ..\n");
+		autotuneWorkGroupSizes(&universe, AUTOTUNE_FILE);
+	}
+	printf("workgroup sizes: scan_tiles %d, setup_tiles %d, sort_particles %d, order_particles %d, update_forces %d, update_positions %d\n",
+		universe.workGroupSizes[TUNED_SCAN_TILES], universe.workGroupSizes[TUNED_SETUP_TILES],
+		universe.workGroupSizes[TUNED_SORT_PARTICLES], universe.workGroupSizes[TUNED_ORDER_PARTICLES],
+		universe.workGroupSizes[TUNED_UPDATE_FORCES], universe.workGroupSizes[TUNED_UPDATE_POSITIONS]);
+#endif
+
+#if defined(TIME_STAGES) || defined(STAGE_LOG)
+	universe.timeStages = 1;
+#endif
+#ifdef STAGE_LOG
+	if (!setStageLog(&universe, STAGE_LOG))
+		fprintf(stderr, "ERROR: failed to open %s\n", STAGE_LOG);
+#endif
+
 	uint64_t t1 = glfwGetTimerValue();
 	printf("created universe in %.3lf seconds\n\n", (t1 - t0) / timerFrequency);
 
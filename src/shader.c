@@ -1,5 +1,7 @@
 #include "shader.h"
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 static char *readEntireFile(const char *filename) {
 	FILE *f = fopen(filename, "rb");
@@ -18,18 +20,43 @@ static char *readEntireFile(const char *filename) {
 	return string;
 }
 
-static GLuint loadShaderComponent(GLenum type, const char *sourceFile) {
-	char* source = readEntireFile(sourceFile);
-	if (!source) {
+/* The source of one shader of a program. The injected text goes after the #version line, which has to come
+   first in the shader, so the source is passed to OpenGL in 3 pieces. It's followed by a #line directive
+   so that the line numbers in the compile errors still match the file. */
+typedef struct ShaderSource {
+	GLenum type;
+	char *source;
+	const GLchar *pieces[3];
+	GLint lengths[3];
+} ShaderSource;
+
+static int readShaderSource(ShaderSource *shader, GLenum type, const char *sourceFile, const char *injected) {
+	shader->type = type;
+	shader->source = readEntireFile(sourceFile);
+	if (!shader->source) {
 		fprintf(stderr, "ERROR: failed to read shader file %s\n", sourceFile);
 		return 0;
 	}
 
-	const GLchar *glSource = (GLchar *)source;
-	GLuint shader = glCreateShader(type);
-	glShaderSource(shader, 1, &glSource, NULL);
+	char *source = shader->source;
+	shader->pieces[0] = (GLchar *)source;
+	shader->pieces[1] = "";
+	shader->pieces[2] = "";
+	shader->lengths[0] = shader->lengths[1] = shader->lengths[2] = -1;
+	char *version = strstr(source, "#version");
+	char *afterVersion = version ? strchr(version, '\n') : NULL;
+	if (injected && afterVersion) {
+		shader->lengths[0] = (GLint)(afterVersion + 1 - source);
+		shader->pieces[1] = (GLchar *)injected;
+		shader->pieces[2] = (GLchar *)(afterVersion + 1);
+	}
+	return 1;
+}
+
+static GLuint compileShader(const ShaderSource *source) {
+	GLuint shader = glCreateShader(source->type);
+	glShaderSource(shader, 3, source->pieces, source->lengths);
 	glCompileShader(shader);
-	free(source);
 
 	GLint compileOk;
 	glGetShaderiv(shader, GL_COMPILE_STATUS, &compileOk);
@@ -68,51 +95,338 @@ static GLboolean linkShaderProgram(Shader program) {
 	return GL_TRUE;
 }
 
-Shader loadShader(const char *vertSourceFile, const char *fragSourceFile) {
-	GLuint vert = loadShaderComponent(GL_VERTEX_SHADER, vertSourceFile);
-	GLuint frag = loadShaderComponent(GL_FRAGMENT_SHADER, fragSourceFile);
+/* The programs in the program cache file, see setProgramCache. The file starts with PROGRAM_CACHE_MAGIC,
+   followed by the programs one after the other. Each has its key, the format and the size of its binary,
+   and then the binary. New programs are appended to the end, so a key can be in the file more than once,
+   and then the last one counts, like in the file of loadWorkGroupSizes. Only that one is kept when the file
+   is loaded, and the file is written again without the others. */
 
-	if (vert == 0 || frag == 0) {
-		glDeleteShader(vert);
-		glDeleteShader(frag);
-		return 0;
+#define PROGRAM_CACHE_MAGIC "PUPROGS1"
+
+typedef struct CachedProgram {
+	uint64_t key;
+	GLenum format;
+	GLsizei length;
+	void *binary;
+} CachedProgram;
+
+static struct ProgramCache {
+	char *filename;
+	int numPrograms;
+	int capacity;
+	CachedProgram *programs;
+	ProgramCacheStats stats;
+} programCache;
+
+/* Add a program to the cache, or replace the one with the same key. Returns 1 if it replaced one. */
+static int addCachedProgram(uint64_t key, GLenum format, GLsizei length, void *binary) {
+	for (int i = 0; i < programCache.numPrograms; ++i) {
+		CachedProgram *program = &programCache.programs[i];
+		if (program->key == key) {
+			free(program->binary);
+			program->format = format;
+			program->length = length;
+			program->binary = binary;
+			return 1;
+		}
 	}
 
-	Shader program = glCreateProgram();
-	glAttachShader(program, vert);
-	glAttachShader(program, frag);
+	if (programCache.numPrograms == programCache.capacity) {
+		programCache.capacity = programCache.capacity ? 2 * programCache.capacity : 16;
+		programCache.programs = (CachedProgram *)realloc(programCache.programs, programCache.capacity * sizeof(CachedProgram));
+	}
+	CachedProgram *program = &programCache.programs[programCache.numPrograms++];
+	program->key = key;
+	program->format = format;
+	program->length = length;
+	program->binary = binary;
+	return 0;
+}
 
-	GLboolean linkOk = linkShaderProgram(program);
-	if (!linkOk) {
+/* Remove a program from the cache. The order of the programs doesn't matter, since every key is only in there once. */
+static void removeCachedProgram(int index) {
+	free(programCache.programs[index].binary);
+	programCache.programs[index] = programCache.programs[--programCache.numPrograms];
+}
+
+/* Write one program to the end of the cache file. */
+static void writeCachedProgram(FILE *f, const CachedProgram *program) {
+	uint32_t format = (uint32_t)program->format, length = (uint32_t)program->length;
+	fwrite(&program->key, sizeof(program->key), 1, f);
+	fwrite(&format, sizeof(format), 1, f);
+	fwrite(&length, sizeof(length), 1, f);
+	fwrite(program->binary, 1, (size_t)program->length, f);
+}
+
+/* Write the whole cache file again from the programs in the cache. */
+static void writeProgramCache(void) {
+	FILE *f = fopen(programCache.filename, "wb");
+	if (!f) {
+		fprintf(stderr, "ERROR: failed to create the program cache %s\n", programCache.filename);
+		return;
+	}
+	fwrite(PROGRAM_CACHE_MAGIC, 1, sizeof(PROGRAM_CACHE_MAGIC) - 1, f);
+	for (int i = 0; i < programCache.numPrograms; ++i)
+		writeCachedProgram(f, &programCache.programs[i]);
+	fclose(f);
+}
+
+void setProgramCache(const char *filename) {
+	for (int i = 0; i < programCache.numPrograms; ++i)
+		free(programCache.programs[i].binary);
+	free(programCache.programs);
+	free(programCache.filename);
+	memset(&programCache, 0, sizeof(programCache));
+	if (!filename)
+		return;
+
+	/* Without any binary formats the driver can't save programs, so leave the cache off. */
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	if (numFormats <= 0)
+		return;
+
+	programCache.filename = (char *)malloc(strlen(filename) + 1);
+	strcpy(programCache.filename, filename);
+
+	/* A file that is missing, or isn't a program cache, is started over. If the last program was cut off, the
+	   file is written again without it, so that the programs appended after it can be read back. It is also
+	   written again if it had older programs with the same key as a later one, so that it doesn't keep growing. */
+	char magic[sizeof(PROGRAM_CACHE_MAGIC) - 1];
+	int complete = 0;
+	int replaced = 0;
+	FILE *f = fopen(filename, "rb");
+	if (f && fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, PROGRAM_CACHE_MAGIC, sizeof(magic)) == 0) {
+		uint64_t key;
+		uint32_t format, length;
+		while (1) {
+			size_t keyRead = fread(&key, sizeof(key), 1, f);
+			if (keyRead == 0 && feof(f)) {
+				complete = 1;
+				break;
+			}
+			if (keyRead != 1 || fread(&format, sizeof(format), 1, f) != 1 || fread(&length, sizeof(length), 1, f) != 1)
+				break;
+			void *binary = malloc(length);
+			if (!binary || fread(binary, 1, length, f) != length) {
+				free(binary);
+				break;
+			}
+			replaced += addCachedProgram(key, (GLenum)format, (GLsizei)length, binary);
+		}
+	}
+	if (f)
+		fclose(f);
+	if (!complete || replaced > 0)
+		writeProgramCache();
+}
+
+ProgramCacheStats getProgramCacheStats(void) {
+	return programCache.stats;
+}
+
+/* 64-bit FNV-1a, which is plenty to tell a couple of programs apart. */
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	return hash;
+}
+
+/* A binary only works with the same driver on the same GPU, so those are part of the key, together
+   with the exact source of every shader, which includes the constants injected into a variant. */
+static uint64_t hashProgram(int numShaders, const ShaderSource *shaders) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (int i = 0; i < 3; ++i) {
+		const char *string = (const char *)glGetString(strings[i]);
+		hash = hashBytes(hash, string, strlen(string) + 1);
+	}
+	for (int i = 0; i < numShaders; ++i) {
+		hash = hashBytes(hash, &shaders[i].type, sizeof(shaders[i].type));
+		for (int j = 0; j < 3; ++j) {
+			const GLchar *piece = shaders[i].pieces[j];
+			hash = hashBytes(hash, piece, shaders[i].lengths[j] < 0 ? strlen(piece) : (size_t)shaders[i].lengths[j]);
+		}
+		hash = hashBytes(hash, "", 1);
+	}
+	return hash;
+}
+
+/* Try the binary of the program in the cache. The driver rejects a binary it can't use, for example after
+   an update that didn't change GL_VERSION, and then this returns 0 so that the program is compiled. The
+   rejected binary is dropped from the cache and its file right away, in case the program doesn't compile. */
+static GLuint loadCachedProgram(uint64_t key) {
+	for (int i = 0; i < programCache.numPrograms; ++i) {
+		CachedProgram *cached = &programCache.programs[i];
+		if (cached->key != key)
+			continue;
+
+		GLuint program = glCreateProgram();
+		glProgramBinary(program, cached->format, cached->binary, cached->length);
+		GLint linkOk;
+		glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+		if (linkOk) {
+			programCache.stats.hits += 1;
+			return program;
+		}
 		glDeleteProgram(program);
+		programCache.stats.rejected += 1;
+		removeCachedProgram(i);
+		writeProgramCache();
 		return 0;
 	}
+	return 0;
+}
+
+static void saveCachedProgram(uint64_t key, GLuint program) {
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	GLenum format;
+	void *binary = malloc((size_t)length);
+	glGetProgramBinary(program, length, NULL, &format, binary);
+	if (addCachedProgram(key, format, length, binary)) {
+		writeProgramCache();
+		return;
+	}
+
+	FILE *f = fopen(programCache.filename, "ab");
+	if (!f) {
+		fprintf(stderr, "ERROR: failed to write to the program cache %s\n", programCache.filename);
+		return;
+	}
+	writeCachedProgram(f, &programCache.programs[programCache.numPrograms - 1]);
+	fclose(f);
+}
+
+/* Load the program from the program cache if it's there, and otherwise compile and link it from the sources,
+   and add it to the cache. This frees the sources. */
+static GLuint loadProgram(int numShaders, ShaderSource *sources) {
+	GLuint program = 0;
+	uint64_t key = 0;
+	if (programCache.filename) {
+		key = hashProgram(numShaders, sources);
+		program = loadCachedProgram(key);
+		if (program == 0)
+			programCache.stats.misses += 1;
+	}
+
+	GLuint shaders[2] = { 0, 0 };
+	if (program == 0) {
+		int compileOk = 1;
+		for (int i = 0; i < numShaders; ++i) {
+			shaders[i] = compileShader(&sources[i]);
+			compileOk = compileOk && shaders[i] != 0;
+		}
+
+		if (compileOk) {
+			program = glCreateProgram();
+			for (int i = 0; i < numShaders; ++i)
+				glAttachShader(program, shaders[i]);
+			if (programCache.filename)
+				glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
-	glDetachShader(program, vert);
-	glDetachShader(program, frag);
-	glDeleteShader(vert);
-	glDeleteShader(frag);
+			GLboolean linkOk = linkShaderProgram(program);
+			for (int i = 0; i < numShaders; ++i)
+				glDetachShader(program, shaders[i]);
+			if (!linkOk) {
+				glDeleteProgram(program);
+				program = 0;
+			} else if (programCache.filename) {
+				saveCachedProgram(key, program);
+			}
+		}
+	}
+
+	for (int i = 0; i < numShaders; ++i) {
+		glDeleteShader(shaders[i]);
+		free(sources[i].source);
+	}
 	return program;
 }
 
-ComputeShader loadComputeShader(const char *sourceFile) {
-	GLuint compute = loadShaderComponent(GL_COMPUTE_SHADER, sourceFile);
-	
-	if (compute == 0) {
-		glDeleteShader(compute);
+Shader loadShader(const char *vertSourceFile, const char *fragSourceFile) {
+	ShaderSource sources[2];
+	int vertOk = readShaderSource(&sources[0], GL_VERTEX_SHADER, vertSourceFile, NULL);
+	int fragOk = readShaderSource(&sources[1], GL_FRAGMENT_SHADER, fragSourceFile, NULL);
+
+	if (!vertOk || !fragOk) {
+		free(vertOk ? sources[0].source : NULL);
+		free(fragOk ? sources[1].source : NULL);
 		return 0;
 	}
 
-	ComputeShader program = glCreateProgram();
-	glAttachShader(program, compute);
+	return loadProgram(2, sources);
+}
 
-	GLboolean linkOk = linkShaderProgram(program);
-	if (!linkOk) {
-		glDeleteProgram(program);
+static ComputeShader loadComputeShaderInjected(const char *sourceFile, const char *injected) {
+	ShaderSource source;
+	if (!readShaderSource(&source, GL_COMPUTE_SHADER, sourceFile, injected))
 		return 0;
-	}
 
-	glDetachShader(program, compute);
-	glDeleteShader(compute);
+	return loadProgram(1, &source);
+}
+
+ComputeShader loadComputeShader(const char *sourceFile) {
+	return loadComputeShaderInjected(sourceFile, NULL);
+}
+
+ComputeShader loadComputeShaderWithConstants(const char *sourceFile, int numConstants, const char *const *names, const int *values) {
+	size_t size = sizeof("#line 2\n");
+	for (int i = 0; i < numConstants; ++i)
+		size += strlen("#define  -2147483648\n") + strlen(names[i]);
+
+	char *injected = (char *)malloc(size);
+	char *end = injected;
+	for (int i = 0; i < numConstants; ++i)
+		end += sprintf(end, "#define %s %d\n", names[i], values[i]);
+	strcpy(end, "#line 2\n");
+
+	ComputeShader program = loadComputeShaderInjected(sourceFile, injected);
+	free(injected);
 	return program;
+}
+
+ShaderVariants createShaderVariants(const char *sourceFile, int numConstants, const char *const *names) {
+	ShaderVariants variants;
+	variants.sourceFile = sourceFile;
+	variants.numConstants = numConstants < MAX_SHADER_CONSTANTS ? numConstants : MAX_SHADER_CONSTANTS;
+	for (int i = 0; i < variants.numConstants; ++i)
+		variants.names[i] = names[i];
+	variants.numVariants = 0;
+	variants.capacity = 0;
+	variants.variants = NULL;
+	return variants;
+}
+
+ComputeShader getShaderVariant(ShaderVariants *variants, const int *values) {
+	/* There are only ever a couple of variants, so a linear search is fine. */
+	for (int i = 0; i < variants->numVariants; ++i) {
+		if (memcmp(variants->variants[i].values, values, variants->numConstants * sizeof(int)) == 0)
+			return variants->variants[i].program;
+	}
+
+	if (variants->numVariants == variants->capacity) {
+		variants->capacity = variants->capacity ? 2 * variants->capacity : 4;
+		variants->variants = (struct ShaderVariant *)realloc(variants->variants, variants->capacity * sizeof(struct ShaderVariant));
+	}
+
+	/* A variant that fails to compile is cached as 0 as well, so that it doesn't get recompiled every time. */
+	struct ShaderVariant *variant = &variants->variants[variants->numVariants++];
+	memset(variant->values, 0, sizeof(variant->values));
+	memcpy(variant->values, values, variants->numConstants * sizeof(int));
+	variant->program = loadComputeShaderWithConstants(variants->sourceFile, variants->numConstants, variants->names, values);
+	return variant->program;
+}
+
+void destroyShaderVariants(ShaderVariants *variants) {
+	for (int i = 0; i < variants->numVariants; ++i)
+		glDeleteProgram(variants->variants[i].program);
+	free(variants->variants);
+	variants->variants = NULL;
+	variants->numVariants = 0;
+	variants->capacity = 0;
 }
\ No newline at end of file
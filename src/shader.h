@@ -8,12 +8,63 @@ typedef GLuint Shader;
 typedef GLuint ComputeShader;
 typedef GLuint GpuBuffer;
 
+/* How the program cache has been doing since it was set. */
+typedef struct ProgramCacheStats {
+	int hits;     /* programs that were loaded from the cache */
+	int misses;   /* programs that weren't in the cache, so they were compiled and added to it */
+	int rejected; /* programs whose binary the driver didn't take, these are counted as misses too */
+} ProgramCacheStats;
+
+/* Keep the linked programs in the given file, and load them from it instead of compiling them when they are
+   loaded again, even by a later run. Each program is looked up by a hash of its sources and the GL_VENDOR,
+   GL_RENDERER and GL_VERSION strings, so programs from other drivers are just never used. If the driver
+   rejects a binary, it is dropped from the file, and the program is compiled from its sources and saved
+   again. When the file is loaded, only the latest program of each hash is kept. Pass NULL to turn the cache
+   off, which is the default. The cache also stays off if the driver doesn't support any program binary
+   formats. This needs the OpenGL context, so call it after the context has been created. */
+void setProgramCache(const char *filename);
+
+ProgramCacheStats getProgramCacheStats(void);
+
 /* Load, compile, and link an OpenGL shader program from the given vertex and fragment shader source files. */
 Shader loadShader(const char *vertSourceFile, const char *fragSourceFile);
 
 /* Load, compile, and link an OpenGL compute shader program from the given source code file. */
 ComputeShader loadComputeShader(const char *sourceFile);
 
+/* Like loadComputeShader, but first inject a "#define name value" line for each of the given constants
+   right after the #version line of the source. The shader can then use them like literal values, or
+   leave out code with the preprocessor, and the compiler removes the branches that depend on them. */
+ComputeShader loadComputeShaderWithConstants(const char *sourceFile, int numConstants, const char *const *names, const int *values);
+
+/* The most constants that a compute shader can be specialised on. */
+#define MAX_SHADER_CONSTANTS 4
+
+/* A compute shader that is compiled into a separate program for each combination of values of its
+   constants, the first time that combination is asked for. Switching back to an earlier combination
+   just picks the cached program. */
+typedef struct ShaderVariants {
+	const char *sourceFile;
+	int numConstants;
+	const char *names[MAX_SHADER_CONSTANTS];
+	int numVariants;
+	int capacity;
+	struct ShaderVariant {
+		int values[MAX_SHADER_CONSTANTS];
+		ComputeShader program;
+	} *variants;
+} ShaderVariants;
+
+/* Set up an empty cache of variants of the given compute shader. Nothing is compiled until getShaderVariant. */
+ShaderVariants createShaderVariants(const char *sourceFile, int numConstants, const char *const *names);
+
+/* Get the program for the given values of the constants, in the same order as the names they were created
+   with. This compiles the variant if it isn't cached yet. */
+ComputeShader getShaderVariant(ShaderVariants *variants, const int *values);
+
+/* Delete all of the compiled variants. */
+void destroyShaderVariants(ShaderVariants *variants);
+
 #ifndef NDEBUG
 /* Check if any OpenGL errors have occured in previous GL calls. */
 #define glCheckErrors()\
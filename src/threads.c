@@ -0,0 +1,549 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include "threads.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condition;
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+#endif
+
+#ifdef _WIN32
+typedef DWORD_PTR Affinity;
+#elif defined(__linux__)
+typedef cpu_set_t Affinity;
+#else
+typedef int Affinity;
+#endif
+
+/* The tasks that one thread still has to run, as a range [begin, end) into the task array
+   of runTasks(). Both ends are packed into a single 64-bit integer so that the owner taking
+   a task from the front and thieves taking tasks from the back can use a single atomic
+   compare-exchange. Each queue gets its own cache line so threads don't fight over them. */
+typedef struct TaskQueue {
+	volatile uint64_t range;
+	char padding[64 - sizeof(uint64_t)];
+} TaskQueue;
+
+struct ThreadPool {
+	int numThreads;
+	TaskQueue *queues;    /* one per thread */
+	ThreadStats *stats;   /* one per thread */
+	double *busyTimes;    /* one per thread, the busy time during the current runTasks() call */
+	Thread *threads;   /* numThreads - 1 workers, the calling thread is thread 0 */
+	int *processors;   /* one per thread, the processor it is pinned to or -1 if it isn't pinned */
+	int *nodes;        /* one per thread, the NUMA node of its processor */
+	Affinity affinity; /* the processors the creating thread could run on, which unpinned threads go back to */
+	Mutex mutex;
+	Condition start;   /* signalled when a new job is posted */
+	Condition finish;  /* signalled when the last worker finishes a job */
+	ParallelJob job;
+	void *data;
+	int generation;    /* incremented each time a new job is posted */
+	int numBusy;       /* number of workers that haven't finished the current job */
+	int quit;
+};
+
+/* Arguments passed to each worker thread on startup. */
+typedef struct WorkerArgs {
+	ThreadPool *pool;
+	int threadID;
+} WorkerArgs;
+
+/* Thin wrappers so the rest of the file doesn't have to care about the platform. */
+
+#ifdef _WIN32
+
+static void initMutex(Mutex *m)             { InitializeCriticalSection(m); }
+static void destroyMutex(Mutex *m)          { DeleteCriticalSection(m); }
+static void lockMutex(Mutex *m)             { EnterCriticalSection(m); }
+static void unlockMutex(Mutex *m)           { LeaveCriticalSection(m); }
+static void initCondition(Condition *c)     { InitializeConditionVariable(c); }
+static void destroyCondition(Condition *c)  { (void)c; }
+static void waitCondition(Condition *c, Mutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void broadcastCondition(Condition *c)      { WakeAllConditionVariable(c); }
+
+#else
+
+static void initMutex(Mutex *m)             { pthread_mutex_init(m, NULL); }
+static void destroyMutex(Mutex *m)          { pthread_mutex_destroy(m); }
+static void lockMutex(Mutex *m)             { pthread_mutex_lock(m); }
+static void unlockMutex(Mutex *m)           { pthread_mutex_unlock(m); }
+static void initCondition(Condition *c)     { pthread_cond_init(c, NULL); }
+static void destroyCondition(Condition *c)  { pthread_cond_destroy(c); }
+static void waitCondition(Condition *c, Mutex *m) { pthread_cond_wait(c, m); }
+static void broadcastCondition(Condition *c)      { pthread_cond_broadcast(c); }
+
+#endif
+
+/* Get and set the processors that the calling thread may run on. */
+
+#ifdef _WIN32
+
+static void getAffinity(Affinity *a) {
+	/* There is no GetThreadAffinityMask, but setting the mask returns the old one. */
+	DWORD_PTR processMask, systemMask;
+	GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+	*a = SetThreadAffinityMask(GetCurrentThread(), processMask);
+	if (*a)
+		SetThreadAffinityMask(GetCurrentThread(), *a);
+	else
+		*a = processMask;
+}
+static void setAffinity(const Affinity *a) { SetThreadAffinityMask(GetCurrentThread(), *a); }
+
+#elif defined(__linux__)
+
+static void getAffinity(Affinity *a)       { pthread_getaffinity_np(pthread_self(), sizeof(*a), a); }
+static void setAffinity(const Affinity *a) { pthread_setaffinity_np(pthread_self(), sizeof(*a), a); }
+
+#else
+
+static void getAffinity(Affinity *a)       { *a = 0; }
+static void setAffinity(const Affinity *a) { (void)a; }
+
+#endif
+
+int getNumProcessors(void) {
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+#endif
+}
+
+/* Get the NUMA node of every logical processor (up to maxProcessors of them) and return the number
+   of nodes. Processors that aren't part of any node we could find are put on node 0. */
+static int getProcessorNodes(int *nodes, int maxProcessors) {
+	memset(nodes, 0, maxProcessors * sizeof(int));
+	int numNodes = 1;
+#ifdef _WIN32
+	ULONG highestNode = 0;
+	if (GetNumaHighestNodeNumber(&highestNode)) {
+		for (ULONG node = 0; node <= highestNode; ++node) {
+			ULONGLONG mask = 0;
+			if (!GetNumaNodeProcessorMask((UCHAR)node, &mask))
+				continue;
+			for (int i = 0; i < maxProcessors && i < 64; ++i)
+				if (mask & ((ULONGLONG)1 << i))
+					nodes[i] = (int)node;
+			numNodes = (int)node + 1;
+		}
+	}
+#elif defined(__linux__)
+	/* Each node lists its processors as ranges, like "0-7,16-23". */
+	for (int node = 0;; ++node) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *file = fopen(path, "r");
+		if (!file)
+			break;
+		int first, last;
+		while (fscanf(file, "%d", &first) == 1) {
+			last = first;
+			int c = fgetc(file);
+			if (c == '-') {
+				if (fscanf(file, "%d", &last) != 1)
+					break;
+				c = fgetc(file);
+			}
+			for (int i = first; i <= last && i < maxProcessors; ++i)
+				nodes[i] = node;
+			if (c != ',')
+				break;
+		}
+		fclose(file);
+		numNodes = node + 1;
+	}
+#else
+	(void)maxProcessors;
+#endif
+	return numNodes;
+}
+
+int getNumNodes(void) {
+	int numProcessors = getNumProcessors();
+	int *nodes = (int *)malloc(numProcessors * sizeof(int));
+	int numNodes = getProcessorNodes(nodes, numProcessors);
+	free(nodes);
+	return numNodes;
+}
+
+double getTime(void) {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+#endif
+}
+
+void splitWork(int count, int threadID, int numThreads, int *begin, int *end) {
+	int workSize = (count + threadID) / numThreads;
+	int extra = threadID - numThreads + count % numThreads;
+	int workOffset = (count / numThreads) * threadID + (extra > 0 ? extra : 0);
+	*begin = workOffset;
+	*end = workOffset + workSize;
+}
+
+/* The main loop of each worker thread. Wait for a job, run it, report that we are done, repeat. */
+#ifdef _WIN32
+static DWORD WINAPI workerMain(void *arg) {
+#else
+static void *workerMain(void *arg) {
+#endif
+	WorkerArgs args = *(WorkerArgs *)arg;
+	free(arg);
+	ThreadPool *pool = args.pool;
+	int seenGeneration = 0;
+
+	for (;;) {
+		lockMutex(&pool->mutex);
+		while (pool->generation == seenGeneration && !pool->quit)
+			waitCondition(&pool->start, &pool->mutex);
+		if (pool->quit) {
+			unlockMutex(&pool->mutex);
+			break;
+		}
+		seenGeneration = pool->generation;
+		ParallelJob job = pool->job;
+		void *data = pool->data;
+		unlockMutex(&pool->mutex);
+
+		job(data, args.threadID, pool->numThreads);
+
+		lockMutex(&pool->mutex);
+		if (--pool->numBusy == 0)
+			broadcastCondition(&pool->finish);
+		unlockMutex(&pool->mutex);
+	}
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+ThreadPool *createThreadPool(int numThreads) {
+	if (numThreads < 1)
+		numThreads = 1;
+
+	ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+	pool->numThreads = numThreads;
+	pool->queues = (TaskQueue *)calloc(numThreads, sizeof(TaskQueue));
+	pool->stats = (ThreadStats *)calloc(numThreads, sizeof(ThreadStats));
+	pool->busyTimes = (double *)calloc(numThreads, sizeof(double));
+	pool->threads = (Thread *)malloc(numThreads * sizeof(Thread));
+	pool->processors = (int *)malloc(numThreads * sizeof(int));
+	pool->nodes = (int *)calloc(numThreads, sizeof(int));
+	for (int i = 0; i < numThreads; ++i)
+		pool->processors[i] = -1;
+	getAffinity(&pool->affinity);
+	initMutex(&pool->mutex);
+	initCondition(&pool->start);
+	initCondition(&pool->finish);
+
+	for (int i = 1; i < numThreads; ++i) {
+		WorkerArgs *args = (WorkerArgs *)malloc(sizeof(WorkerArgs));
+		args->pool = pool;
+		args->threadID = i;
+	#ifdef _WIN32
+		pool->threads[i] = CreateThread(NULL, 0, workerMain, args, 0, NULL);
+	#else
+		pthread_create(&pool->threads[i], NULL, workerMain, args);
+	#endif
+	}
+
+	return pool;
+}
+
+void destroyThreadPool(ThreadPool *pool) {
+	if (!pool)
+		return;
+
+	lockMutex(&pool->mutex);
+	pool->quit = 1;
+	broadcastCondition(&pool->start);
+	unlockMutex(&pool->mutex);
+
+	for (int i = 1; i < pool->numThreads; ++i) {
+	#ifdef _WIN32
+		WaitForSingleObject(pool->threads[i], INFINITE);
+		CloseHandle(pool->threads[i]);
+	#else
+		pthread_join(pool->threads[i], NULL);
+	#endif
+	}
+
+	/* Give the calling thread back the processors it had before it was pinned. */
+	if (pool->processors[0] >= 0)
+		setAffinity(&pool->affinity);
+
+	destroyCondition(&pool->start);
+	destroyCondition(&pool->finish);
+	destroyMutex(&pool->mutex);
+	free(pool->threads);
+	free(pool->processors);
+	free(pool->nodes);
+	free(pool->queues);
+	free(pool->stats);
+	free(pool->busyTimes);
+	free(pool);
+}
+
+int getNumThreads(ThreadPool *pool) {
+	return pool->numThreads;
+}
+
+/* Pin the calling thread to its processor in the pool, or give it back the processors that the
+   thread which created the pool had if it has none. The workers inherited those when they started. */
+static void pinJob(void *data, int threadID, int numThreads) {
+	ThreadPool *pool = (ThreadPool *)data;
+	int processor = pool->processors[threadID];
+	(void)numThreads;
+	if (processor < 0) {
+		setAffinity(&pool->affinity);
+		return;
+	}
+#ifdef _WIN32
+	if (processor < 64)
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << processor);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(processor, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+void pinThreads(ThreadPool *pool, int pin) {
+	int numProcessors = getNumProcessors();
+	int *nodes = (int *)malloc(numProcessors * sizeof(int));
+	int numNodes = getProcessorNodes(nodes, numProcessors);
+
+	/* Order the processors by node, and give every thread the next processor in that order.
+	   If there are more threads than processors, some of them have to share. */
+	int *order = (int *)malloc(numProcessors * sizeof(int));
+	int numOrdered = 0;
+	for (int node = 0; node < numNodes; ++node)
+		for (int i = 0; i < numProcessors; ++i)
+			if (nodes[i] == node)
+				order[numOrdered++] = i;
+
+	for (int i = 0; i < pool->numThreads; ++i) {
+		int processor = order[(int)((long long)i * numOrdered / pool->numThreads)];
+		pool->processors[i] = pin ? processor : -1;
+		pool->nodes[i] = pin ? nodes[processor] : 0;
+	}
+
+	free(order);
+	free(nodes);
+	runParallel(pool, pinJob, pool);
+}
+
+int getThreadNode(ThreadPool *pool, int threadID) {
+	return pool->nodes[threadID];
+}
+
+void runParallel(ThreadPool *pool, ParallelJob job, void *data) {
+	if (pool->numThreads == 1) {
+		job(data, 0, 1);
+		return;
+	}
+
+	lockMutex(&pool->mutex);
+	pool->job = job;
+	pool->data = data;
+	pool->numBusy = pool->numThreads - 1;
+	pool->generation++;
+	broadcastCondition(&pool->start);
+	unlockMutex(&pool->mutex);
+
+	/* The calling thread does its share of the work too. */
+	job(data, 0, pool->numThreads);
+
+	lockMutex(&pool->mutex);
+	while (pool->numBusy > 0)
+		waitCondition(&pool->finish, &pool->mutex);
+	unlockMutex(&pool->mutex);
+}
+
+/* Atomic operations on the packed task ranges. */
+
+static uint64_t packRange(int begin, int end) {
+	return ((uint64_t)(uint32_t)begin << 32) | (uint64_t)(uint32_t)end;
+}
+
+static int rangeBegin(uint64_t range) { return (int)(uint32_t)(range >> 32); }
+static int rangeEnd(uint64_t range)   { return (int)(uint32_t)range; }
+
+static uint64_t loadRange(volatile uint64_t *range) {
+#ifdef _MSC_VER
+	return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)range, 0, 0);
+#else
+	return __atomic_load_n(range, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void storeRange(volatile uint64_t *range, uint64_t value) {
+#ifdef _MSC_VER
+	_InterlockedExchange64((volatile __int64 *)range, (__int64)value);
+#else
+	__atomic_store_n(range, value, __ATOMIC_RELEASE);
+#endif
+}
+
+/* Replace expected with desired if the range still holds expected. Returns non-zero on success. */
+static int swapRange(volatile uint64_t *range, uint64_t expected, uint64_t desired) {
+#ifdef _MSC_VER
+	return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)range, (__int64)desired, (__int64)expected) == expected;
+#else
+	return __atomic_compare_exchange_n(range, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/* Take the next task from the front of a queue, or return -1 if it is empty. */
+static int popTask(TaskQueue *queue) {
+	for (;;) {
+		uint64_t range = loadRange(&queue->range);
+		int begin = rangeBegin(range);
+		int end = rangeEnd(range);
+		if (begin >= end)
+			return -1;
+		if (swapRange(&queue->range, range, packRange(begin + 1, end)))
+			return begin;
+	}
+}
+
+/* Steal half of the tasks from the back of the fullest queue and move them into the thief's own
+   (empty) queue. Since all queues are ranges of the same task array, this is just a matter of
+   moving the boundaries around. Returns 0 once there is nothing left to steal anywhere. */
+static int stealTasks(ThreadPool *pool, int thiefID) {
+	for (;;) {
+		int victimID = -1;
+		int mostTasks = 0;
+		uint64_t victimRange = 0;
+		for (int i = 1; i < pool->numThreads; ++i) {
+			int id = (thiefID + i) % pool->numThreads;
+			uint64_t range = loadRange(&pool->queues[id].range);
+			int numTasks = rangeEnd(range) - rangeBegin(range);
+			if (numTasks > mostTasks) {
+				victimID = id;
+				mostTasks = numTasks;
+				victimRange = range;
+			}
+		}
+		if (victimID < 0)
+			return 0;
+
+		int begin = rangeBegin(victimRange);
+		int end = rangeEnd(victimRange);
+		int half = (end - begin + 1) / 2;
+		if (swapRange(&pool->queues[victimID].range, victimRange, packRange(begin, end - half))) {
+			storeRange(&pool->queues[thiefID].range, packRange(end - half, end));
+			return 1;
+		}
+	}
+}
+
+typedef struct TaskJob {
+	ThreadPool *pool;
+	const Task *tasks;
+	int numTasks;
+	TaskFunc func;
+	void *data;
+	int steal;
+} TaskJob;
+
+static void runTaskJob(void *data, int threadID, int numThreads) {
+	TaskJob *job = (TaskJob *)data;
+	ThreadPool *pool = job->pool;
+	(void)numThreads;
+
+	TaskQueue *queue = &pool->queues[threadID];
+	ThreadStats *stats = &pool->stats[threadID];
+	double busyTime = 0;
+
+	for (;;) {
+		int taskID = popTask(queue);
+		if (taskID < 0) {
+			if (!job->steal || !stealTasks(pool, threadID))
+				break;
+			stats->numSteals++;
+			continue;
+		}
+
+		double t0 = getTime();
+		job->func(job->data, &job->tasks[taskID], threadID);
+		busyTime += getTime() - t0;
+		stats->numTasks++;
+	}
+
+	pool->busyTimes[threadID] = busyTime;
+}
+
+void runTasks(ThreadPool *pool, const Task *tasks, int numTasks, TaskFunc func, void *data, int steal) {
+	runTasksSplit(pool, tasks, numTasks, NULL, func, data, steal);
+}
+
+void runTasksSplit(ThreadPool *pool, const Task *tasks, int numTasks, const int *first, TaskFunc func, void *data, int steal) {
+	TaskJob job;
+	job.pool = pool;
+	job.tasks = tasks;
+	job.numTasks = numTasks;
+	job.func = func;
+	job.data = data;
+	job.steal = steal;
+
+	for (int i = 0; i < pool->numThreads; ++i) {
+		int begin, end;
+		if (first) {
+			begin = first[i];
+			end = first[i + 1];
+		} else {
+			splitWork(numTasks, i, pool->numThreads, &begin, &end);
+		}
+		storeRange(&pool->queues[i].range, packRange(begin, end));
+	}
+
+	double t0 = getTime();
+	runParallel(pool, runTaskJob, &job);
+	double wallTime = getTime() - t0;
+
+	for (int i = 0; i < pool->numThreads; ++i) {
+		pool->stats[i].busyTime += pool->busyTimes[i];
+		pool->stats[i].idleTime += wallTime - pool->busyTimes[i];
+	}
+}
+
+const ThreadStats *getThreadStats(ThreadPool *pool) {
+	return pool->stats;
+}
+
+void resetThreadStats(ThreadPool *pool) {
+	memset(pool->stats, 0, pool->numThreads * sizeof(ThreadStats));
+}
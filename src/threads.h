@@ -0,0 +1,91 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+/* A pool of worker threads which all run the same job in parallel.
+   The thread that calls runParallel() takes part in the job as thread 0,
+   so a pool of 1 thread simply runs the job on the calling thread. */
+typedef struct ThreadPool ThreadPool;
+
+/* A job that is run by every thread in a pool. threadID is in [0, numThreads). */
+typedef void (*ParallelJob)(void *data, int threadID, int numThreads);
+
+/* A piece of work for runTasks(). What the fields mean is up to the task function.
+   For example, in the CPU force pass a task is the range of particles [begin, end) of tile id. */
+typedef struct Task {
+	int id;
+	int begin;
+	int end;
+} Task;
+
+/* A function that runs a single task. */
+typedef void (*TaskFunc)(void *data, const Task *task, int threadID);
+
+/* How one thread of a pool spent its time in runTasks(), accumulated until resetThreadStats(). */
+typedef struct ThreadStats {
+	double busyTime; /* seconds spent running tasks */
+	double idleTime; /* seconds spent looking for tasks or waiting for the other threads to finish */
+	int numTasks;    /* number of tasks run */
+	int numSteals;   /* number of times this thread stole tasks from another thread */
+} ThreadStats;
+
+/* Get the number of logical processors on this machine. */
+int getNumProcessors(void);
+
+/* Get the number of NUMA nodes on this machine, 1 if it doesn't have NUMA. */
+int getNumNodes(void);
+
+/* Create a pool with the given number of threads (including the calling thread). */
+ThreadPool *createThreadPool(int numThreads);
+
+/* Stop all the worker threads and free the pool. */
+void destroyThreadPool(ThreadPool *pool);
+
+/* Get the number of threads in the pool (including the calling thread). */
+int getNumThreads(ThreadPool *pool);
+
+/* Pin every thread of the pool to its own logical processor, or unpin them again if pin is 0.
+   The threads are spread evenly over the processors, ordered by NUMA node, so consecutive threads
+   end up on the same node. Unpinning, or destroying the pool, gives the threads back the processors
+   that the thread which created the pool had, so the calling thread (usually the one with the OpenGL
+   context) ends up like it was. This only does something on Windows and Linux. */
+void pinThreads(ThreadPool *pool, int pin);
+
+/* Get the NUMA node that a thread of the pool is pinned to, or 0 if the threads aren't pinned. */
+int getThreadNode(ThreadPool *pool, int threadID);
+
+/* Run the job on all threads of the pool and wait until every thread has finished it. */
+void runParallel(ThreadPool *pool, ParallelJob job, void *data);
+
+/* Run all of the tasks on the threads of the pool and wait until they are all finished.
+   The tasks are first split into one contiguous block per thread. If steal is non-zero, a
+   thread that runs out of tasks steals half of the remaining tasks from the thread that has
+   the most tasks left, so that uneven tasks still keep every thread busy until the end. */
+void runTasks(ThreadPool *pool, const Task *tasks, int numTasks, TaskFunc func, void *data, int steal);
+
+/* Like runTasks(), but thread i starts out with the tasks [first[i], first[i + 1]) instead of an even split.
+   first has to have getNumThreads() + 1 elements, and first[getNumThreads()] has to be numTasks. */
+void runTasksSplit(ThreadPool *pool, const Task *tasks, int numTasks, const int *first, TaskFunc func, void *data, int steal);
+
+/* Get the statistics of every thread of the pool (an array of getNumThreads() elements). */
+const ThreadStats *getThreadStats(ThreadPool *pool);
+
+/* Reset the statistics of every thread of the pool to 0. */
+void resetThreadStats(ThreadPool *pool);
+
+/* Split count items evenly between numThreads threads and get the range [*begin, *end) for one thread.
+   Every thread gets the same number of items + the last couple of threads might get an extra item
+   if the number of threads doesn't evenly divide the number of items. */
+void splitWork(int count, int threadID, int numThreads, int *begin, int *end);
+
+/* Get a timestamp in seconds from a high resolution monotonic clock. */
+double getTime(void);
+
+/* Atomically add value to the integer at address and return the previous value. */
+#ifdef _MSC_VER
+#include <intrin.h>
+#define atomicAdd(address, value) ((int)_InterlockedExchangeAdd((volatile long *)(address), (long)(value)))
+#else
+#define atomicAdd(address, value) __atomic_fetch_add((address), (value), __ATOMIC_RELAXED)
+#endif
+
+#endif
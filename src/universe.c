@@ -1,51 +1,261 @@
 #define GLAD_IMPLEMENTATION
 #include "universe.h"
+#include "cpu.h"
 #include <stddef.h>
+#include <string.h>
 #include <time.h>
 
+/* The number of tiles that each workgroup of reduce_tiles.glsl and setup_tiles.glsl handles. It is injected
+   into both, and each thread handles TILES_PER_BLOCK / LOCAL_SIZE of them, so it has to be a multiple of
+   every size in workGroupSizeCandidates. */
+#define TILES_PER_BLOCK 4096
+
+/* The workgroup sizes that autotuneWorkGroupSizes tries, from small to large. */
+static const int workGroupSizeCandidates[] = { 64, 128, 256, 512, 1024 };
+#define NUM_WORK_GROUP_SIZE_CANDIDATES ((int)(sizeof(workGroupSizeCandidates) / sizeof(workGroupSizeCandidates[0])))
+
+/* The number of samples of the force law in each row of the force table, spaced evenly over the squared
+   distance, and the number of finer samples after them that are spaced evenly over the square root of the
+   distance up to the second sample. These have to be the same as forceTableSize and nearForceTableSize in update_forces.glsl. */
+#define FORCE_TABLE_SIZE 1024
+#define NEAR_FORCE_TABLE_SIZE 128
+#define FORCE_TABLE_STRIDE (FORCE_TABLE_SIZE + NEAR_FORCE_TABLE_SIZE)
+
+/* The UNIFORMS block that all of the shaders share, in std140 layout. */
+typedef struct Uniforms {
+	int numTilesX;
+	int numTilesY;
+	float invTileSize;
+	float deltaTime;
+	float width;
+	float height;
+	float centerX;
+	float centerY;
+	float friction;
+	float particleRadius;
+	int wrap;
+	int typeSorted;
+	int compact;
+	int activeTiles;
+	int packTiles;
+	int countLanes;
+	int stencilRadius;
+	int tabulated;
+	float forceTableScale;
+	int stageInteractions;
+} Uniforms;
+
+Particles allocParticles(int numParticles) {
+
+	/* All of the arrays are carved out of a single allocation. Each array starts
+	   on a new cache line so that vector loads never straddle two lines. */
+	const size_t alignment = 64;
+	size_t laneSize = ((size_t)numParticles * sizeof(float) + alignment - 1) & ~(alignment - 1);
+
+	Particles p;
+	p.memory = malloc(5 * laneSize + alignment);
+	char *lanes = (char *)(((uintptr_t)p.memory + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	p.posX = (float *)(lanes + 0 * laneSize);
+	p.posY = (float *)(lanes + 1 * laneSize);
+	p.velX = (float *)(lanes + 2 * laneSize);
+	p.velY = (float *)(lanes + 3 * laneSize);
+	p.type = (int   *)(lanes + 4 * laneSize);
+	return p;
+}
+
+void freeParticles(Particles *particles) {
+	free(particles->memory);
+	memset(particles, 0, sizeof(*particles));
+}
+
+void copyParticles(Particles *dst, const Particles *src, int numParticles) {
+	memcpy(dst->posX, src->posX, numParticles * sizeof(float));
+	memcpy(dst->posY, src->posY, numParticles * sizeof(float));
+	memcpy(dst->velX, src->velX, numParticles * sizeof(float));
+	memcpy(dst->velY, src->velY, numParticles * sizeof(float));
+	memcpy(dst->type, src->type, numParticles * sizeof(int));
+}
+
+void setNumThreads(Universe *u, int numThreads) {
+	struct UniverseInternal *ui = &u->internal;
+	destroyThreadPool(ui->threadPool);
+	ui->threadPool = createThreadPool(numThreads);
+
+	/* The bands of the threads changed, so the particles have to be placed again. */
+	if (ui->placement != PLACEMENT_DEFAULT)
+		setPlacement(u, ui->placement);
+}
+
+void setPlacement(Universe *u, Placement placement) {
+	struct UniverseInternal *ui = &u->internal;
+	ui->placement = placement;
+	pinThreads(ui->threadPool, placement != PLACEMENT_DEFAULT);
+	if (placement != PLACEMENT_DEFAULT) {
+		placeParticles(u, &u->particles);
+		placeParticles(u, &ui->oldParticles);
+	}
+}
+
 ParticleInteraction *getInteraction(Universe *u, int type1, int type2) {
 	return &u->interactions[type1 * u->numParticleTypes + type2];
 }
 
-Universe createUniverse(int numParticleTypes, int numParticles, float width, float height) {
+/* Point the per-instance attributes of a VAO at a buffer of hot particles. This has to be done again
+   when updateBuffers replaces the buffer with a bigger one. */
+static void setParticleAttributes(GLuint vertexArray, GpuBuffer particleBuffer) {
+	glBindVertexArray(vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, particleBuffer);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(HotParticle), (void *)offsetof(HotParticle, pos));
+	glVertexAttribDivisor(1, 1);
+	glVertexAttribIPointer(2, 1, GL_INT, sizeof(HotParticle), (void *)offsetof(HotParticle, type));
+	glVertexAttribDivisor(2, 1);
+}
+
+Universe createUniverse(int numParticleTypes, int numParticles, float width, float height, Backend backend) {
 
 	Universe u;
 
 	u.rng = seedRNG((uint64_t)time(NULL));
 	u.numParticles = numParticles;
 	u.numParticleTypes = numParticleTypes;
-	u.particles = (Particle *)malloc(u.numParticles * sizeof(Particle));
+	u.particles = allocParticles(u.numParticles);
 	u.particleTypes = (ParticleType *)malloc(u.numParticleTypes * sizeof(ParticleType));
 	u.interactions = (ParticleInteraction *)malloc(u.numParticleTypes * u.numParticleTypes * sizeof(ParticleInteraction));
 
 	u.width = width;
 	u.height = height;
 	u.wrap = GL_TRUE;
+	u.workStealing = 1;
+	u.halfStencil = 0;
+	u.deterministic = 0;
+	u.typeSorted = 0;
+	u.compact = 0;
+	u.activeTiles = 1;
+	u.packTiles = 1;
+	u.countLanes = 0;
+	u.tileDivisions = 1;
+	u.tabulated = 0;
+	u.stageInteractions = 1;
+	for (int i = 0; i < NUM_TUNED_PASSES; ++i)
+		u.workGroupSizes[i] = 256;
+	u.timeStages = 0;
+	u.uniformRing = 1;
 	u.particleRadius = 5;
 	u.meshDetail = 8;
 
 	struct UniverseInternal *ui = &u.internal;
+	ui->backend = backend;
+	ui->threadPool = createThreadPool(getNumProcessors());
+	ui->placement = PLACEMENT_DEFAULT;
+	ui->tileLists = NULL;
+	ui->numTilesX = 0;
+	ui->numTilesY = 0;
+	ui->invTileSize = 0;
+	ui->stencilRadius = 1;
+	ui->forceTableScale = 0;
+	ui->forceTableStale = 1;
+	ui->dirty = DIRTY_ALL;
+	ui->gpuNumParticles = -1;
+	ui->gpuNumParticleTypes = -1;
+	ui->uploadedBytes = 0;
+	ui->oldParticles = allocParticles(u.numParticles);
+	ui->particleTiles = (int *)malloc(u.numParticles * sizeof(int));
+	ui->histograms = NULL;
+	ui->histogramsSize = 0;
+	ui->tasks = NULL;
+	ui->tasksCapacity = 0;
+
+	/* The compute shaders aren't needed when simulating on the CPU,
+	   so don't waste time compiling them. We still need to draw though. */
+	ui->particleShader = loadShader("shaders/vert.glsl", "shaders/frag.glsl");
+	if (backend == BACKEND_GPU) {
+		const char *reduceConstants[] = { "TILES_PER_BLOCK" };
+		const int reduceValues[] = { TILES_PER_BLOCK };
+		ui->reduceTiles     = loadComputeShaderWithConstants("shaders/reduce_tiles.glsl", 1, reduceConstants, reduceValues);
+		glGenQueries(1, &ui->passQuery);
+		glGenQueries(STAGE_QUERY_FRAMES * NUM_STAGES, &ui->stageQueries[0][0]);
+	} else {
+		ui->reduceTiles     = 0;
+		ui->passQuery       = 0;
+		memset(ui->stageQueries, 0, sizeof(ui->stageQueries));
+	}
+	ui->timedPass = -1;
+	memset(ui->stageQueryIssued, 0, sizeof(ui->stageQueryIssued));
+	ui->stageFrame = 0;
+	memset(ui->numStageTimes, 0, sizeof(ui->numStageTimes));
+	ui->stageLog = NULL;
 
-	/* Load the shaders. */
-	ui->particleShader  = loadShader("shaders/vert.glsl", "shaders/frag.glsl");
-	ui->setupTiles      = loadComputeShader("shaders/setup_tiles.glsl");
-	ui->sortParticles   = loadComputeShader("shaders/sort_particles.glsl");
-	ui->updateForces    = loadComputeShader("shaders/update_forces.glsl");
-	ui->updatePositions = loadComputeShader("shaders/update_positions.glsl");
+	/* These are only compiled when they are first used, with the settings of the universe at that time. */
+	const char *localSizeConstants[] = { "LOCAL_SIZE" };
+	const char *setupConstants[] = { "LOCAL_SIZE", "FORCES_LOCAL_SIZE", "TILES_PER_BLOCK" };
+	const char *forcesConstants[] = { "WRAP", "NUM_PARTICLE_TYPES", "LOCAL_SIZE" };
+	const char *positionsConstants[] = { "WRAP", "LOCAL_SIZE" };
+	ui->scanTiles       = createShaderVariants("shaders/scan_tiles.glsl", 1, localSizeConstants);
+	ui->setupTiles      = createShaderVariants("shaders/setup_tiles.glsl", 3, setupConstants);
+	ui->sortParticles   = createShaderVariants("shaders/sort_particles.glsl", 1, localSizeConstants);
+	ui->orderParticles  = createShaderVariants("shaders/order_particles.glsl", 1, localSizeConstants);
+	ui->updateForces    = createShaderVariants("shaders/update_forces.glsl", 3, forcesConstants);
+	ui->updatePositions = createShaderVariants("shaders/update_positions.glsl", 2, positionsConstants);
 
 	/* Generate and bind all of the GPU buffers. */
 	glGenBuffers(1, &ui->gpuUniforms);
 	glGenBuffers(1, &ui->gpuTileLists);
+	glGenBuffers(1, &ui->gpuTileBlocks);
+	glGenBuffers(1, &ui->gpuActiveTiles);
+	glGenBuffers(1, &ui->gpuTileWork);
+	glGenBuffers(1, &ui->gpuLaneCounters);
 	glGenBuffers(1, &ui->gpuNewParticles);
 	glGenBuffers(1, &ui->gpuOldParticles);
+	glGenBuffers(1, &ui->gpuNewColdParticles);
+	glGenBuffers(1, &ui->gpuOldColdParticles);
+	glGenBuffers(1, &ui->gpuCompactParticles);
 	glGenBuffers(1, &ui->gpuParticleTypes);
 	glGenBuffers(1, &ui->gpuInteractions);	
+	glGenBuffers(1, &ui->gpuForceTable);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, ui->gpuTileLists);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ui->gpuNewParticles);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ui->gpuOldParticles);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ui->gpuParticleTypes);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, ui->gpuInteractions);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, ui->gpuCompactParticles);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, ui->gpuTileBlocks);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, ui->gpuActiveTiles);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, ui->gpuTileWork);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, ui->gpuLaneCounters);
 	glBindBufferBase(GL_UNIFORM_BUFFER, 10, ui->gpuUniforms);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, ui->gpuForceTable);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, ui->gpuNewColdParticles);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, ui->gpuOldColdParticles);
+
+	/* With OpenGL 4.4 the uniforms go into a ring of blocks that stays mapped the whole time,
+	   see updateUniforms. The blocks have to start at the uniform buffer offset alignment. */
+	ui->gpuUniformRing = 0;
+	ui->uniformRingData = NULL;
+	ui->uniformRingStride = 0;
+	ui->uniformRingSlot = 0;
+	memset(ui->uniformFences, 0, sizeof(ui->uniformFences));
+	ui->numTimesteps = 0;
+	memset(ui->snapshots, 0, sizeof(ui->snapshots));
+	ui->nextSnapshot = 0;
+	ui->snapshotInterval = 0;
+	ui->snapshotCallback = NULL;
+	ui->snapshotUserData = NULL;
+	ui->droppedSnapshots = 0;
+	if (GLAD_GL_VERSION_4_4) {
+		GLint alignment;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		ui->uniformRingStride = (int)((sizeof(Uniforms) + alignment - 1) / alignment * alignment);
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &ui->gpuUniformRing);
+		glBindBuffer(GL_UNIFORM_BUFFER, ui->gpuUniformRing);
+		glBufferStorage(GL_UNIFORM_BUFFER, UNIFORM_RING_SIZE * ui->uniformRingStride, NULL, flags);
+		ui->uniformRingData = (char *)glMapBufferRange(GL_UNIFORM_BUFFER, 0, UNIFORM_RING_SIZE * ui->uniformRingStride, flags);
+	}
+
+	/* The lane counters keep counting until printParams reads them. */
+	GLuint laneCounters[6] = { 0, 0, 0, 0, 0, 0 };
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuLaneCounters);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(laneCounters), laneCounters, GL_DYNAMIC_COPY);
 
 	/* Initialize circle mesh for the particles. */
 	const float twoPi = 2 * PI;
@@ -75,122 +285,399 @@ Universe createUniverse(int numParticleTypes, int numParticles, float width, flo
 	glEnableVertexAttribArray(2);
 	glBindBuffer(GL_ARRAY_BUFFER, ui->particleVertexBuffer);
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
-	glBindBuffer(GL_ARRAY_BUFFER, ui->gpuNewParticles);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Particle), (void *)offsetof(Particle, pos));
-	glVertexAttribDivisor(1, 1);
-	glVertexAttribIPointer(2, 1, GL_INT, sizeof(Particle), (void *)offsetof(Particle, type));
-	glVertexAttribDivisor(2, 1);
+	setParticleAttributes(ui->particleVertexArray1, ui->gpuNewParticles);
 	glBindVertexArray(ui->particleVertexArray2);
 	glEnableVertexAttribArray(0);
 	glEnableVertexAttribArray(1);
 	glEnableVertexAttribArray(2);
 	glBindBuffer(GL_ARRAY_BUFFER, ui->particleVertexBuffer);
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), 0);
-	glBindBuffer(GL_ARRAY_BUFFER, ui->gpuOldParticles);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Particle), (void *)offsetof(Particle, pos));
-	glVertexAttribDivisor(1, 1);
-	glVertexAttribIPointer(2, 1, GL_INT, sizeof(Particle), (void *)offsetof(Particle, type));
-	glVertexAttribDivisor(2, 1);
+	setParticleAttributes(ui->particleVertexArray2, ui->gpuOldParticles);
 	glBindVertexArray(0);
 
 	return u;
 }
 
 void destroyUniverse(Universe *u) {
-	free(u->particles);
+	freeParticles(&u->particles);
 	free(u->particleTypes);
 	free(u->interactions);
 
 	struct UniverseInternal *ui = &u->internal;
+	destroyThreadPool(ui->threadPool);
+	free(ui->tileLists);
+	freeParticles(&ui->oldParticles);
+	free(ui->particleTiles);
+	free(ui->histograms);
+	free(ui->tasks);
 
 	glDeleteProgram(ui->particleShader);
-	glDeleteProgram(ui->setupTiles);
-	glDeleteProgram(ui->sortParticles);
-	glDeleteProgram(ui->updateForces);
-	glDeleteProgram(ui->updatePositions);
+	glDeleteProgram(ui->reduceTiles);
+	destroyShaderVariants(&ui->scanTiles);
+	destroyShaderVariants(&ui->setupTiles);
+	destroyShaderVariants(&ui->sortParticles);
+	destroyShaderVariants(&ui->orderParticles);
+	destroyShaderVariants(&ui->updateForces);
+	destroyShaderVariants(&ui->updatePositions);
 
 	glDeleteVertexArrays(1, &ui->particleVertexArray1);
 	glDeleteVertexArrays(1, &ui->particleVertexArray2);
 	glDeleteBuffers(1, &ui->particleVertexBuffer);
 	glDeleteBuffers(1, &ui->gpuTileLists);
+	glDeleteBuffers(1, &ui->gpuTileBlocks);
+	glDeleteBuffers(1, &ui->gpuActiveTiles);
+	glDeleteBuffers(1, &ui->gpuTileWork);
+	glDeleteBuffers(1, &ui->gpuLaneCounters);
 	glDeleteBuffers(1, &ui->gpuNewParticles);
 	glDeleteBuffers(1, &ui->gpuOldParticles);
+	glDeleteBuffers(1, &ui->gpuNewColdParticles);
+	glDeleteBuffers(1, &ui->gpuOldColdParticles);
+	glDeleteBuffers(1, &ui->gpuCompactParticles);
 	glDeleteBuffers(1, &ui->gpuParticleTypes);
 	glDeleteBuffers(1, &ui->gpuInteractions);
+	glDeleteBuffers(1, &ui->gpuForceTable);
 	glDeleteBuffers(1, &ui->gpuUniforms);
+	glDeleteBuffers(1, &ui->gpuUniformRing);
+	for (int i = 0; i < UNIFORM_RING_SIZE; ++i)
+		glDeleteSync(ui->uniformFences[i]);
+	for (int i = 0; i < SNAPSHOT_RING_SIZE; ++i) {
+		glDeleteSync(ui->snapshots[i].fence);
+		glDeleteBuffers(1, &ui->snapshots[i].buffer);
+	}
+	glDeleteQueries(1, &ui->passQuery);
+	glDeleteQueries(STAGE_QUERY_FRAMES * NUM_STAGES, &ui->stageQueries[0][0]);
+	if (ui->stageLog)
+		fclose(ui->stageLog);
 
 	glCheckErrors();
 	memset(u, 0, sizeof(*u));
 }
 
-void updateBuffers(Universe *u) {
+/* Bind the first size bytes of a buffer to a storage buffer binding point, so that .length() in the
+   shaders is the part of the buffer that is in use and not all of the room it has to grow. */
+static void bindStorageBuffer(int binding, GpuBuffer buffer, GLsizeiptr size) {
+	if (size > 0)
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, buffer, 0, size);
+	else
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+}
+
+/* Make sure a buffer has room for size bytes, leave it bound to GL_COPY_WRITE_BUFFER, and bind those bytes
+   to the given storage buffer binding point, unless that is negative. A buffer that is too small gets half
+   again as much room as it needs, so that it isn't reallocated every time the number of particles or tiles
+   changes a little. With OpenGL 4.4 the buffers are immutable storage, which can't be resized, so then the
+   buffer is replaced with a new one, and this returns 1 so that the caller can point its VAO at that. */
+static int reserveBuffer(GpuBuffer *buffer, int binding, GLsizeiptr size) {
+	GLint64 capacity = 0;
+	glBindBuffer(GL_COPY_WRITE_BUFFER, *buffer);
+	glGetBufferParameteri64v(GL_COPY_WRITE_BUFFER, GL_BUFFER_SIZE, &capacity);
+
+	int replaced = 0;
+	if (size > capacity || capacity == 0) {
+		capacity = size + size / 2 > 256 ? size + size / 2 : 256;
+		if (GLAD_GL_VERSION_4_4) {
+			glDeleteBuffers(1, buffer);
+			glGenBuffers(1, buffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, *buffer);
+			glBufferStorage(GL_COPY_WRITE_BUFFER, capacity, NULL, GL_DYNAMIC_STORAGE_BIT | GL_MAP_WRITE_BIT);
+			replaced = 1;
+		} else {
+			glBufferData(GL_COPY_WRITE_BUFFER, capacity, NULL, GL_DYNAMIC_COPY);
+		}
+	}
+
+	if (binding >= 0)
+		bindStorageBuffer(binding, *buffer, size);
+	return replaced;
+}
+
+/* Convert the particles to the GPU layout and write them to the start of the given hot and cold buffers,
+   which need to have room for them. The cold buffer can be 0 if only the hot particles are needed, like
+   for drawing. This and downloadParticles are the only places where the particles are converted between
+   the two layouts. */
+static void uploadParticles(Universe *u, GpuBuffer hotBuffer, GpuBuffer coldBuffer) {
+	const Particles *p = &u->particles;
+	if (u->numParticles == 0)
+		return;
+
+	/* Invalidating the whole buffer lets the driver hand out fresh memory if the GPU is still reading the old particles. */
+	glBindBuffer(GL_COPY_WRITE_BUFFER, hotBuffer);
+	HotParticle *hot = (HotParticle *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, u->numParticles * sizeof(HotParticle),
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	for (int i = 0; i < u->numParticles; ++i) {
+		hot[i].pos.x = p->posX[i];
+		hot[i].pos.y = p->posY[i];
+		hot[i].type = p->type[i];
+	}
+	glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+
+	if (coldBuffer == 0)
+		return;
 
+	glBindBuffer(GL_COPY_WRITE_BUFFER, coldBuffer);
+	ColdParticle *cold = (ColdParticle *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, u->numParticles * sizeof(ColdParticle),
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	for (int i = 0; i < u->numParticles; ++i) {
+		cold[i].vel.x = p->velX[i];
+		cold[i].vel.y = p->velY[i];
+		cold[i].key = 0;
+	}
+	glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+}
+
+/* Read the particles of the latest timestep back from the GPU into the host-side particles. */
+static void downloadParticles(Universe *u) {
 	struct UniverseInternal *ui = &u->internal;
+	Particles *p = &u->particles;
 
-	/* Recalculate the tile sizes. */
+	HotParticle *hot = (HotParticle *)malloc(u->numParticles * sizeof(HotParticle));
+	ColdParticle *cold = (ColdParticle *)malloc(u->numParticles * sizeof(ColdParticle));
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_COPY_READ_BUFFER, ui->gpuNewParticles);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, 0, u->numParticles * sizeof(HotParticle), hot);
+	glBindBuffer(GL_COPY_READ_BUFFER, ui->gpuNewColdParticles);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, 0, u->numParticles * sizeof(ColdParticle), cold);
+	for (int i = 0; i < u->numParticles; ++i) {
+		p->posX[i] = hot[i].pos.x;
+		p->posY[i] = hot[i].pos.y;
+		p->velX[i] = cold[i].vel.x;
+		p->velY[i] = cold[i].vel.y;
+		p->type[i] = hot[i].type;
+	}
+	free(hot);
+	free(cold);
+}
+
+/* Copy the start of one buffer into another, which needs to have room for it. */
+static void copyBuffer(GpuBuffer dst, GpuBuffer src, GLsizeiptr size) {
+	glBindBuffer(GL_COPY_READ_BUFFER, src);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, dst);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+}
+
+/* Write data to the start of a buffer, reserving room for it first, and count it towards uploadedBytes. */
+static void uploadBuffer(struct UniverseInternal *ui, GpuBuffer *buffer, int binding, GLsizeiptr size, const void *data) {
+	reserveBuffer(buffer, binding, size);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, 0, size, data);
+	ui->uploadedBytes += size;
+}
 
-	float tileSize = 0;
+static float getMaxRadius(Universe *u) {
+	float maxRadius = 0;
 	for (int i = 0; i < u->numParticleTypes; ++i)
 		for (int j = 0; j < u->numParticleTypes; ++j)
-			tileSize = fmaxf(tileSize, getInteraction(u, i, j)->maxRadius);
+			maxRadius = fmaxf(maxRadius, getInteraction(u, i, j)->maxRadius);
+	return maxRadius;
+}
+
+/* The force of the analytic force law at the given distance, times the distance. */
+static double sampleForceTimesDistance(const ParticleInteraction *interaction, double r) {
+	double minr = interaction->minRadius;
+	double maxr = interaction->maxRadius;
+	double force = 0;
+	if (r <= maxr) {
+		if (r > minr)
+			force = interaction->attraction * fmin(fabs(r - minr), fabs(r - maxr));
+		else
+			force = -(minr - r) / (0.5 + minr * r);
+	}
+	return force * r;
+}
+
+/* Sample the force law of every pair of particle types into the force table, evenly spaced over the squared
+   distance up to the largest interaction radius. Each entry holds the force times the distance, and the
+   difference to the next entry for the linear interpolation. The force pass divides it by the squared
+   distance and multiplies it with the difference of the positions. Unlike the force divided by the distance,
+   which goes up without bounds like 1/r^2 near 0, this is smooth enough for linear interpolation, except
+   before the second sample, where the repulsion rises from 0 within a small fraction of the distance. The
+   finer samples at the end of each row cover that stretch, spaced evenly over the square root of the distance
+   so that they are densest where the repulsion bends, and the last of them leads up to the second sample. This takes a while and the table is big, so it's only done before a
+   tabulated timestep after the interactions have changed. */
+static void updateForceTable(Universe *u) {
+
+	struct UniverseInternal *ui = &u->internal;
+	const int numPairs = u->numParticleTypes * u->numParticleTypes;
+	const float maxRadius = getMaxRadius(u);
+	const double step = (double)maxRadius * maxRadius / (FORCE_TABLE_SIZE - 1);
+	const double nearRadius = sqrt(step);
+	ui->forceTableScale = maxRadius > 0 ? (float)(1 / step) : 0;
+
+	vec2 *table = (vec2 *)malloc((size_t)numPairs * FORCE_TABLE_STRIDE * sizeof(vec2));
+	for (int pair = 0; pair < numPairs; ++pair) {
+		const ParticleInteraction *interaction = &u->interactions[pair];
+		vec2 *row = &table[pair * FORCE_TABLE_STRIDE];
+		vec2 *nearRow = &row[FORCE_TABLE_SIZE];
+
+		for (int i = 0; i < FORCE_TABLE_SIZE; ++i)
+			row[i].x = i < FORCE_TABLE_SIZE - 1 ? (float)sampleForceTimesDistance(interaction, sqrt(i * step)) : 0;
+		for (int i = 0; i < FORCE_TABLE_SIZE; ++i)
+			row[i].y = i + 1 < FORCE_TABLE_SIZE ? row[i + 1].x - row[i].x : 0;
+
+		for (int i = 0; i < NEAR_FORCE_TABLE_SIZE; ++i) {
+			double t = (double)i / NEAR_FORCE_TABLE_SIZE;
+			nearRow[i].x = (float)sampleForceTimesDistance(interaction, nearRadius * t * t);
+		}
+		for (int i = 0; i < NEAR_FORCE_TABLE_SIZE; ++i)
+			nearRow[i].y = (i + 1 < NEAR_FORCE_TABLE_SIZE ? nearRow[i + 1].x : row[1].x) - nearRow[i].x;
+	}
 
-	ui->invTileSize = 1 / tileSize;
-	ui->numTilesX = (int)ceilf(u->width / tileSize);
-	ui->numTilesY = (int)ceilf(u->height / tileSize);
-	int numTiles = ui->numTilesX * ui->numTilesY;
+	uploadBuffer(ui, &ui->gpuForceTable, 11, (GLsizeiptr)numPairs * FORCE_TABLE_STRIDE * sizeof(vec2), table);
+	ui->forceTableStale = 0;
+	free(table);
+}
+
+void markDirty(Universe *u, int flags) {
+	u->internal.dirty |= flags;
+}
+
+void updateBuffers(Universe *u) {
+	markDirty(u, DIRTY_ALL);
+	updateDirtyBuffers(u);
+}
+
+void updateDirtyBuffers(Universe *u) {
+
+	struct UniverseInternal *ui = &u->internal;
 
-	struct TileList {
-		int offset;
-		int capacity;
-		int size;
-	} *tileLists = (struct TileList *)calloc(numTiles, sizeof(*tileLists));
-	
-	/* On the initial run of the shaders the capacity of the tile lists needs to be calculated.
-	   This is why we have to do it here. After the first timestep we no longer have to do this
-	   here and the shaders will take care of it. */
+	/* A different number of particles or types doesn't fit the buffers on the GPU any more. */
+	if (u->numParticles != ui->gpuNumParticles)
+		ui->dirty |= DIRTY_PARTICLES;
+	if (u->numParticleTypes != ui->gpuNumParticleTypes)
+		ui->dirty |= DIRTY_TYPES | DIRTY_INTERACTIONS;
 
-	for (int pID = 0; pID < u->numParticles; ++pID) {
-		Particle p = u->particles[pID];
-		int gridID = (int)(p.pos.y * ui->invTileSize) * ui->numTilesX + (int)(p.pos.x * ui->invTileSize);
-		if (gridID < 0) gridID = 0;
-		if (gridID >= numTiles) gridID = numTiles - 1;
-		tileLists[gridID].capacity++;
+	/* Recalculate the tile sizes. On the GPU the tiles can be a fraction of the largest interaction
+	   radius, and the force pass then reaches out over as many tiles as that radius spans. The CPU
+	   backend always uses tiles of the full radius. */
+
+	float maxRadius = getMaxRadius(u);
+	int stencilRadius = 1;
+	if (ui->backend == BACKEND_GPU)
+		stencilRadius = u->tileDivisions < 1 ? 1 : u->tileDivisions > 4 ? 4 : u->tileDivisions;
+
+	/* The block of tiles that the force pass reaches over wraps around the edges of the world. If it
+	   were wider than the world, it would visit some tiles twice and count their pairs twice, so use
+	   fewer divisions when the world is only a couple of tiles across. */
+	float tileSize;
+	int numTilesX, numTilesY;
+	for (;;) {
+		tileSize = maxRadius / stencilRadius;
+		numTilesX = (int)ceilf(u->width / tileSize);
+		numTilesY = (int)ceilf(u->height / tileSize);
+		if (stencilRadius == 1 || (2 * stencilRadius + 1 <= numTilesX && 2 * stencilRadius + 1 <= numTilesY))
+			break;
+		--stencilRadius;
 	}
+	float invTileSize = 1 / tileSize;
+	int numTiles = numTilesX * numTilesY;
+
+	/* The particles on the GPU are counted into the tiles they are in, so when the tiles change they have to
+	   be sorted into the new ones. If the particles weren't changed on the host, the host-side copy of them is
+	   out of date on the GPU backend, so get them from the GPU first. */
+	int tilesChanged = numTilesX != ui->numTilesX || numTilesY != ui->numTilesY
+		|| invTileSize != ui->invTileSize || stencilRadius != ui->stencilRadius;
+	if (tilesChanged && !(ui->dirty & DIRTY_PARTICLES)) {
+		if (ui->backend == BACKEND_GPU)
+			downloadParticles(u);
+		ui->dirty |= DIRTY_PARTICLES;
+	}
+
+	ui->stencilRadius = stencilRadius;
+	ui->invTileSize = invTileSize;
+	ui->numTilesX = numTilesX;
+	ui->numTilesY = numTilesY;
 
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuTileLists);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, numTiles * sizeof(*tileLists), tileLists, GL_STREAM_COPY);
-	free(tileLists);
+	/* Sort the particles into their tiles on the host, exactly like the first two passes of a timestep
+	   would. That way the tile lists are complete and the first timestep starts from binned particles.
+	   The sorted particles end up in the back-buffer, so swap it to the front afterwards. */
+
+	if (ui->dirty & DIRTY_PARTICLES) {
+		ui->tileLists = (TileList *)realloc(ui->tileLists, numTiles * sizeof(TileList));
+		binParticles(u, &u->particles, &ui->oldParticles);
+		Particles temp = u->particles;
+		u->particles = ui->oldParticles;
+		ui->oldParticles = temp;
+	}
+
+	if (ui->backend == BACKEND_CPU) {
+		/* The CPU backend keeps the tile lists and the particles on the host. The GPU
+		   only needs the particle types for drawing, the particles are uploaded in draw(). */
+		if (ui->dirty & DIRTY_TYPES)
+			uploadBuffer(ui, &ui->gpuParticleTypes, 3, u->numParticleTypes * sizeof(ParticleType), u->particleTypes);
+		ui->gpuNumParticleTypes = u->numParticleTypes;
+		ui->gpuNumParticles = u->numParticles;
+		ui->dirty = 0;
+		return;
+	}
 
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuNewParticles);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, u->numParticles * sizeof(Particle), u->particles, GL_STREAM_COPY);
+	if (ui->dirty & DIRTY_PARTICLES) {
+		uploadBuffer(ui, &ui->gpuTileLists, 0, numTiles * sizeof(TileList), ui->tileLists);
 
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuOldParticles);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, u->numParticles * sizeof(Particle), u->particles, GL_STREAM_COPY);
+		/* One sum (and later offset) for each block of tiles in the tile offset scan. */
+		ui->numTileBlocks = (numTiles + TILES_PER_BLOCK - 1) / TILES_PER_BLOCK;
+		reserveBuffer(&ui->gpuTileBlocks, 6, ui->numTileBlocks * sizeof(int));
 
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuParticleTypes);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, u->numParticleTypes * sizeof(ParticleType), u->particleTypes, GL_STATIC_DRAW);
-	
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ui->gpuInteractions);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, u->numParticleTypes * u->numParticleTypes * sizeof(ParticleInteraction), u->interactions, GL_STATIC_DRAW);
+		/* The 3 workgroup counts of the indirect dispatch and the number of active tiles come first,
+		   followed by room for every tile. scan_tiles and setup_tiles fill this in every timestep. */
+		reserveBuffer(&ui->gpuActiveTiles, 7, (4 + numTiles) * sizeof(int));
+
+		/* The bins of the force pass follow a header with their dispatch size, their sizes and where they start.
+		   Every active tile can end up in any of the first 3 bins. The last bin holds the tiles with more than
+		   half a force workgroup of particles, split into chunks of 4 particles per thread, and each of its items
+		   takes up 2 ints. Each of these items stands for at least half a workgroup of particles, so there can't be
+		   more of them than numParticles / (size / 2). Without packTiles every active tile is in the last bin, with
+		   one more item for every chunk. The force pass can be tuned to any of the candidates without marking the
+		   particles dirty, so this makes room for the smallest one. */
+		int forcesSize = workGroupSizeCandidates[0];
+		int binCapacity = numTiles < u->numParticles ? numTiles : u->numParticles;
+		int heavyCapacity = u->numParticles / (forcesSize / 2) + 1;
+		if (heavyCapacity < binCapacity + u->numParticles / (4 * forcesSize) + 1)
+			heavyCapacity = binCapacity + u->numParticles / (4 * forcesSize) + 1;
+		GLuint workHeader[12] = { 0, 1, 1, 0, 0, 0, 0, 0 };
+		for (int bin = 0; bin < 4; ++bin)
+			workHeader[8 + bin] = bin * binCapacity;
+		reserveBuffer(&ui->gpuTileWork, 8, sizeof(workHeader) + (3 * binCapacity + 2 * heavyCapacity) * sizeof(int));
+		glBufferSubData(GL_COPY_WRITE_BUFFER, 0, sizeof(workHeader), workHeader);
+		ui->uploadedBytes += sizeof(workHeader);
+
+		/* Both particle buffers start out with the same particles, so convert them only once and copy. */
+		GLsizeiptr hotSize = u->numParticles * sizeof(HotParticle);
+		GLsizeiptr coldSize = u->numParticles * sizeof(ColdParticle);
+		int replaced = reserveBuffer(&ui->gpuNewParticles, 1, hotSize);
+		replaced |= reserveBuffer(&ui->gpuOldParticles, 2, hotSize);
+		reserveBuffer(&ui->gpuNewColdParticles, 12, coldSize);
+		reserveBuffer(&ui->gpuOldColdParticles, 13, coldSize);
+		uploadParticles(u, ui->gpuNewParticles, ui->gpuNewColdParticles);
+		copyBuffer(ui->gpuOldParticles, ui->gpuNewParticles, hotSize);
+		copyBuffer(ui->gpuOldColdParticles, ui->gpuNewColdParticles, coldSize);
+		ui->uploadedBytes += hotSize + coldSize;
+		if (replaced) {
+			setParticleAttributes(ui->particleVertexArray1, ui->gpuNewParticles);
+			setParticleAttributes(ui->particleVertexArray2, ui->gpuOldParticles);
+			glBindVertexArray(0);
+		}
+
+		/* The compact particles are encoded by sort_particles every timestep, so they don't need any data. */
+		reserveBuffer(&ui->gpuCompactParticles, 5, u->numParticles * sizeof(CompactParticle));
+		ui->gpuNumParticles = u->numParticles;
+	}
+
+	if (ui->dirty & DIRTY_TYPES)
+		uploadBuffer(ui, &ui->gpuParticleTypes, 3, u->numParticleTypes * sizeof(ParticleType), u->particleTypes);
+
+	if (ui->dirty & DIRTY_INTERACTIONS) {
+		uploadBuffer(ui, &ui->gpuInteractions, 4, u->numParticleTypes * u->numParticleTypes * sizeof(ParticleInteraction), u->interactions);
+		ui->forceTableStale = 1;
+	}
+
+	ui->gpuNumParticleTypes = u->numParticleTypes;
+	ui->dirty = 0;
 }
 
-void simulateTimestep(Universe *u) {
+void updateUniforms(Universe *u) {
 
 	struct UniverseInternal *ui = &u->internal;
 
-	struct {
-		int numTilesX;
-		int numTilesY;
-		float invTileSize;
-		float deltaTime;
-		float width;
-		float height;
-		float centerX;
-		float centerY;
-		float friction;
-		float particleRadius;
-		int wrap;
-	} uniforms;
+	Uniforms uniforms;
 
 	uniforms.numTilesX = ui->numTilesX;
 	uniforms.numTilesY = ui->numTilesY;
@@ -203,8 +690,262 @@ void simulateTimestep(Universe *u) {
 	uniforms.friction = u->friction;
 	uniforms.particleRadius = u->particleRadius;
 	uniforms.wrap = u->wrap;
-	glBindBuffer(GL_UNIFORM_BUFFER, ui->gpuUniforms);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(uniforms), &uniforms, GL_STREAM_DRAW);
+	uniforms.typeSorted = u->typeSorted;
+	/* CompactParticle only has 8 bits for the type, so with more types compact mode would mix them up. */
+	uniforms.compact = u->compact && u->numParticleTypes <= 256;
+	/* Only order_particles reads the list of active tiles, so setup_tiles doesn't build it when that doesn't run. */
+	uniforms.activeTiles = u->activeTiles && (u->deterministic || u->typeSorted);
+	uniforms.packTiles = u->packTiles;
+	uniforms.countLanes = u->countLanes;
+	uniforms.stencilRadius = ui->stencilRadius;
+	uniforms.tabulated = u->tabulated;
+	uniforms.forceTableScale = ui->forceTableScale;
+	uniforms.stageInteractions = u->stageInteractions;
+
+	if (!u->uniformRing || !ui->uniformRingData) {
+		glBindBufferBase(GL_UNIFORM_BUFFER, 10, ui->gpuUniforms);
+		glBindBuffer(GL_UNIFORM_BUFFER, ui->gpuUniforms);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(uniforms), &uniforms, GL_STREAM_DRAW);
+		return;
+	}
+
+	/* Put a fence after the commands that used the current block, and move on to the next block. The GPU
+	   last used that one UNIFORM_RING_SIZE - 1 timesteps ago, so it's almost always done with it already,
+	   and then the wait returns right away. The storage is coherent, so the copy doesn't need a flush. */
+	int slot = ui->uniformRingSlot;
+	glDeleteSync(ui->uniformFences[slot]);
+	ui->uniformFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	slot = (slot + 1) % UNIFORM_RING_SIZE;
+	if (ui->uniformFences[slot]) {
+		while (glClientWaitSync(ui->uniformFences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+		glDeleteSync(ui->uniformFences[slot]);
+		ui->uniformFences[slot] = NULL;
+	}
+
+	memcpy(ui->uniformRingData + slot * ui->uniformRingStride, &uniforms, sizeof(uniforms));
+	glBindBufferRange(GL_UNIFORM_BUFFER, 10, ui->gpuUniformRing, slot * ui->uniformRingStride, sizeof(uniforms));
+	ui->uniformRingSlot = slot;
+}
+
+/* Swap the front and back particle buffers, and the VAOs that draw them. */
+static void swapParticleBuffers(struct UniverseInternal *ui) {
+	GpuBuffer temp = ui->gpuNewParticles;
+	ui->gpuNewParticles = ui->gpuOldParticles;
+	ui->gpuOldParticles = temp;
+	bindStorageBuffer(1, ui->gpuNewParticles, ui->gpuNumParticles * sizeof(HotParticle));
+	bindStorageBuffer(2, ui->gpuOldParticles, ui->gpuNumParticles * sizeof(HotParticle));
+
+	temp = ui->gpuNewColdParticles;
+	ui->gpuNewColdParticles = ui->gpuOldColdParticles;
+	ui->gpuOldColdParticles = temp;
+	bindStorageBuffer(12, ui->gpuNewColdParticles, ui->gpuNumParticles * sizeof(ColdParticle));
+	bindStorageBuffer(13, ui->gpuOldColdParticles, ui->gpuNumParticles * sizeof(ColdParticle));
+
+	GLuint tempa = ui->particleVertexArray1;
+	ui->particleVertexArray1 = ui->particleVertexArray2;
+	ui->particleVertexArray2 = tempa;
+}
+
+/* Get the variant of a tuned pass for the current workgroup sizes and settings, or 0 if it failed to compile.
+   setup_tiles is compiled for the size of the force pass too, and the force and position passes for wrap
+   and the number of particle types, so that they don't have to check these for every particle. */
+static GLuint getTunedProgram(Universe *u, TunedPass pass) {
+	struct UniverseInternal *ui = &u->internal;
+	int *sizes = u->workGroupSizes;
+	switch (pass) {
+	case TUNED_SCAN_TILES:
+		return getShaderVariant(&ui->scanTiles, &sizes[TUNED_SCAN_TILES]);
+	case TUNED_SETUP_TILES: {
+		int constants[] = { sizes[TUNED_SETUP_TILES], sizes[TUNED_UPDATE_FORCES], TILES_PER_BLOCK };
+		return getShaderVariant(&ui->setupTiles, constants);
+	}
+	case TUNED_SORT_PARTICLES:
+		return getShaderVariant(&ui->sortParticles, &sizes[TUNED_SORT_PARTICLES]);
+	case TUNED_ORDER_PARTICLES:
+		return getShaderVariant(&ui->orderParticles, &sizes[TUNED_ORDER_PARTICLES]);
+	case TUNED_UPDATE_FORCES: {
+		int constants[] = { u->wrap != 0, u->numParticleTypes, sizes[TUNED_UPDATE_FORCES] };
+		return getShaderVariant(&ui->updateForces, constants);
+	}
+	case TUNED_UPDATE_POSITIONS: {
+		int constants[] = { u->wrap != 0, sizes[TUNED_UPDATE_POSITIONS] };
+		return getShaderVariant(&ui->updatePositions, constants);
+	}
+	default:
+		return 0;
+	}
+}
+
+/* Start and stop the timer query around one of the passes while autotuneWorkGroupSizes is measuring it. */
+static void beginTunedPass(struct UniverseInternal *ui, TunedPass pass) {
+	if (ui->timedPass == (int)pass)
+		glBeginQuery(GL_TIME_ELAPSED, ui->passQuery);
+}
+
+static void endTunedPass(struct UniverseInternal *ui, TunedPass pass) {
+	if (ui->timedPass == (int)pass)
+		glEndQuery(GL_TIME_ELAPSED);
+}
+
+static const char *stageNames[NUM_STAGES] = { "setup_tiles", "sort_particles", "update_forces", "update_positions", "draw" };
+
+/* Start and stop the timer query of a stage in this timestep's slot of the ring. Only one GL_TIME_ELAPSED
+   query can be active at a time, so the stages aren't timed while autotuneWorkGroupSizes times a pass. */
+static void beginStage(Universe *u, Stage stage) {
+	struct UniverseInternal *ui = &u->internal;
+	if (u->timeStages && ui->backend == BACKEND_GPU && ui->timedPass < 0)
+		glBeginQuery(GL_TIME_ELAPSED, ui->stageQueries[ui->stageFrame % STAGE_QUERY_FRAMES][stage]);
+}
+
+static void endStage(Universe *u, Stage stage) {
+	struct UniverseInternal *ui = &u->internal;
+	if (u->timeStages && ui->backend == BACKEND_GPU && ui->timedPass < 0) {
+		glEndQuery(GL_TIME_ELAPSED);
+		ui->stageQueryIssued[ui->stageFrame % STAGE_QUERY_FRAMES][stage] = 1;
+	}
+}
+
+/* Move on to the next slot of the query rings, and collect the times of the queries that were issued in it
+   STAGE_QUERY_FRAMES timesteps ago. By now the GPU is almost always done with them, so reading them doesn't
+   stall. If one isn't done yet its time is dropped instead of waiting for it. */
+static void collectStageTimes(Universe *u) {
+	struct UniverseInternal *ui = &u->internal;
+	ui->stageFrame += 1;
+	int slot = ui->stageFrame % STAGE_QUERY_FRAMES;
+
+	double times[NUM_STAGES];
+	int numTimes = 0;
+	for (int s = 0; s < NUM_STAGES; ++s) {
+		times[s] = -1;
+		if (!ui->stageQueryIssued[slot][s])
+			continue;
+		ui->stageQueryIssued[slot][s] = 0;
+
+		GLuint available = 0;
+		glGetQueryObjectuiv(ui->stageQueries[slot][s], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			continue;
+
+		GLuint64 nanoseconds;
+		glGetQueryObjectui64v(ui->stageQueries[slot][s], GL_QUERY_RESULT, &nanoseconds);
+		times[s] = nanoseconds / 1e6;
+		ui->stageTimes[s][ui->numStageTimes[s] % STAGE_WINDOW] = (float)times[s];
+		ui->numStageTimes[s] += 1;
+		numTimes += 1;
+	}
+
+	if (ui->stageLog && numTimes > 0) {
+		fprintf(ui->stageLog, "%d", ui->stageFrame - STAGE_QUERY_FRAMES);
+		for (int s = 0; s < NUM_STAGES; ++s) {
+			if (times[s] >= 0)
+				fprintf(ui->stageLog, ",%.4f", times[s]);
+			else
+				fprintf(ui->stageLog, ",");
+		}
+		fprintf(ui->stageLog, "\n");
+	}
+}
+
+/* Copy the particles of the latest timestep into the next staging buffer of the snapshot ring, and put a fence
+   after the copy. The staging buffers are in client storage, because they are only ever read by the CPU. */
+static void takeSnapshot(Universe *u) {
+	struct UniverseInternal *ui = &u->internal;
+	SnapshotSlot *slot = &ui->snapshots[ui->nextSnapshot];
+	if (slot->fence) {
+		ui->droppedSnapshots += 1;
+		return;
+	}
+	if (ui->gpuNumParticles <= 0)
+		return;
+
+	GLsizeiptr hotSize = ui->gpuNumParticles * sizeof(HotParticle);
+	GLsizeiptr coldSize = ui->gpuNumParticles * sizeof(ColdParticle);
+	if (hotSize + coldSize > slot->capacity) {
+		glDeleteBuffers(1, &slot->buffer);
+		glGenBuffers(1, &slot->buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, slot->buffer);
+		slot->capacity = hotSize + coldSize;
+		if (GLAD_GL_VERSION_4_4) {
+			GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_COPY_WRITE_BUFFER, slot->capacity, NULL, flags | GL_CLIENT_STORAGE_BIT);
+			slot->data = (const char *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, slot->capacity, flags);
+		} else {
+			glBufferData(GL_COPY_WRITE_BUFFER, slot->capacity, NULL, GL_STREAM_READ);
+			slot->data = NULL;
+		}
+	}
+
+	/* update_positions wrote the particles from a shader, so the copy has to wait for it. */
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, slot->buffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, ui->gpuNewParticles);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, hotSize);
+	glBindBuffer(GL_COPY_READ_BUFFER, ui->gpuNewColdParticles);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, hotSize, coldSize);
+	slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot->timestep = ui->numTimesteps;
+	slot->numParticles = ui->gpuNumParticles;
+	ui->nextSnapshot = (ui->nextSnapshot + 1) % SNAPSHOT_RING_SIZE;
+}
+
+void setupTiles(Universe *u) {
+
+	/* The tile offsets are an exclusive scan over the tile capacities. This is done in 3 passes so
+	   that it scales to any number of tiles: reduce_tiles sums up the capacities of each block of
+	   tiles, scan_tiles turns those sums into block offsets in a single workgroup, and setup_tiles
+	   scans each block on its own and adds the block offset. */
+
+	struct UniverseInternal *ui = &u->internal;
+
+	glUseProgram(ui->reduceTiles);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	glDispatchCompute(ui->numTileBlocks, 1, 1);
+
+	glUseProgram(getTunedProgram(u, TUNED_SCAN_TILES));
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	beginTunedPass(ui, TUNED_SCAN_TILES);
+	glDispatchCompute(1, 1, 1);
+	endTunedPass(ui, TUNED_SCAN_TILES);
+
+	/* setup_tiles also sorts the tiles into the bins of the force pass, whose widths depend on its size. */
+	glUseProgram(getTunedProgram(u, TUNED_SETUP_TILES));
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	beginTunedPass(ui, TUNED_SETUP_TILES);
+	glDispatchCompute(ui->numTileBlocks, 1, 1);
+	endTunedPass(ui, TUNED_SETUP_TILES);
+}
+
+/* Run the current compute shader once for each tile, or only for the active tiles. setup_tiles
+   has written the number of workgroups that the active tiles need into gpuActiveTiles. */
+static void dispatchTiles(Universe *u) {
+	struct UniverseInternal *ui = &u->internal;
+	if (u->activeTiles) {
+		glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, ui->gpuActiveTiles);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+		glDispatchComputeIndirect(0);
+	} else {
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		glDispatchCompute(ui->numTilesX, ui->numTilesY, 1);
+	}
+}
+
+void simulateTimestep(Universe *u) {
+
+	struct UniverseInternal *ui = &u->internal;
+
+	if (ui->backend == BACKEND_CPU) {
+		cpuSimulateTimestep(u);
+		return;
+	}
+
+	/* The force table is only sampled again when it's going to be used, see updateDirtyBuffers. */
+	if (u->tabulated && ui->forceTableStale)
+		updateForceTable(u);
+
+	updateUniforms(u);
+	if (u->timeStages)
+		collectStageTimes(u);
 
 	/* The particle data is actually double buffered on the GPU between timesteps.
 	   During the shader pipeline the particles from the back buffer are copied over
@@ -222,37 +963,65 @@ void simulateTimestep(Universe *u) {
 	   introduce a memory indirection and lower performance by a pretty significant factor
 	   (I tried it). */
 
-	GpuBuffer temp = ui->gpuNewParticles;
-	ui->gpuNewParticles = ui->gpuOldParticles;
-	ui->gpuOldParticles = temp;
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, ui->gpuNewParticles);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ui->gpuOldParticles);
+	swapParticleBuffers(ui);
 
-	glUseProgram(ui->setupTiles);
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glDispatchCompute(1, 1, 1);
+	beginStage(u, STAGE_SETUP_TILES);
+	setupTiles(u);
+	endStage(u, STAGE_SETUP_TILES);
 
-	glUseProgram(ui->sortParticles);
+	beginStage(u, STAGE_SORT_PARTICLES);
+	int sortSize = u->workGroupSizes[TUNED_SORT_PARTICLES];
+	glUseProgram(getTunedProgram(u, TUNED_SORT_PARTICLES));
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glDispatchCompute((int)ceil(u->numParticles / (1.0 * 256.0)), 1, 1);
+	beginTunedPass(ui, TUNED_SORT_PARTICLES);
+	glDispatchCompute((int)ceil(u->numParticles / (1.0 * sortSize)), 1, 1);
+	endTunedPass(ui, TUNED_SORT_PARTICLES);
 
-	glUseProgram(ui->updateForces);
-	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glDispatchCompute(ui->numTilesX, ui->numTilesY, 1);
+	/* In deterministic mode the particles are put back in a stable order within their tiles,
+	   and with typeSorted they are also sorted by type within their tiles. This moves them
+	   over to the back buffer, so it becomes the front buffer again. */
+	if (u->deterministic || u->typeSorted) {
+		glUseProgram(getTunedProgram(u, TUNED_ORDER_PARTICLES));
+		beginTunedPass(ui, TUNED_ORDER_PARTICLES);
+		dispatchTiles(u);
+		endTunedPass(ui, TUNED_ORDER_PARTICLES);
+		swapParticleBuffers(ui);
+	}
+	endStage(u, STAGE_SORT_PARTICLES);
+
+	/* The force and position passes are compiled for the current wrap and number of particle types,
+	   so that they don't have to check these for every particle. Changing them switches to another
+	   variant, which is compiled the first time it's used.
+	   The force pass has its own dispatch size, which setup_tiles calculated from the bins of tiles. */
+	int positionsSize = u->workGroupSizes[TUNED_UPDATE_POSITIONS];
+	glUseProgram(getTunedProgram(u, TUNED_UPDATE_FORCES));
+	beginStage(u, STAGE_UPDATE_FORCES);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, ui->gpuTileWork);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+	beginTunedPass(ui, TUNED_UPDATE_FORCES);
+	glDispatchComputeIndirect(0);
+	endTunedPass(ui, TUNED_UPDATE_FORCES);
+	endStage(u, STAGE_UPDATE_FORCES);
 
-	glUseProgram(ui->updatePositions);
+	glUseProgram(getTunedProgram(u, TUNED_UPDATE_POSITIONS));
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-	glDispatchCompute((int)ceil(u->numParticles / (1.0 * 256.0)), 1, 1);
+	beginStage(u, STAGE_UPDATE_POSITIONS);
+	beginTunedPass(ui, TUNED_UPDATE_POSITIONS);
+	glDispatchCompute((int)ceil(u->numParticles / (1.0 * positionsSize)), 1, 1);
+	endTunedPass(ui, TUNED_UPDATE_POSITIONS);
+	endStage(u, STAGE_UPDATE_POSITIONS);
 
-	GLuint tempa = ui->particleVertexArray1;
-	ui->particleVertexArray1 = ui->particleVertexArray2;
-	ui->particleVertexArray2 = tempa;
+	/* Hand over the snapshots that have arrived first, so that the staging buffer for the next one is free. */
+	ui->numTimesteps += 1;
+	collectSnapshots(u, 0);
+	if (ui->snapshotInterval > 0 && ui->numTimesteps % ui->snapshotInterval == 0)
+		takeSnapshot(u);
 }
 
 void draw(Universe *u) {
 	struct UniverseInternal *ui = &u->internal;
 
-	/* The code commented out below needs to be uncommented if
+	/* The line commented out below needs to be uncommented if
 	   you are drawing the universe without simulating a timestep first.
 	   So if you are doing something like:
 	   
@@ -264,50 +1033,35 @@ void draw(Universe *u) {
 	   
 	   Then this should stay commented out. */
 
-	/*
-	struct {
-		int numTilesX;
-		int numTilesY;
-		float invTileSize;
-		float deltaTime;
-		float width;
-		float height;
-		float centerX;
-		float centerY;
-		float friction;
-		float particleRadius;
-		int wrap;
-	} uniforms;
-	
-	uniforms.numTilesX = ui->numTilesX;
-	uniforms.numTilesY = ui->numTilesY;
-	uniforms.invTileSize = ui->invTileSize;
-	uniforms.deltaTime = u->deltaTime;
-	uniforms.width = u->width;
-	uniforms.height = u->height;
-	uniforms.centerX = u->width / 2;
-	uniforms.centerY = u->height / 2;
-	uniforms.friction = u->friction;
-	uniforms.particleRadius = u->particleRadius;
-	uniforms.wrap = u->wrap;
-	glBindBuffer(GL_UNIFORM_BUFFER, ui->gpuUniforms);
-	glBufferData(GL_UNIFORM_BUFFER, sizeof(uniforms), &uniforms, GL_STREAM_DRAW);
-	*/
+	/* updateUniforms(u); */
+
+	/* The CPU backend never swaps the GPU buffers, so particleVertexArray2 always
+	   reads from gpuOldParticles. Upload the latest particles there. The uniforms
+	   also have to be sent here because no compute shaders ran this timestep. */
+	if (ui->backend == BACKEND_CPU) {
+		updateUniforms(u);
+
+		if (reserveBuffer(&ui->gpuOldParticles, -1, u->numParticles * sizeof(HotParticle))) {
+			setParticleAttributes(ui->particleVertexArray2, ui->gpuOldParticles);
+			glBindVertexArray(0);
+		}
+		uploadParticles(u, ui->gpuOldParticles, 0);
+	}
 
 	glUseProgram(ui->particleShader);
 	glBindVertexArray(ui->particleVertexArray2);
 	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	beginStage(u, STAGE_DRAW);
 	glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, u->meshDetail + 2, (int)u->numParticles);
+	endStage(u, STAGE_DRAW);
 	glBindVertexArray(0);
 }
 
-void randomize(Universe *u, float attractionMean, float attractionStddev, float minRadius0, float minRadius1, float maxRadius0, float maxRadius1) {
+/* Draw a new interaction matrix. The particles and their types are left alone. */
+static void randomizeInteractionMatrix(Universe *u, float attractionMean, float attractionStddev, float minRadius0, float minRadius1, float maxRadius0, float maxRadius1) {
 
 	const float diamater = 2 * u->particleRadius;
 
-	for (int i = 0; i < u->numParticleTypes; ++i)
-		u->particleTypes[i].color = HSV((float)i / u->numParticleTypes, 1, (float)(i & 1) * 0.5f + 0.5f);
-
 	for (int i = 0; i < u->numParticleTypes; ++i) {
 		for (int j = 0; j < u->numParticleTypes; ++j) {		
 			ParticleInteraction *interaction = getInteraction(u, i, j);
@@ -329,19 +1083,249 @@ void randomize(Universe *u, float attractionMean, float attractionStddev, float
 			interaction->attraction = 2 * interaction->attraction / (interaction->maxRadius - interaction->minRadius);
 		}
 	}
+}
 
+void randomize(Universe *u, float attractionMean, float attractionStddev, float minRadius0, float minRadius1, float maxRadius0, float maxRadius1) {
+
+	for (int i = 0; i < u->numParticleTypes; ++i)
+		u->particleTypes[i].color = HSV((float)i / u->numParticleTypes, 1, (float)(i & 1) * 0.5f + 0.5f);
+
+	randomizeInteractionMatrix(u, attractionMean, attractionStddev, minRadius0, minRadius1, maxRadius0, maxRadius1);
+
+	Particles *p = &u->particles;
 	for (int i = 0; i < u->numParticles; ++i) {
-		Particle *p = &u->particles[i];
-		p->type = randi(&u->rng, 0, u->numParticleTypes);
-		p->pos.x = randUniform(&u->rng, 0, u->width);
-		p->pos.y = randUniform(&u->rng, 0, u->height);
-		p->vel.x = randGaussian(&u->rng, 0, 1);
-		p->vel.y = randGaussian(&u->rng, 0, 1);
+		p->type[i] = randi(&u->rng, 0, u->numParticleTypes);
+		p->posX[i] = randUniform(&u->rng, 0, u->width);
+		p->posY[i] = randUniform(&u->rng, 0, u->height);
+		p->velX[i] = randGaussian(&u->rng, 0, 1);
+		p->velY[i] = randGaussian(&u->rng, 0, 1);
 	}
 
 	updateBuffers(u);
 }
 
+void randomizeInteractions(Universe *u, float attractionMean, float attractionStddev, float minRadius0, float minRadius1, float maxRadius0, float maxRadius1) {
+	randomizeInteractionMatrix(u, attractionMean, attractionStddev, minRadius0, minRadius1, maxRadius0, maxRadius1);
+	markDirty(u, DIRTY_INTERACTIONS);
+	updateDirtyBuffers(u);
+}
+
+/* Check that a workgroup size from the file is one of the sizes the tuner could have picked. */
+static int isValidWorkGroupSize(int size) {
+	for (int c = 0; c < NUM_WORK_GROUP_SIZE_CANDIDATES; ++c) {
+		if (size == workGroupSizeCandidates[c])
+			return 1;
+	}
+	return 0;
+}
+
+/* The file has one line per device, with the renderer, the version and the workgroup size of each
+   TunedPass separated by tabs. If a device has several lines, the last one is used. */
+int loadWorkGroupSizes(Universe *u, const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		return 0;
+
+	const char *renderer = (const char *)glGetString(GL_RENDERER);
+	const char *version = (const char *)glGetString(GL_VERSION);
+	int found = 0;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		char *versionStart = strchr(line, '\t');
+		char *sizesStart = versionStart ? strchr(versionStart + 1, '\t') : NULL;
+		if (!sizesStart)
+			continue;
+		*versionStart++ = 0;
+		*sizesStart++ = 0;
+		if (strcmp(line, renderer) != 0 || strcmp(versionStart, version) != 0)
+			continue;
+
+		/* Lines that were written for a different set of TunedPass values have another number of sizes. */
+		int sizes[NUM_TUNED_PASSES];
+		int valid = 1;
+		char *next = sizesStart;
+		for (int i = 0; i < NUM_TUNED_PASSES && valid; ++i) {
+			char *end;
+			sizes[i] = (int)strtol(next, &end, 10);
+			valid = end != next && isValidWorkGroupSize(sizes[i]);
+			next = end;
+		}
+		if (!valid || next[strspn(next, " \r\n")] != 0)
+			continue;
+
+		memcpy(u->workGroupSizes, sizes, sizeof(sizes));
+		found = 1;
+	}
+
+	fclose(f);
+	return found;
+}
+
+void autotuneWorkGroupSizes(Universe *u, const char *filename) {
+	struct UniverseInternal *ui = &u->internal;
+	if (ui->backend != BACKEND_GPU)
+		return;
+
+	/* Each size is first run for a couple of timesteps to compile it and let the particles move into the
+	   new order, and then the fastest of a couple of timed runs is taken, because that one had the least
+	   interference from everything else on the GPU. The current size is measured first and only replaced
+	   by one that is strictly faster, so it's kept if the timer queries can't tell the sizes apart.
+	   order_particles only runs in deterministic mode, so that is turned on while it's measured. The size of
+	   the force pass also sets the widths of the bins that setup_tiles sorts the tiles into, so setup_tiles
+	   is tuned first with the current force size, and each force size runs with its own setup_tiles variant. */
+
+	const int warmupTimesteps = 2;
+	const int timedTimesteps = 5;
+
+	GLint maxSize, maxInvocations;
+	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxSize);
+	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+
+	int deterministic = u->deterministic;
+	for (int pass = 0; pass < NUM_TUNED_PASSES; ++pass) {
+		if (pass == TUNED_ORDER_PARTICLES)
+			u->deterministic = 1;
+
+		int currentSize = u->workGroupSizes[pass];
+		int bestSize = currentSize;
+		GLuint64 bestTime = (GLuint64)-1;
+		for (int c = -1; c < NUM_WORK_GROUP_SIZE_CANDIDATES; ++c) {
+			int size = c < 0 ? currentSize : workGroupSizeCandidates[c];
+			if ((c >= 0 && size == currentSize) || size > maxSize || size > maxInvocations)
+				continue;
+
+			/* Skip the sizes that the passes which depend on it can't be compiled for, for example because
+			   they need more shared memory than the device has. The force pass also changes setup_tiles. */
+			u->workGroupSizes[pass] = size;
+			if (!getTunedProgram(u, pass) || (pass == TUNED_UPDATE_FORCES && !getTunedProgram(u, TUNED_SETUP_TILES)))
+				continue;
+			for (int i = 0; i < warmupTimesteps; ++i)
+				simulateTimestep(u);
+
+			ui->timedPass = pass;
+			for (int i = 0; i < timedTimesteps; ++i) {
+				simulateTimestep(u);
+				GLuint64 time;
+				glGetQueryObjectui64v(ui->passQuery, GL_QUERY_RESULT, &time);
+				if (time < bestTime) {
+					bestTime = time;
+					bestSize = size;
+				}
+			}
+			ui->timedPass = -1;
+		}
+
+		u->workGroupSizes[pass] = bestSize;
+		u->deterministic = deterministic;
+	}
+
+	/* Put the particles back to where they were before tuning. */
+	updateBuffers(u);
+
+	if (filename) {
+		FILE *f = fopen(filename, "a");
+		if (f) {
+			fprintf(f, "%s\t%s\t", (const char *)glGetString(GL_RENDERER), (const char *)glGetString(GL_VERSION));
+			for (int i = 0; i < NUM_TUNED_PASSES; ++i)
+				fprintf(f, i + 1 < NUM_TUNED_PASSES ? "%d " : "%d\n", u->workGroupSizes[i]);
+			fclose(f);
+		} else {
+			fprintf(stderr, "ERROR: failed to write the workgroup sizes to %s\n", filename);
+		}
+	}
+}
+
+static int compareFloats(const void *a, const void *b) {
+	float x = *(const float *)a, y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+StageStats getStageStats(Universe *u, Stage stage) {
+	struct UniverseInternal *ui = &u->internal;
+	StageStats stats = { 0, 0, 0, 0 };
+	stats.count = ui->numStageTimes[stage] < STAGE_WINDOW ? ui->numStageTimes[stage] : STAGE_WINDOW;
+	if (stats.count == 0)
+		return stats;
+
+	float sorted[STAGE_WINDOW];
+	memcpy(sorted, ui->stageTimes[stage], stats.count * sizeof(float));
+	qsort(sorted, stats.count, sizeof(float), compareFloats);
+	double sum = 0;
+	for (int i = 0; i < stats.count; ++i)
+		sum += sorted[i];
+	stats.min = sorted[0];
+	stats.mean = sum / stats.count;
+	stats.p99 = sorted[(int)ceil(0.99 * stats.count) - 1];
+	return stats;
+}
+
+int setStageLog(Universe *u, const char *filename) {
+	struct UniverseInternal *ui = &u->internal;
+	if (ui->stageLog)
+		fclose(ui->stageLog);
+	ui->stageLog = NULL;
+	if (!filename)
+		return 1;
+
+	ui->stageLog = fopen(filename, "w");
+	if (!ui->stageLog)
+		return 0;
+	fprintf(ui->stageLog, "timestep");
+	for (int s = 0; s < NUM_STAGES; ++s)
+		fprintf(ui->stageLog, ",%s_ms", stageNames[s]);
+	fprintf(ui->stageLog, "\n");
+	return 1;
+}
+
+void setSnapshotCallback(Universe *u, int interval, SnapshotCallback callback, void *userData) {
+	struct UniverseInternal *ui = &u->internal;
+	ui->snapshotInterval = ui->backend == BACKEND_GPU && callback ? interval : 0;
+	ui->snapshotCallback = callback;
+	ui->snapshotUserData = userData;
+}
+
+void collectSnapshots(Universe *u, int wait) {
+	struct UniverseInternal *ui = &u->internal;
+
+	/* The snapshots in flight are the ones right before nextSnapshot in the ring, so starting from there goes
+	   from the oldest to the newest. The GPU finishes them in that order, so stop at the first one that isn't
+	   done, that way they are always handed over in the order they were taken. */
+	for (int i = 0; i < SNAPSHOT_RING_SIZE; ++i) {
+		SnapshotSlot *slot = &ui->snapshots[(ui->nextSnapshot + i) % SNAPSHOT_RING_SIZE];
+		if (!slot->fence)
+			continue;
+
+		GLenum status = glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000 : 0);
+		while (wait && status == GL_TIMEOUT_EXPIRED)
+			status = glClientWaitSync(slot->fence, 0, 1000000000);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			break;
+		glDeleteSync(slot->fence);
+		slot->fence = NULL;
+
+		/* Without OpenGL 4.4 the staging buffer is mapped only for the callback. The copy is done
+		   by now, so that doesn't wait either. */
+		const char *data = slot->data;
+		if (!data) {
+			glBindBuffer(GL_COPY_READ_BUFFER, slot->buffer);
+			data = (const char *)glMapBufferRange(GL_COPY_READ_BUFFER, 0, slot->capacity, GL_MAP_READ_BIT);
+		}
+
+		Snapshot snapshot;
+		snapshot.timestep = slot->timestep;
+		snapshot.numParticles = slot->numParticles;
+		snapshot.hot = (const HotParticle *)data;
+		snapshot.cold = (const ColdParticle *)(data + slot->numParticles * sizeof(HotParticle));
+		if (ui->snapshotCallback)
+			ui->snapshotCallback(&snapshot, ui->snapshotUserData);
+
+		if (!slot->data) {
+			glBindBuffer(GL_COPY_READ_BUFFER, slot->buffer);
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+		}
+	}
+}
+
 void printParams(Universe *u) {
 	printf("Attract:\n");
 	for (int i = 0; i < u->numParticleTypes; ++i) {
@@ -369,4 +1353,41 @@ void printParams(Universe *u) {
 		}
 		printf("\n");
 	}
-}
+
+	if (u->internal.backend == BACKEND_CPU) {
+		ThreadPool *pool = u->internal.threadPool;
+		const ThreadStats *stats = getThreadStats(pool);
+		printf("Threads (force pass, %s):\n", u->workStealing ? "work stealing" : "static");
+		printf("thread busy[s] idle[s] tasks steals\n");
+		for (int i = 0; i < getNumThreads(pool); ++i)
+			printf("%d %.3f %.3f %d %d\n", i, stats[i].busyTime, stats[i].idleTime, stats[i].numTasks, stats[i].numSteals);
+		resetThreadStats(pool);
+	}
+
+	if (u->internal.backend == BACKEND_GPU && u->countLanes) {
+		/* The counters are 64-bit numbers stored as 2 32-bit words, low word first. */
+		GLuint counters[6];
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, u->internal.gpuLaneCounters);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+		double pairs = counters[0] + 4294967296.0 * counters[1];
+		double slots = counters[2] + 4294967296.0 * counters[3];
+		double inRange = counters[4] + 4294967296.0 * counters[5];
+		int stencilWidth = 2 * u->internal.stencilRadius + 1;
+		printf("Lanes (force pass, %s, %dx%d tiles):\n", u->packTiles ? "packed" : "one tile per workgroup",
+			stencilWidth, stencilWidth);
+		printf("pairs lane-slots utilisation in-range\n");
+		printf("%.0f %.0f %.1f%% %.1f%%\n", pairs, slots, slots > 0 ? 100 * pairs / slots : 0, pairs > 0 ? 100 * inRange / pairs : 0);
+		memset(counters, 0, sizeof(counters));
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+	}
+
+	if (u->internal.backend == BACKEND_GPU && u->timeStages) {
+		printf("Stages (GPU time of the latest timesteps):\n");
+		printf("stage timesteps min[ms] mean[ms] p99[ms]\n");
+		for (int s = 0; s < NUM_STAGES; ++s) {
+			StageStats stats = getStageStats(u, (Stage)s);
+			if (stats.count > 0)
+				printf("%s %d %.3f %.3f %.3f\n", stageNames[s], stats.count, stats.min, stats.mean, stats.p99);
+		}
+	}
+}
\ No newline at end of file
@@ -4,19 +4,45 @@
 #include "math.h"
 #include "glad.h"
 #include "shader.h"
+#include "threads.h"
 
+/* All of the fields of a single particle. On the GPU the particles are split into the HotParticle
+   and ColdParticle streams below, and on the host they are stored as a structure of arrays instead,
+   see Particles. This is used to look at the particles from both in the same way. */
 typedef struct Particle {
 	vec2 pos;  /* position */
 	vec2 vel;  /* velocity */
 	int  type; /* index into the particle type array */
-	
-	/* This struct needs to be aligned on a vec2 sized boundary on the GPU
-	   because of std430 buffer layout rules. So we need to add some padding.
-	   See: https://www.khronos.org/registry/OpenGL/specs/gl/glspec43.core.pdf#page=146 */
-	
-	int  padding[1];
+	int  padding[1]; /* the sort key of the particle's ColdParticle */
 } Particle;
 
+/* The part of a particle on the GPU that the force pass reads for every neighbor. The GLSL version of
+   this struct uses 2 floats instead of a vec2 for the position, because std430 would align a vec2 to
+   8 bytes and pad the struct out to 16. */
+typedef struct HotParticle {
+	vec2 pos;  /* position */
+	int  type; /* index into the particle type array */
+} HotParticle;
+
+/* The rest of a particle on the GPU, which the force pass only reads and writes for the particles of the tile. */
+typedef struct ColdParticle {
+	vec2 vel; /* velocity */
+	int  key; /* sort_particles.glsl stores a sort key here for order_particles.glsl */
+} ColdParticle;
+
+/* The particles on the host are stored as separate arrays for each field, so that
+   loops over the particles stream through contiguous lanes and can be vectorized.
+   Every array is aligned to a cache line. The particles are only converted to the
+   GPU layout above when they are uploaded to the GPU. */
+typedef struct Particles {
+	float *posX; /* position */
+	float *posY;
+	float *velX; /* velocity */
+	float *velY;
+	int   *type; /* index into the particle type array */
+	void  *memory; /* the single allocation backing all of the arrays */
+} Particles;
+
 typedef struct ParticleType {
 	vec3 color;
 
@@ -41,11 +67,109 @@ typedef struct ParticleInteraction {
 
 } ParticleInteraction;
 
+/* The compact encoding of a particle that the GPU force pass reads for the neighboring particles
+   in compact mode. The force pass doesn't need the velocity of the neighbors, so only the position
+   relative to the origin of the particle's tile and the type are stored. */
+typedef struct CompactParticle {
+	unsigned int pos;  /* x and y as 16-bit unsigned normalized fractions of the tile size */
+	unsigned int type; /* only the low 8 bits are used */
+} CompactParticle;
+
+typedef struct TileList {
+	int offset;   /* index of the first particle of this tile in the tile-sorted particle array */
+	int capacity; /* number of particles that will be sorted into this tile in the next timestep */
+	int size;     /* number of particles that have been sorted into this tile so far */
+} TileList;
+
+typedef enum Backend {
+	BACKEND_GPU, /* simulate using the compute shaders */
+	BACKEND_CPU  /* simulate on a pool of CPU threads, the GPU is only used for drawing */
+} Backend;
+
+typedef enum Placement {
+	PLACEMENT_DEFAULT,     /* leave the threads unpinned, and the particles wherever they were first written to */
+	PLACEMENT_INTERLEAVED, /* pin the threads, and spread the pages of the particles evenly over all threads */
+	PLACEMENT_STRIPED      /* pin the threads, and put each thread's band of tile rows on the NUMA node it runs on */
+} Placement;
+
+/* The GPU passes whose workgroup size can be tuned, in the order they run. The force pass packs 8 slices of
+   1/8 of its workgroup into a workgroup for the lightest tiles, and the tile setup bins the tiles by the
+   widths of those slices, so it is compiled for the size of the force pass as well as its own. reduce_tiles
+   isn't tuned, it only sums up the blocks of TILES_PER_BLOCK tiles that setup_tiles then processes. */
+typedef enum TunedPass {
+	TUNED_SCAN_TILES,
+	TUNED_SETUP_TILES,
+	TUNED_SORT_PARTICLES,
+	TUNED_ORDER_PARTICLES,
+	TUNED_UPDATE_FORCES,
+	TUNED_UPDATE_POSITIONS,
+	NUM_TUNED_PASSES
+} TunedPass;
+
+/* The parts of a GPU timestep, and drawing, whose GPU time is measured with timeStages. */
+typedef enum Stage {
+	STAGE_SETUP_TILES,
+	STAGE_SORT_PARTICLES, /* sort_particles, and order_particles if it runs */
+	STAGE_UPDATE_FORCES,
+	STAGE_UPDATE_POSITIONS,
+	STAGE_DRAW,
+	NUM_STAGES
+} Stage;
+
+/* How many timesteps the timer queries of a stage are read back after they were issued, plus 1. */
+#define STAGE_QUERY_FRAMES 4
+
+/* How many blocks of uniforms the ring of uniform blocks holds, so how many timesteps the GPU can be behind
+   before updateUniforms waits for it. */
+#define UNIFORM_RING_SIZE 3
+
+/* How many of the latest times of each stage getStageStats looks at. */
+#define STAGE_WINDOW 256
+
+/* The parts of a universe that updateBuffers sends to the GPU. Mark the ones that changed with markDirty. */
+typedef enum DirtyFlag {
+	DIRTY_PARTICLES    = 1, /* the positions, velocities or types of the particles */
+	DIRTY_TYPES        = 2, /* the colors of the particle types */
+	DIRTY_INTERACTIONS = 4, /* the interactions between the particle types */
+	DIRTY_ALL          = 7
+} DirtyFlag;
+
+/* How many snapshots of the particles can be on their way back from the GPU at once, see setSnapshotCallback. */
+#define SNAPSHOT_RING_SIZE 3
+
+/* The particles of one timestep, copied back from the GPU. They are in the order and the layout of the GPU
+   buffers, and only valid during the SnapshotCallback they are handed to. */
+typedef struct Snapshot {
+	int timestep;     /* how many timesteps the universe had simulated when the snapshot was taken */
+	int numParticles;
+	const HotParticle *hot;
+	const ColdParticle *cold; /* the key of each cold particle is left over from sorting and means nothing */
+} Snapshot;
+
+typedef void (*SnapshotCallback)(const Snapshot *snapshot, void *userData);
+
+/* One staging buffer of the snapshot ring. */
+typedef struct SnapshotSlot {
+	GpuBuffer buffer;     /* the hot particles followed by the cold ones */
+	const char *data;     /* the buffer, persistently mapped, or NULL without OpenGL 4.4 */
+	GLsizeiptr capacity;
+	GLsync fence;         /* signalled when the copy into the buffer is done, NULL while the slot is free */
+	int timestep;
+	int numParticles;
+} SnapshotSlot;
+
+typedef struct StageStats {
+	int count;   /* how many times the statistics are over, at most STAGE_WINDOW */
+	double min;  /* in milliseconds */
+	double mean;
+	double p99;
+} StageStats;
+
 typedef struct Universe {
 
 	int numParticles;
 	int numParticleTypes;
-	Particle *particles;
+	Particles particles;
 	ParticleType *particleTypes;
 	ParticleInteraction *interactions;
 	float width;          /* should be positive */
@@ -54,6 +178,20 @@ typedef struct Universe {
 	float deltaTime;      /* should be positive or 0 */
 	float particleRadius; /* should be positive or 0 */
 	int wrap;             /* should be either 0 or 1 */
+	int workStealing;     /* CPU backend only, balance the force pass with work stealing, should be either 0 or 1 */
+	int halfStencil;      /* CPU backend only, calculate each pair of particles once for both directions, should be either 0 or 1 (default 0) */
+	int deterministic;    /* make timesteps bit-reproducible on the GPU (the CPU backend always is), should be either 0 or 1 */
+	int typeSorted;       /* GPU backend only, keep the particles in each tile sorted by type, should be either 0 or 1 */
+	int compact;          /* GPU backend only, read the neighbors in the force pass from CompactParticles, ignored with more than 256 types, should be either 0 or 1 */
+	int activeTiles;      /* GPU backend only, only run the ordering pass of deterministic and typeSorted over the tiles that have particles in them (the force pass always does), should be either 0 or 1 */
+	int packTiles;        /* GPU backend only, pack light tiles into one workgroup of the force pass (heavy ones are always split over several), should be either 0 or 1 */
+	int countLanes;       /* GPU backend only, count how busy the lanes of the force pass are, and how many pairs are in range, for printParams, should be either 0 or 1 */
+	int tileDivisions;    /* GPU backend only, make the tiles this fraction of the largest interaction radius and widen the block of neighbor tiles to match, takes effect in updateBuffers, should be between 1 and 4, lowered while the block would be wider than the world */
+	int tabulated;        /* GPU backend only, look up the forces in a table of each pair of types, which simulateTimestep samples again after the interactions change, should be either 0 or 1 */
+	int stageInteractions; /* GPU backend only, load the interactions into shared memory once per workgroup of the force pass (up to 16 types), should be either 0 or 1 */
+	int workGroupSizes[NUM_TUNED_PASSES]; /* GPU backend only, the local size of each TunedPass, see autotuneWorkGroupSizes, should be powers of 2 between 64 and 1024 */
+	int timeStages;       /* GPU backend only, measure the GPU time of each Stage for printParams and getStageStats, should be either 0 or 1 (default 0) */
+	int uniformRing;      /* write the uniforms into a persistently mapped ring of blocks instead of reallocating their buffer every timestep (needs OpenGL 4.4), should be either 0 or 1 */
 	int meshDetail;       /* should be positive */
 	RNG rng;              /* you can set this with seedRNG() */
 
@@ -61,33 +199,107 @@ typedef struct Universe {
 	struct UniverseInternal {
 		int numTilesX;
 		int numTilesY;
+		int numTileBlocks; /* number of blocks of TILES_PER_BLOCK tiles that the tile offsets are scanned in */
 		float invTileSize; /* stores the inverse of the tile size so we don't have to divide */
+		int stencilRadius; /* how many tiles the largest interaction radius spans, the tileDivisions of the last updateBuffers, lowered to fit the world */
+		float forceTableScale; /* turns a squared distance into an index into a row of the force table */
+		int forceTableStale;   /* the interactions changed, so the force table is sampled again before the next tabulated timestep */
+		int dirty;             /* the DirtyFlags that haven't been sent to the GPU yet */
+		int gpuNumParticles;   /* how many particles and particle types the GPU buffers hold, -1 before the first updateBuffers */
+		int gpuNumParticleTypes;
+		size_t uploadedBytes;  /* how many bytes updateBuffers has sent to the GPU so far */
+		Backend backend;
+
+		/* Host-side copies of the GPU buffers below. Both backends use these to sort the
+		   particles into tiles in updateBuffers, the CPU backend also simulates with them. */
+		ThreadPool *threadPool;
+		Placement placement;
+		TileList *tileLists;     /* one list per tile */
+		Particles oldParticles;  /* back-buffer, the front-buffer is the particles array */
+		int *particleTiles;      /* the tile of each particle in the back-buffer, used while sorting */
+		int *histograms;         /* per-thread tile histograms, used while sorting */
+		int histogramsSize;
+		Task *tasks;             /* the tasks of the CPU force pass */
+		int tasksCapacity;
 
 		Shader particleShader;
-		ComputeShader setupTiles;
-		ComputeShader sortParticles;
-		ComputeShader updateForces;
-		ComputeShader updatePositions;
+		ComputeShader reduceTiles;
+		ShaderVariants scanTiles;       /* specialised on LOCAL_SIZE */
+		ShaderVariants setupTiles;      /* specialised on LOCAL_SIZE, FORCES_LOCAL_SIZE and TILES_PER_BLOCK */
+		ShaderVariants sortParticles;   /* specialised on LOCAL_SIZE */
+		ShaderVariants orderParticles;  /* specialised on LOCAL_SIZE */
+		ShaderVariants updateForces;    /* specialised on WRAP, NUM_PARTICLE_TYPES and LOCAL_SIZE */
+		ShaderVariants updatePositions; /* specialised on WRAP and LOCAL_SIZE */
+		GLuint passQuery;               /* the timer query around the pass that autotuneWorkGroupSizes measures */
+		int timedPass;                  /* the TunedPass that passQuery times, or -1 */
+		GLuint stageQueries[STAGE_QUERY_FRAMES][NUM_STAGES]; /* a ring of timer queries for each stage, one per timestep */
+		int stageQueryIssued[STAGE_QUERY_FRAMES][NUM_STAGES];
+		int stageFrame;                 /* the number of timesteps since timeStages was turned on, this picks the queries in the ring */
+		float stageTimes[NUM_STAGES][STAGE_WINDOW]; /* the latest times of each stage in milliseconds, also a ring */
+		int numStageTimes[NUM_STAGES];  /* how many times have been added to each ring in total */
+		FILE *stageLog;                 /* see setStageLog */
 
 		GLuint particleVertexArray1;
 		GLuint particleVertexArray2;
 		GpuBuffer particleVertexBuffer;
 		GpuBuffer gpuTileLists;
-		GpuBuffer gpuNewParticles;
+		GpuBuffer gpuTileBlocks;
+		GpuBuffer gpuActiveTiles; /* the indirect dispatch size of the per-tile passes, followed by the list of active tiles */
+		GpuBuffer gpuTileWork;    /* the indirect dispatch size of the packed force pass, followed by the bins of tiles */
+		GpuBuffer gpuLaneCounters;
+		GpuBuffer gpuNewParticles;     /* the hot particles, these are also what gets drawn */
 		GpuBuffer gpuOldParticles;
+		GpuBuffer gpuNewColdParticles; /* the cold particles, double buffered and sorted together with the hot ones */
+		GpuBuffer gpuOldColdParticles;
+		GpuBuffer gpuCompactParticles;
 		GpuBuffer gpuParticleTypes;
 		GpuBuffer gpuInteractions;
+		GpuBuffer gpuForceTable; /* FORCE_TABLE_STRIDE samples of the force law for each pair of particle types */
 		GpuBuffer gpuUniforms;
+		GpuBuffer gpuUniformRing; /* UNIFORM_RING_SIZE blocks of uniforms in immutable storage, 0 without OpenGL 4.4 */
+		char *uniformRingData;    /* gpuUniformRing, persistently mapped */
+		int uniformRingStride;    /* the size of the uniforms rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT */
+		int uniformRingSlot;      /* the block that the latest uniforms were written to */
+		GLsync uniformFences[UNIFORM_RING_SIZE]; /* signalled when the GPU is done with the commands that used each block */
+
+		int numTimesteps;               /* how many GPU timesteps have been simulated */
+		SnapshotSlot snapshots[SNAPSHOT_RING_SIZE]; /* see setSnapshotCallback */
+		int nextSnapshot;               /* the slot the next snapshot is copied into, the oldest one in flight if there are any */
+		int snapshotInterval;
+		SnapshotCallback snapshotCallback;
+		void *snapshotUserData;
+		int droppedSnapshots;           /* how many snapshots were skipped because the whole ring was still in flight */
 	} internal;
 
 } Universe;
 
-/* Create a new universe with the given characteristics. */
-Universe createUniverse(int numParticleTypes, int numParticles, float width, float height);
+/* Create a new universe with the given characteristics.
+   The backend decides whether simulateTimestep runs on the GPU or on the CPU. */
+Universe createUniverse(int numParticleTypes, int numParticles, float width, float height, Backend backend);
 
 /* Destroy all the resources used by the universe. */
 void destroyUniverse(Universe *u);
 
+/* Allocate space for the given number of particles. Free it again with freeParticles(). */
+Particles allocParticles(int numParticles);
+
+/* Free particles allocated with allocParticles(). */
+void freeParticles(Particles *particles);
+
+/* Copy numParticles particles from src to dst. */
+void copyParticles(Particles *dst, const Particles *src, int numParticles);
+
+/* Set the number of threads that the CPU backend simulates with, and that updateBuffers sorts the particles with.
+   By default one thread per logical processor is used. */
+void setNumThreads(Universe *u, int numThreads);
+
+/* Set how the threads and the host-side particles are placed on NUMA machines. The particles are
+   copied to memory that is placed the new way, so call this after updateBuffers() when the number of
+   particles changes. With PLACEMENT_STRIPED each thread's band of tile rows is the contiguous range of
+   particles it moves in every pass, so only the halo rows at the edges of the bands are read across nodes.
+   By default PLACEMENT_DEFAULT is used. */
+void setPlacement(Universe *u, Placement placement);
+
 /* Get a pointer to the interaction of one particle type with another. */
 ParticleInteraction *getInteraction(Universe *u, int type1, int type2);
 
@@ -95,17 +307,82 @@ ParticleInteraction *getInteraction(Universe *u, int type1, int type2);
    You can control the RNG used by setting the universes .rng field before calling randomize. */
 void randomize(Universe *u, float attractionMean, float attractionStddev, float minRadius0, float minRadius1, float maxRadius0, float maxRadius1);
 
-/* This function sends the universe data to the GPU and it has to be called 
-   whenever particles, particle types, or interactions are changed. */
+/* Like randomize, but only draw new interactions and keep the particles where they are. Only the
+   interactions are sent to the GPU, unless the largest radius changes the tiles, see updateDirtyBuffers. */
+void randomizeInteractions(Universe *u, float attractionMean, float attractionStddev, float minRadius0, float minRadius1, float maxRadius0, float maxRadius1);
+
+/* This function sends all of the universe data to the GPU and it has to be called
+   whenever particles, particle types, or interactions are changed, unless the changes
+   are marked with markDirty and sent with updateDirtyBuffers instead.
+   Note that this sorts the particles by tile, so it changes their order. */
 void updateBuffers(Universe *u);
 
-/* Simulate a single timestep on the GPU. */
+/* Mark parts of the universe as changed on the host, see DirtyFlag. */
+void markDirty(Universe *u, int flags);
+
+/* Send only the parts of the universe that were marked with markDirty to the GPU. The GPU buffers have room
+   to grow, so they are only reallocated when they outgrow it, and otherwise just the part in use is written.
+   Changes to the number of particles or particle types, the size of the universe, tileDivisions, or the largest
+   interaction radius are picked up without being marked. If the tiles change while the particles weren't
+   marked, the particles are read back from the GPU to sort them into the new tiles. Like updateBuffers, this
+   changes the order of the particles when they are sent. */
+void updateDirtyBuffers(Universe *u);
+
+/* Run only the passes that calculate the offset of each tile in the tile-sorted particle array from the
+   tile capacities, and reset the capacities and sizes to 0. This also sorts the tiles that have particles in
+   them into the bins of the force pass, and with activeTiles set, builds the list of them for order_particles
+   when deterministic or typeSorted is set. This is the first thing a GPU timestep does. */
+void setupTiles(Universe *u);
+
+/* Simulate a single timestep on the GPU, or on the CPU if the universe was created with BACKEND_CPU.
+   With the CPU backend the particles always hold the state of the latest timestep. */
 void simulateTimestep(Universe *u);
 
+/* Send the per-timestep parameters to the UNIFORMS block used by all of the shaders.
+   simulateTimestep() does this by itself, so you only need this to draw or to run
+   individual passes without simulating a timestep first. */
+void updateUniforms(Universe *u);
+
 /* Render the universe. */
 void draw(Universe *u);
 
-/* Print the parameters of the universe for reproducability. */
+/* Look up the workgroup sizes that were tuned for the current device (GL_RENDERER and GL_VERSION) in the given
+   file, and use them. Returns 1 if the file had them, and 0 if the sizes were left as they are. */
+int loadWorkGroupSizes(Universe *u, const char *filename);
+
+/* Time each TunedPass with a couple of different workgroup sizes on the current device using timer queries,
+   use the fastest size for each, and add them to the given file for loadWorkGroupSizes (unless it's NULL).
+   This simulates timesteps, so set up the universe like it's going to run first. The particles are restored
+   with updateBuffers when it's done. Only for the GPU backend. */
+void autotuneWorkGroupSizes(Universe *u, const char *filename);
+
+/* Get the statistics of the GPU time of a stage over its latest STAGE_WINDOW timesteps. The times are read back
+   STAGE_QUERY_FRAMES - 1 timesteps late so that the CPU never waits for them, so the latest couple of timesteps
+   are missing. The count is 0 if timeStages is off or the stage hasn't run yet. */
+StageStats getStageStats(Universe *u, Stage stage);
+
+/* Also write the GPU time of each stage to a CSV file with a row for each timestep, as they are read back.
+   Pass NULL to stop writing. Returns 0 if the file couldn't be opened. */
+int setStageLog(Universe *u, const char *filename);
+
+/* Copy the particles back to the host every interval timesteps, and hand each copy to the callback once it has
+   arrived. A copy is made on the GPU right after the timestep, into the next buffer of a ring of SNAPSHOT_RING_SIZE
+   staging buffers, and a fence is put after it. simulateTimestep checks the fences without waiting for them, and
+   hands the snapshots whose copy is done to the callback in the order they were taken. If all of the staging
+   buffers are still in flight when a snapshot is due, it's skipped instead of waiting. Pass 0 as the interval to
+   stop taking snapshots. Only for the GPU backend, with the CPU backend the particles are always on the host. */
+void setSnapshotCallback(Universe *u, int interval, SnapshotCallback callback, void *userData);
+
+/* Hand the snapshots that have arrived to the callback. simulateTimestep does this by itself, so this is
+   only needed to get the latest snapshots after the last timestep. With wait set, this waits for all of
+   the snapshots that are still in flight, so that none of them are lost. */
+void collectSnapshots(Universe *u, int wait);
+
+/* Print the parameters of the universe for reproducability.
+   With the CPU backend this also prints how busy each thread was in the force pass since the last print,
+   and with countLanes set on the GPU backend how busy the lanes of the force pass were, and how many
+   of the pairs it evaluated were within the largest interaction radius. With timeStages set on the GPU
+   backend it also prints the minimum, mean and 99th percentile of the GPU time of each stage. */
 void printParams(Universe *u);
 
 #endif
\ No newline at end of file